@@ -100,12 +100,20 @@ struct Stream {
     int height;
     SpiceRect dest_area;
     int top_down;
+    int tiled; // the frames are parts of dest_area, see red_stream_detector_update
+    uint32_t tile_frame;    // video frame of the last tile, see red_stream_is_new_tile_frame
+    QRegion tile_frame_rgn; // the part of dest_area the tiles of that frame painted
+    uint64_t last_frame_hash;    // see red_stream_update_idle_time
+    red_time_t last_change_time; // of the last frame that differed from the previous one
+    int idle_upgraded;           // the repeated frame was sent lossless, see red_upgrade_idle_stream
     Stream *next;
     RingItem link;
 
     uint32_t num_input_frames;
     uint64_t input_fps_start_time;
     uint32_t input_fps;
+
+    MJpegFrameCache *frame_cache; // frames encoded for the clients, NULL with one client
 };
 
 #define STREAM_STATS
@@ -113,6 +121,10 @@ struct Stream {
 typedef struct StreamStats {
    uint64_t num_drops_pipe;
    uint64_t num_drops_fps;
+   uint64_t num_drops_pacer;
+   uint64_t num_drops_late;     // older than the latency of a low latency stream
+   uint64_t num_frames_skipped; // identical to the frame the client shows
+   uint64_t num_overlays;       // drawables shown over the stream, see red_stream_overlay_fits
    uint64_t num_frames_sent;
    uint64_t num_input_frames;
    uint64_t size_sent;
@@ -122,6 +134,16 @@ typedef struct StreamStats {
 } StreamStats;
 #endif
 
+/* a frame sent to a client, see red_stream_agent_is_frame_shown */
+typedef struct StreamSentFrame {
+    SpiceRect dest;
+    uint64_t hash; // 0 - the entry is free
+    int quality;   // the frame was encoded at, see mjpeg_encoder_get_last_frame_quality
+    int scale_shift;
+} StreamSentFrame;
+
+#define STREAM_AGENT_SENT_FRAMES 8
+
 typedef struct StreamAgent {
     QRegion vis_region; /* the part of the surface area that is currently occupied by video
                            fragments */
@@ -145,11 +167,62 @@ typedef struct StreamAgent {
 
     uint32_t report_id;
     uint32_t client_required_latency;
+
+    int64_t pacer_tokens; // bytes the frames may still take, see red_stream_pacer_admit
+    uint64_t pacer_last_time;
+
+    /* the tiles of a video frame of a tiled stream are sent or dropped together */
+    uint32_t tile_frame; // 0 - none yet
+    int tile_frame_dropped;
+
+    /* the last frames sent at different places, tiled streams have several */
+    StreamSentFrame sent_frames[STREAM_AGENT_SENT_FRAMES];
+    int next_sent_frame;
 #ifdef STREAM_STATS
     StreamStats stats;
 #endif
 } StreamAgent;
 
+/* adaptive image codec selection, see red_codec_select_quic */
+enum {
+    RED_CODEC_QUIC,
+    RED_CODEC_LZ, // LZ, GLZ or LZ4, whichever the compression mode uses
+    RED_CODEC_JPEG,
+    RED_CODEC_LAST,
+};
+
+/* content classes are the graduality levels low, medium and high */
+#define RED_CODEC_NUM_CLASSES 3
+#define RED_CODEC_NUM_JPEG_LEVELS 4
+
+typedef struct CodecEstimate {
+    double ratio;           // compressed size / original size
+    double cpu_ns_per_byte; // encoding time
+    uint32_t samples;
+} CodecEstimate;
+
+typedef struct CodecSelector {
+    int enabled;
+    CodecEstimate estimates[RED_CODEC_NUM_CLASSES][RED_CODEC_LAST];
+    uint32_t decisions[RED_CODEC_NUM_CLASSES];
+    CodecEstimate jpeg_estimates[RED_CODEC_NUM_JPEG_LEVELS];
+    double jpeg_input_size; // average size of the bitmaps compressed with jpeg
+    int jpeg_level;         // index in the jpeg quality levels
+} CodecSelector;
+
+/* levels the ZLIB_GLZ wrap picks from, the first one sends the GLZ data
+ * as is, see red_zlib_select_level */
+#define RED_ZLIB_NUM_LEVELS 5
+
+typedef struct ZlibLevelSelector {
+    CodecEstimate estimates[RED_ZLIB_NUM_LEVELS]; // ratio is zlib size / glz size
+    uint32_t decisions;
+    int level;                 // index in the levels of the last choice
+    uint32_t cpu_budget;       // percent of the time zlib may use
+    red_time_t window_start;   // start of the current budget window
+    uint64_t window_cpu_time;  // zlib time spent in the window
+} ZlibLevelSelector;
+
 struct DisplayChannelClient {
     CommonChannelClient common;
 
@@ -191,6 +264,16 @@ struct DisplayChannelClient {
     int use_mjpeg_encoder_rate_control;
     uint32_t streams_max_latency;
     uint64_t streams_max_bit_rate;
+
+    /* update rate cap: while a window is open, primary surface drawables are
+     * not queued; their bboxes are accumulated in update_damage and sent as
+     * images once the window expires */
+    uint32_t update_interval_ms; // 0 - no cap
+    red_time_t update_window_start;
+    QRegion update_damage;
+
+    CodecSelector codec_selector;
+    ZlibLevelSelector zlib_selector;
 };
 
 #endif /* RED_WORKER_CLIENT_H_ */
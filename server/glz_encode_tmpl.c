@@ -36,6 +36,7 @@
 #define ENCODE_PIXEL(e, pix) encode(e, (pix).a)   // gets the pixel and write only the needed bytes
                                                   // from the pixel
 #define SAME_PIXEL(pix1, pix2) ((pix1).a == (pix2).a)
+#define MATCH_LENGTH(ip, ref, n) glz_match_length_8((uint8_t *)(ip), (uint8_t *)(ref), n)
 #define MIN_REF_ENCODE_SIZE 4
 #define MAX_REF_ENCODE_SIZE 7
 #define HASH_FUNC(v, p) {  \
@@ -43,7 +44,7 @@
     DJB2_HASH(v, p[0].a);  \
     DJB2_HASH(v, p[1].a);  \
     DJB2_HASH(v, p[2].a);  \
-    v &= HASH_MASK;        \
+    v &= hash_mask;        \
     }
 #endif
 
@@ -53,6 +54,8 @@
 #define FNAME(name) glz_rgb_alpha_##name
 #define ENCODE_PIXEL(e, pix) {encode(e, (pix).pad);}
 #define SAME_PIXEL(pix1, pix2) ((pix1).pad == (pix2).pad)
+#define MATCH_LENGTH(ip, ref, n) glz_match_length_32((uint8_t *)(ip), (uint8_t *)(ref), n, \
+                                                     GUINT32_TO_LE(0xff000000))
 #define MIN_REF_ENCODE_SIZE 4
 #define MAX_REF_ENCODE_SIZE 7
 #define HASH_FUNC(v, p) {    \
@@ -60,7 +63,7 @@
     DJB2_HASH(v, p[0].pad);  \
     DJB2_HASH(v, p[1].pad);  \
     DJB2_HASH(v, p[2].pad);  \
-    v &= HASH_MASK;          \
+    v &= hash_mask;          \
     }
 #endif
 
@@ -72,6 +75,7 @@
 #define GET_g(pix) (((pix) >> 5) & 0x1f)
 #define GET_b(pix) ((pix) & 0x1f)
 #define ENCODE_PIXEL(e, pix) {encode(e, (pix) >> 8); encode(e, (pix) & 0xff);}
+#define MATCH_LENGTH(ip, ref, n) glz_match_length_16((uint8_t *)(ip), (uint8_t *)(ref), n, 0x7fff)
 #define MIN_REF_ENCODE_SIZE 2
 #define MAX_REF_ENCODE_SIZE 3
 #define HASH_FUNC(v, p) {                  \
@@ -82,7 +86,7 @@
     DJB2_HASH(v, (p[1] >> 8) & (0x007f));  \
     DJB2_HASH(v, p[2] & (0x00ff));         \
     DJB2_HASH(v, (p[2] >> 8) & (0x007f));  \
-    v &= HASH_MASK;                        \
+    v &= hash_mask;                        \
 }
 #endif
 
@@ -90,6 +94,8 @@
 #define PIXEL rgb24_pixel_t
 #define FNAME(name) glz_rgb24_##name
 #define ENCODE_PIXEL(e, pix) {encode(e, (pix).b); encode(e, (pix).g); encode(e, (pix).r);}
+#define MATCH_LENGTH(ip, ref, n) (glz_match_length_8((uint8_t *)(ip), (uint8_t *)(ref), \
+                                                     (n) * 3) / 3)
 #define MIN_REF_ENCODE_SIZE 2
 #define MAX_REF_ENCODE_SIZE 2
 #endif
@@ -98,6 +104,8 @@
 #define PIXEL rgb32_pixel_t
 #define FNAME(name) glz_rgb32_##name
 #define ENCODE_PIXEL(e, pix) {encode(e, (pix).b); encode(e, (pix).g); encode(e, (pix).r);}
+#define MATCH_LENGTH(ip, ref, n) glz_match_length_32((uint8_t *)(ip), (uint8_t *)(ref), n, \
+                                                     GUINT32_TO_LE(0x00ffffff))
 #define MIN_REF_ENCODE_SIZE 2
 #define MAX_REF_ENCODE_SIZE 2
 #endif
@@ -118,7 +126,7 @@
     DJB2_HASH(v, p[2].r);    \
     DJB2_HASH(v, p[2].g);    \
     DJB2_HASH(v, p[2].b);    \
-    v &= HASH_MASK;          \
+    v &= hash_mask;          \
     }
 #endif
 
@@ -211,14 +219,14 @@ static inline size_t FNAME(do_match)(SharedDictionary *dict,
     } else { // the ref is at different image - encode offset from the image start
 #ifndef LZ_PLT
         *o_pix_distance = PIXEL_DIST(ref, ref_seg,
-                                     (PIXEL *)(dict->window.segs[ref_seg->image->first_seg].lines),
-                                     &dict->window.segs[ref_seg->image->first_seg]
+                                     (PIXEL *)(WINDOW_SEG(dict, ref_seg->image->first_seg)->lines),
+                                     WINDOW_SEG(dict, ref_seg->image->first_seg)
                                      );
 #else
         // in bytes
         *o_pix_distance = PIXEL_DIST(ref, ref_seg,
-                                     (PIXEL *)(dict->window.segs[ref_seg->image->first_seg].lines),
-                                     &dict->window.segs[ref_seg->image->first_seg],
+                                     (PIXEL *)(WINDOW_SEG(dict, ref_seg->image->first_seg)->lines),
+                                     WINDOW_SEG(dict, ref_seg->image->first_seg),
                                      pix_per_byte);
 #endif
     }
@@ -230,13 +238,8 @@ static inline size_t FNAME(do_match)(SharedDictionary *dict,
 
 
     /* continue the match*/
-    while ((tmp_ip < ip_limit) && (tmp_ref < ref_limit)) {
-        if (!SAME_PIXEL(*tmp_ref, *tmp_ip)) {
-            break;
-        } else {
-            tmp_ref++;
-            tmp_ip++;
-        }
+    if ((tmp_ip < ip_limit) && (tmp_ref < ref_limit)) {
+        tmp_ip += MATCH_LENGTH(tmp_ip, tmp_ref, MIN(ip_limit - tmp_ip, ref_limit - tmp_ref));
     }
 
 
@@ -267,10 +270,12 @@ static inline size_t FNAME(do_match)(SharedDictionary *dict,
 */
 static void FNAME(compress_seg)(Encoder *encoder, uint32_t seg_idx, PIXEL *from, int copied)
 {
-    WindowImageSegment *seg = &encoder->dict->window.segs[seg_idx];
+    WindowImageSegment *seg = WINDOW_SEG(encoder->dict, seg_idx);
     const PIXEL *ip = from;
     const PIXEL *ip_bound = (PIXEL *)(seg->lines_end) - BOUND_OFFSET;
     const PIXEL *ip_limit = (PIXEL *)(seg->lines_end) - LIMIT_OFFSET;
+    const uint32_t hash_mask = encoder->dict->hash_mask;
+    const uint32_t chain_size = 1 << encoder->dict->hash_chain_log;
     int hval;
     int copy = copied;
 #ifdef  LZ_PLT
@@ -290,20 +295,16 @@ static void FNAME(compress_seg)(Encoder *encoder, uint32_t seg_idx, PIXEL *from,
         const PIXEL            *ref;
         const PIXEL            *ref_limit;
         WindowImageSegment     *ref_seg;
-        uint32_t ref_seg_idx;
-        size_t pix_dist;
-        size_t image_dist;
+        HashEntry              *chain;
+        HashEntry ref_entry;
+        uint32_t hash_id;
+        size_t pix_dist = 0;
+        size_t image_dist = 0;
         /* minimum match length */
         size_t len = 0;
 
         /* comparison starting-point */
         const PIXEL            *anchor = ip;
-#ifdef CHAINED_HASH
-        int hash_id = 0;
-        size_t best_len = 0;
-        size_t best_pix_dist = 0;
-        size_t best_image_dist = 0;
-#endif
 
         /* check for a run */
 
@@ -338,44 +339,32 @@ static void FNAME(compress_seg)(Encoder *encoder, uint32_t seg_idx, PIXEL *from,
         /* find potential match */
         HASH_FUNC(hval, ip);
 
-#ifdef CHAINED_HASH
-        for (hash_id = 0; hash_id < HASH_CHAIN_SIZE; hash_id++) {
-            ref_seg_idx = encoder->dict->htab[hval][hash_id].image_seg_idx;
-#else
-        ref_seg_idx = encoder->dict->htab[hval].image_seg_idx;
-#endif
-            ref_seg = encoder->dict->window.segs + ref_seg_idx;
+        chain = encoder->dict->htab + ((uint32_t)hval << encoder->dict->hash_chain_log);
+        for (hash_id = 0; hash_id < chain_size; hash_id++) {
+            size_t cur_len, cur_pix_dist, cur_image_dist;
+
+            ref_entry = HASH_ENTRY_LOAD(chain[hash_id]);
+            ref_seg = WINDOW_SEG(encoder->dict, HASH_ENTRY_SEG(ref_entry));
             if (REF_SEG_IS_VALID(encoder->dict, encoder->id,
                                  ref_seg, seg)) {
-#ifdef CHAINED_HASH
-                ref = ((PIXEL *)ref_seg->lines) + encoder->dict->htab[hval][hash_id].ref_pix_idx;
-#else
-                ref = ((PIXEL *)ref_seg->lines) + encoder->dict->htab[hval].ref_pix_idx;
-#endif
+                ref = ((PIXEL *)ref_seg->lines) + HASH_ENTRY_PIX(ref_entry);
                 ref_limit = (PIXEL *)ref_seg->lines_end;
 
-                len = FNAME(do_match)(encoder->dict, ref_seg, ref, ref_limit, seg, ip, ip_bound,
+                cur_len = FNAME(do_match)(encoder->dict, ref_seg, ref, ref_limit, seg, ip,
+                                          ip_bound,
 #ifdef  LZ_PLT
-                                      pix_per_byte,
+                                          pix_per_byte,
 #endif
-                                      &image_dist, &pix_dist);
+                                          &cur_image_dist, &cur_pix_dist);
 
-#ifdef CHAINED_HASH
                 // TODO. not compare len but rather len - encode_size
-                if (len > best_len) {
-                    best_len = len;
-                    best_pix_dist = pix_dist;
-                    best_image_dist = image_dist;
+                if (cur_len > len) {
+                    len = cur_len;
+                    pix_dist = cur_pix_dist;
+                    image_dist = cur_image_dist;
                 }
-#endif
             }
-
-#ifdef CHAINED_HASH
         } // end chain loop
-        len = best_len;
-        pix_dist = best_pix_dist;
-        image_dist = best_image_dist;
-#endif
 
         /* update hash table */
         UPDATE_HASH(encoder->dict, hval, seg_idx, anchor - ((PIXEL *)seg->lines));
@@ -500,34 +489,35 @@ static void FNAME(compress)(Encoder *encoder)
     uint32_t seg_id = encoder->cur_image.first_win_seg;
     PIXEL    *ip;
     SharedDictionary *dict = encoder->dict;
+    const uint32_t hash_mask = dict->hash_mask;
     int hval;
 
     // fetch the first image segment that is not too small
     while ((seg_id != NULL_IMAGE_SEG_ID) &&
-           (dict->window.segs[seg_id].image->id == encoder->cur_image.id) &&
-           ((((PIXEL *)dict->window.segs[seg_id].lines_end) -
-             ((PIXEL *)dict->window.segs[seg_id].lines)) < 4)) {
+           (WINDOW_SEG(dict, seg_id)->image->id == encoder->cur_image.id) &&
+           ((((PIXEL *)WINDOW_SEG(dict, seg_id)->lines_end) -
+             ((PIXEL *)WINDOW_SEG(dict, seg_id)->lines)) < 4)) {
         // coping the segment
-        if (dict->window.segs[seg_id].lines != dict->window.segs[seg_id].lines_end) {
-            ip = (PIXEL *)dict->window.segs[seg_id].lines;
+        if (WINDOW_SEG(dict, seg_id)->lines != WINDOW_SEG(dict, seg_id)->lines_end) {
+            ip = (PIXEL *)WINDOW_SEG(dict, seg_id)->lines;
             // Note: we assume MAX_COPY > 3
             encode_copy_count(encoder, (uint8_t)(
-                                  (((PIXEL *)dict->window.segs[seg_id].lines_end) -
-                                   ((PIXEL *)dict->window.segs[seg_id].lines)) - 1));
-            while (ip < (PIXEL *)dict->window.segs[seg_id].lines_end) {
+                                  (((PIXEL *)WINDOW_SEG(dict, seg_id)->lines_end) -
+                                   ((PIXEL *)WINDOW_SEG(dict, seg_id)->lines)) - 1));
+            while (ip < (PIXEL *)WINDOW_SEG(dict, seg_id)->lines_end) {
                 ENCODE_PIXEL(encoder, *ip);
                 ip++;
             }
         }
-        seg_id = dict->window.segs[seg_id].next;
+        seg_id = WINDOW_SEG(dict, seg_id)->next;
     }
 
     if ((seg_id == NULL_IMAGE_SEG_ID) ||
-        (dict->window.segs[seg_id].image->id != encoder->cur_image.id)) {
+        (WINDOW_SEG(dict, seg_id)->image->id != encoder->cur_image.id)) {
         return;
     }
 
-    ip = (PIXEL *)dict->window.segs[seg_id].lines;
+    ip = (PIXEL *)WINDOW_SEG(dict, seg_id)->lines;
 
 
     encode_copy_count(encoder, MAX_COPY - 1);
@@ -546,11 +536,11 @@ static void FNAME(compress)(Encoder *encoder)
     FNAME(compress_seg)(encoder, seg_id, ip, 2);
 
     // compressing the next segments
-    for (seg_id = dict->window.segs[seg_id].next;
+    for (seg_id = WINDOW_SEG(dict, seg_id)->next;
         seg_id != NULL_IMAGE_SEG_ID && (
-        dict->window.segs[seg_id].image->id == encoder->cur_image.id);
-        seg_id = dict->window.segs[seg_id].next) {
-        FNAME(compress_seg)(encoder, seg_id, (PIXEL *)dict->window.segs[seg_id].lines, 0);
+        WINDOW_SEG(dict, seg_id)->image->id == encoder->cur_image.id);
+        seg_id = WINDOW_SEG(dict, seg_id)->next) {
+        FNAME(compress_seg)(encoder, seg_id, (PIXEL *)WINDOW_SEG(dict, seg_id)->lines, 0);
     }
 }
 
@@ -560,6 +550,7 @@ static void FNAME(compress)(Encoder *encoder)
 #undef PIXEL
 #undef ENCODE_PIXEL
 #undef SAME_PIXEL
+#undef MATCH_LENGTH
 #undef HASH_FUNC
 #undef GET_r
 #undef GET_g
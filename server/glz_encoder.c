@@ -21,6 +21,10 @@
 #include <glib.h>
 #include <pthread.h>
 #include <stdio.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include "glz_encoder.h"
 #include "glz_encoder_dictionary_protected.h"
 
@@ -168,6 +172,86 @@ void glz_encoder_destroy(GlzEncoderContext *opaque_encoder)
 #endif
 
 
+/*
+ * Match length search: the number of leading pixels of a and b that are equal,
+ * up to n. Pixels compare equal when the bits of mask are, like SAME_PIXEL.
+ * With SSE2, 16 bytes are compared at a time.
+ */
+static inline size_t glz_match_length_8(const uint8_t *a, const uint8_t *b, size_t n)
+{
+    size_t i = 0;
+
+#ifdef __SSE2__
+    for (; i + 16 <= n; i += 16) {
+        __m128i eq = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(a + i)),
+                                    _mm_loadu_si128((const __m128i *)(b + i)));
+        unsigned int diff = ~_mm_movemask_epi8(eq) & 0xffff;
+        if (diff) {
+            return i + __builtin_ctz(diff);
+        }
+    }
+#endif
+    for (; i < n && a[i] == b[i]; i++) {
+    }
+    return i;
+}
+
+static inline size_t glz_match_length_16(const uint8_t *a, const uint8_t *b, size_t n,
+                                         uint16_t mask)
+{
+    uint16_t pix_a, pix_b;
+    size_t i = 0;
+
+#ifdef __SSE2__
+    const __m128i mask_v = _mm_set1_epi16(mask);
+
+    for (; i + 8 <= n; i += 8) {
+        __m128i va = _mm_and_si128(_mm_loadu_si128((const __m128i *)(a + i * 2)), mask_v);
+        __m128i vb = _mm_and_si128(_mm_loadu_si128((const __m128i *)(b + i * 2)), mask_v);
+        unsigned int diff = ~_mm_movemask_epi8(_mm_cmpeq_epi16(va, vb)) & 0xffff;
+        if (diff) {
+            return i + __builtin_ctz(diff) / 2;
+        }
+    }
+#endif
+    for (; i < n; i++) {
+        memcpy(&pix_a, a + i * 2, 2);
+        memcpy(&pix_b, b + i * 2, 2);
+        if ((pix_a ^ pix_b) & mask) {
+            break;
+        }
+    }
+    return i;
+}
+
+static inline size_t glz_match_length_32(const uint8_t *a, const uint8_t *b, size_t n,
+                                         uint32_t mask)
+{
+    uint32_t pix_a, pix_b;
+    size_t i = 0;
+
+#ifdef __SSE2__
+    const __m128i mask_v = _mm_set1_epi32(mask);
+
+    for (; i + 4 <= n; i += 4) {
+        __m128i va = _mm_and_si128(_mm_loadu_si128((const __m128i *)(a + i * 4)), mask_v);
+        __m128i vb = _mm_and_si128(_mm_loadu_si128((const __m128i *)(b + i * 4)), mask_v);
+        unsigned int diff = ~_mm_movemask_epi8(_mm_cmpeq_epi32(va, vb)) & 0xffff;
+        if (diff) {
+            return i + __builtin_ctz(diff) / 4;
+        }
+    }
+#endif
+    for (; i < n; i++) {
+        memcpy(&pix_a, a + i * 4, 4);
+        memcpy(&pix_b, b + i * 4, 4);
+        if ((pix_a ^ pix_b) & mask) {
+            break;
+        }
+    }
+    return i;
+}
+
 typedef uint8_t BYTE;
 
 typedef struct __attribute__ ((__packed__)) one_byte_pixel_t {
@@ -52,20 +52,23 @@ static int glz_dictionary_window_create(SharedDictionary *dict, uint32_t size)
     }
 
     dict->window.size_limit = size;
-    dict->window.segs = (WindowImageSegment *)(
-            dict->cur_usr->malloc(dict->cur_usr, sizeof(WindowImageSegment) * INIT_IMAGE_SEGS_NUM));
+    memset(dict->window.segs_blocks, 0, sizeof(dict->window.segs_blocks));
+    dict->window.segs_blocks[0] = (WindowImageSegment *)(
+            dict->cur_usr->malloc(dict->cur_usr,
+                                  sizeof(WindowImageSegment) * IMAGE_SEGS_BLOCK_SIZE));
 
-    if (!dict->window.segs) {
+    if (!dict->window.segs_blocks[0]) {
         return FALSE;
     }
 
-    dict->window.segs_quota = INIT_IMAGE_SEGS_NUM;
+    dict->window.segs_quota = IMAGE_SEGS_BLOCK_SIZE;
 
     dict->window.encoders_heads = (uint32_t *)dict->cur_usr->malloc(dict->cur_usr,
                                                             sizeof(uint32_t) * dict->max_encoders);
 
     if (!dict->window.encoders_heads) {
-        dict->cur_usr->free(dict->cur_usr, dict->window.segs);
+        dict->cur_usr->free(dict->cur_usr, dict->window.segs_blocks[0]);
+        dict->window.segs_blocks[0] = NULL;
         return FALSE;
     }
 
@@ -77,25 +80,41 @@ static int glz_dictionary_window_create(SharedDictionary *dict, uint32_t size)
     return TRUE;
 }
 
-/* initializes an empty window (segs and encoder_heads should be pre allocated.
-   resets the image infos, and calls the free_image usr callback*/
-static void glz_dictionary_window_reset(SharedDictionary *dict)
+/* resets the segments [first_seg, first_seg + IMAGE_SEGS_BLOCK_SIZE) of a block
+   and chains them in front of next_free */
+static void __glz_dictionary_window_reset_segs_block(WindowImageSegment *block,
+                                                     uint32_t first_seg, uint32_t next_free)
 {
+    WindowImageSegment *seg;
     uint32_t i;
-    WindowImageSegment *seg, *last_seg;
 
-    last_seg = dict->window.segs + dict->window.segs_quota;
-    /* reset free segs list */
-    dict->window.free_segs_head = 0;
-    for (seg = dict->window.segs, i = 0; seg < last_seg; seg++, i++) {
-        seg->next = i + 1;
+    for (seg = block, i = first_seg + 1; seg < block + IMAGE_SEGS_BLOCK_SIZE; seg++, i++) {
+        seg->next = i;
         seg->image = NULL;
         seg->lines = NULL;
         seg->lines_end = NULL;
         seg->pixels_num = 0;
         seg->pixels_so_far = 0;
     }
-    dict->window.segs[dict->window.segs_quota - 1].next = NULL_IMAGE_SEG_ID;
+    block[IMAGE_SEGS_BLOCK_SIZE - 1].next = next_free;
+}
+
+/* initializes an empty window (segs and encoder_heads should be pre allocated.
+   resets the image infos, and calls the free_image usr callback*/
+static void glz_dictionary_window_reset(SharedDictionary *dict)
+{
+    uint32_t i;
+    uint32_t num_blocks = dict->window.segs_quota >> IMAGE_SEGS_BLOCK_SIZE_LOG;
+
+    /* reset free segs list, the blocks are chained in order */
+    dict->window.free_segs_head = 0;
+    for (i = 0; i < num_blocks; i++) {
+        __glz_dictionary_window_reset_segs_block(dict->window.segs_blocks[i],
+                                                 i << IMAGE_SEGS_BLOCK_SIZE_LOG,
+                                                 (i + 1 < num_blocks) ?
+                                                 (i + 1) << IMAGE_SEGS_BLOCK_SIZE_LOG :
+                                                 NULL_IMAGE_SEG_ID);
+    }
 
     dict->window.used_segs_head = NULL_IMAGE_SEG_ID;
     dict->window.used_segs_tail = NULL_IMAGE_SEG_ID;
@@ -110,19 +129,68 @@ static void glz_dictionary_window_reset(SharedDictionary *dict)
 
 static inline void glz_dictionary_reset_hash(SharedDictionary *dict)
 {
-    memset(dict->htab, 0, sizeof(HashEntry) * HASH_SIZE * HASH_CHAIN_SIZE);
-#ifdef CHAINED_HASH
-    memset(dict->htab_counter, 0, HASH_SIZE * sizeof(uint8_t));
-#endif
+    memset(dict->htab, 0, sizeof(HashEntry) * (dict->hash_mask + 1) << dict->hash_chain_log);
+    if (dict->htab_counter) {
+        memset(dict->htab_counter, 0, (dict->hash_mask + 1) * sizeof(uint8_t));
+    }
+}
+
+static inline void glz_dictionary_free_hash(SharedDictionary *dict)
+{
+    if (dict->htab) {
+        dict->cur_usr->free(dict->cur_usr, dict->htab);
+        dict->htab = NULL;
+    }
+    if (dict->htab_counter) {
+        dict->cur_usr->free(dict->cur_usr, dict->htab_counter);
+        dict->htab_counter = NULL;
+    }
+}
+
+/* allocate the hash (no reset) */
+static int glz_dictionary_alloc_hash(SharedDictionary *dict, uint32_t hash_size_log,
+                                     uint32_t hash_chain_log)
+{
+    HashEntry *htab;
+    uint8_t *htab_counter = NULL;
+
+    if (hash_size_log < GLZ_ENC_DICT_HASH_SIZE_LOG_MIN ||
+        hash_size_log > GLZ_ENC_DICT_HASH_SIZE_LOG_MAX ||
+        hash_chain_log > GLZ_ENC_DICT_HASH_CHAIN_LOG_MAX) {
+        return FALSE;
+    }
+
+    htab = (HashEntry *)dict->cur_usr->malloc(dict->cur_usr,
+                                              sizeof(HashEntry) << (hash_size_log +
+                                                                    hash_chain_log));
+    if (!htab) {
+        return FALSE;
+    }
+    if (hash_chain_log) {
+        htab_counter = (uint8_t *)dict->cur_usr->malloc(dict->cur_usr, 1 << hash_size_log);
+        if (!htab_counter) {
+            dict->cur_usr->free(dict->cur_usr, htab);
+            return FALSE;
+        }
+    }
+
+    glz_dictionary_free_hash(dict);
+    dict->htab = htab;
+    dict->htab_counter = htab_counter;
+    dict->hash_mask = (1 << hash_size_log) - 1;
+    dict->hash_chain_log = hash_chain_log;
+    return TRUE;
 }
 
 static inline void glz_dictionary_window_destroy(SharedDictionary *dict)
 {
+    uint32_t i;
+
     __glz_dictionary_window_reset_images(dict);
 
-    if (dict->window.segs) {
-        dict->cur_usr->free(dict->cur_usr, dict->window.segs);
-        dict->window.segs = NULL;
+    for (i = 0; i < MAX_IMAGE_SEGS_BLOCKS && dict->window.segs_blocks[i]; i++) {
+        dict->cur_usr->free(dict->cur_usr, dict->window.segs_blocks[i]);
+        dict->window.segs_blocks[i] = NULL;
     }
 
     while (dict->window.free_images) {
@@ -159,12 +227,19 @@ GlzEncDictContext *glz_enc_dictionary_create(uint32_t size, uint32_t max_encoder
     dict->max_encoders = max_encoders;
 
     pthread_mutex_init(&dict->lock, NULL);
-    pthread_rwlock_init(&dict->rw_alloc_lock, NULL);
 
     dict->window.encoders_heads = NULL;
+    dict->htab = NULL;
+    dict->htab_counter = NULL;
+
+    if (!glz_dictionary_alloc_hash(dict, GLZ_ENC_DICT_HASH_SIZE_LOG_DEFAULT, 0)) {
+        dict->cur_usr->free(usr, dict);
+        return NULL;
+    }
 
     // alloc window fields and reset
     if (!glz_dictionary_window_create(dict, size)) {
+        glz_dictionary_free_hash(dict);
         dict->cur_usr->free(usr, dict);
         return NULL;
     }
@@ -211,6 +286,20 @@ void glz_enc_dictionary_reset(GlzEncDictContext *opaque_dict, GlzEncoderUsrConte
     glz_dictionary_reset_hash(dict);
 }
 
+int glz_enc_dictionary_set_hash(GlzEncDictContext *opaque_dict, uint32_t hash_size_log,
+                                uint32_t hash_chain_log, GlzEncoderUsrContext *usr)
+{
+    SharedDictionary *dict = (SharedDictionary *)opaque_dict;
+    dict->cur_usr = usr;
+    GLZ_ASSERT(dict->cur_usr, opaque_dict);
+
+    if (!glz_dictionary_alloc_hash(dict, hash_size_log, hash_chain_log)) {
+        return FALSE;
+    }
+    glz_dictionary_reset_hash(dict);
+    return TRUE;
+}
+
 void glz_enc_dictionary_destroy(GlzEncDictContext *opaque_dict, GlzEncoderUsrContext *usr)
 {
     SharedDictionary *dict = (SharedDictionary *)opaque_dict;
@@ -221,9 +310,9 @@ void glz_enc_dictionary_destroy(GlzEncDictContext *opaque_dict, GlzEncoderUsrCon
 
     dict->cur_usr = usr;
     glz_dictionary_window_destroy(dict);
+    glz_dictionary_free_hash(dict);
 
     pthread_mutex_destroy(&dict->lock);
-    pthread_rwlock_destroy(&dict->rw_alloc_lock);
 
     dict->cur_usr->free(dict->cur_usr, dict);
 }
@@ -264,48 +353,33 @@ static inline int __get_pixels_num(LzImageType image_type, unsigned int num_line
     }
 }
 
-static void __glz_dictionary_window_segs_realloc(SharedDictionary *dict)
+/* Adds a block of segments to the free list. The existing segments don't move, so
+   the encoders that are in the middle of an encoding are not disturbed. */
+static void __glz_dictionary_window_segs_grow(SharedDictionary *dict)
 {
-    WindowImageSegment *new_segs;
-    uint32_t new_quota = (MAX_IMAGE_SEGS_NUM < (dict->window.segs_quota * 2)) ?
-        MAX_IMAGE_SEGS_NUM : (dict->window.segs_quota * 2);
-    WindowImageSegment *seg;
-    uint32_t i;
+    WindowImageSegment *new_block;
+    uint32_t block_id = dict->window.segs_quota >> IMAGE_SEGS_BLOCK_SIZE_LOG;
 
-    pthread_rwlock_wrlock(&dict->rw_alloc_lock);
-
-    if (dict->window.segs_quota == MAX_IMAGE_SEGS_NUM) {
+    if (block_id == MAX_IMAGE_SEGS_BLOCKS) {
         dict->cur_usr->error(dict->cur_usr, "overflow in image segments window\n");
     }
 
-    new_segs = (WindowImageSegment*)dict->cur_usr->malloc(
-            dict->cur_usr, sizeof(WindowImageSegment) * new_quota);
+    new_block = (WindowImageSegment*)dict->cur_usr->malloc(
+            dict->cur_usr, sizeof(WindowImageSegment) * IMAGE_SEGS_BLOCK_SIZE);
 
-    if (!new_segs) {
+    if (!new_block) {
         dict->cur_usr->error(dict->cur_usr,
                              "realloc of dictionary window failed\n");
     }
 
-    memcpy(new_segs, dict->window.segs,
-           sizeof(WindowImageSegment) * dict->window.segs_quota);
-
-    // resetting the new elements
-    for (i = dict->window.segs_quota, seg = new_segs + i; i < new_quota; i++, seg++) {
-        seg->image = NULL;
-        seg->lines = NULL;
-        seg->lines_end = NULL;
-        seg->pixels_num = 0;
-        seg->pixels_so_far = 0;
-        seg->next = i + 1;
-    }
-    new_segs[new_quota - 1].next = dict->window.free_segs_head;
+    __glz_dictionary_window_reset_segs_block(new_block, dict->window.segs_quota,
+                                             dict->window.free_segs_head);
     dict->window.free_segs_head = dict->window.segs_quota;
 
-    dict->cur_usr->free(dict->cur_usr, dict->window.segs);
-    dict->window.segs = new_segs;
-    dict->window.segs_quota = new_quota;
-
-    pthread_rwlock_unlock(&dict->rw_alloc_lock);
+    // the hash entries that refer to the new segments are published with a release
+    // store after this one, see UPDATE_HASH
+    __atomic_store_n(&dict->window.segs_blocks[block_id], new_block, __ATOMIC_RELEASE);
+    dict->window.segs_quota += IMAGE_SEGS_BLOCK_SIZE;
 }
 
 /* NOTE - it also updates the used_images_list*/
@@ -343,13 +417,13 @@ static uint32_t __glz_dictionary_window_alloc_image_seg(SharedDictionary *dict)
 
     // TODO: when is it best to realloc? when full or when half full?
     if (dict->window.free_segs_head == NULL_IMAGE_SEG_ID) {
-        __glz_dictionary_window_segs_realloc(dict);
+        __glz_dictionary_window_segs_grow(dict);
     }
 
     GLZ_ASSERT(dict->cur_usr, dict->window.free_segs_head != NULL_IMAGE_SEG_ID);
 
     seg_id = dict->window.free_segs_head;
-    seg = dict->window.segs + seg_id;
+    seg = WINDOW_SEG(dict, seg_id);
     dict->window.free_segs_head = seg->next;
 
     return seg_id;
@@ -377,13 +451,13 @@ static inline void __glz_dictionary_window_free_image_segs(SharedDictionary *dic
     dict->window.free_segs_head = image->first_seg;
 
     // retrieving the last segment of the image
-    for (seg_id = image->first_seg, next_seg_id = dict->window.segs[seg_id].next;
-         (next_seg_id != NULL_IMAGE_SEG_ID) && (dict->window.segs[next_seg_id].image == image);
-         seg_id = next_seg_id, next_seg_id = dict->window.segs[seg_id].next) {
+    for (seg_id = image->first_seg, next_seg_id = WINDOW_SEG(dict, seg_id)->next;
+         (next_seg_id != NULL_IMAGE_SEG_ID) && (WINDOW_SEG(dict, next_seg_id)->image == image);
+         seg_id = next_seg_id, next_seg_id = WINDOW_SEG(dict, seg_id)->next) {
     }
 
     // concatenate the free list
-    dict->window.segs[seg_id].next = old_free_head;
+    WINDOW_SEG(dict, seg_id)->next = old_free_head;
 }
 
 /* Returns the logical head of the window after we add an image with the give size to its tail.
@@ -409,10 +483,10 @@ static WindowImage *glz_dictionary_window_get_new_head(SharedDictionary *dict, i
     GLZ_ASSERT(dict->cur_usr, dict->window.used_segs_tail != NULL_IMAGE_SEG_ID);
 
     // used_segs_head is the latest logical head (the physical head may preceed it)
-    cur_head = dict->window.segs[dict->window.used_segs_head].image;
-    cur_win_size = dict->window.segs[dict->window.used_segs_tail].pixels_num +
-        dict->window.segs[dict->window.used_segs_tail].pixels_so_far -
-        dict->window.segs[dict->window.used_segs_head].pixels_so_far;
+    cur_head = WINDOW_SEG(dict, dict->window.used_segs_head)->image;
+    cur_win_size = WINDOW_SEG(dict, dict->window.used_segs_tail)->pixels_num +
+        WINDOW_SEG(dict, dict->window.used_segs_tail)->pixels_so_far -
+        WINDOW_SEG(dict, dict->window.used_segs_head)->pixels_so_far;
 
     while ((cur_win_size + new_image_size) > dict->window.size_limit) {
         GLZ_ASSERT(dict->cur_usr, cur_head);
@@ -463,7 +537,7 @@ static uint32_t glz_dictionary_window_alloc_image_seg(SharedDictionary *dict, Wi
                                                       uint8_t *lines, unsigned int num_lines)
 {
     uint32_t seg_id = __glz_dictionary_window_alloc_image_seg(dict);
-    WindowImageSegment *seg = &dict->window.segs[seg_id];
+    WindowImageSegment *seg = WINDOW_SEG(dict, seg_id);
 
     seg->image = image;
     seg->lines = lines;
@@ -509,7 +583,7 @@ static WindowImage *glz_dictionary_window_add_image(SharedDictionary *dict, LzIm
         if (row == 0) {
             image->first_seg = seg_id;
         } else {
-            dict->window.segs[prev_seg_id].next = seg_id;
+            WINDOW_SEG(dict, prev_seg_id)->next = seg_id;
         }
 
         row += num_lines;
@@ -539,7 +613,7 @@ static WindowImage *glz_dictionary_window_add_image(SharedDictionary *dict, LzIm
         // For the other thread that may read 'next' of the old tail, NULL_IMAGE_SEG_ID
         // is equivalent to a segment with an image id that is different
         // from the image id of the tail, so we don't need to further protect this field.
-        dict->window.segs[prev_tail].next = image->first_seg;
+        WINDOW_SEG(dict, prev_tail)->next = image->first_seg;
         dict->window.used_segs_tail = seg_id;
     }
     image->is_alive = TRUE;
@@ -586,7 +660,6 @@ WindowImage *glz_dictionary_pre_encode(uint32_t encoder_id, GlzEncoderUsrContext
 
     // update encoders head  (the other heads were already updated)
     pthread_mutex_unlock(&dict->lock);
-    pthread_rwlock_rdlock(&dict->rw_alloc_lock);
     return ret;
 }
 
@@ -597,7 +670,6 @@ void glz_dictionary_post_encode(uint32_t encoder_id, GlzEncoderUsrContext *usr,
     uint32_t early_head_seg = NULL_IMAGE_SEG_ID;
     uint32_t this_encoder_head_seg;
 
-    pthread_rwlock_unlock(&dict->rw_alloc_lock);
     pthread_mutex_lock(&dict->lock);
     dict->cur_usr = usr;
 
@@ -624,7 +696,7 @@ void glz_dictionary_post_encode(uint32_t encoder_id, GlzEncoderUsrContext *usr,
         GLZ_ASSERT(dict->cur_usr,
                    this_encoder_head_seg == dict->window.used_images_head->first_seg);
         glz_dictionary_window_remove_head(dict, encoder_id,
-                                          dict->window.segs[early_head_seg].image);
+                                          WINDOW_SEG(dict, early_head_seg)->image);
     }
 
 
@@ -37,6 +37,14 @@ typedef struct GlzEncDictRestoreData {
     uint64_t last_image_id;
 } GlzEncDictRestoreData;
 
+/* The geometry of the hash table that finds the matches: 1 << hash_size_log chains of
+   1 << hash_chain_log references. Longer chains find longer matches but encode slower.
+   The decoder doesn't depend on it. */
+#define GLZ_ENC_DICT_HASH_SIZE_LOG_DEFAULT 20
+#define GLZ_ENC_DICT_HASH_SIZE_LOG_MIN 12
+#define GLZ_ENC_DICT_HASH_SIZE_LOG_MAX 22
+#define GLZ_ENC_DICT_HASH_CHAIN_LOG_MAX 3
+
 /* size        : maximal number of pixels occupying the window
    max_encoders: maximal number of encoders that use the dictionary
    usr         : callbacks */
@@ -61,6 +69,12 @@ GlzEncDictContext *glz_enc_dictionary_restore(GlzEncDictRestoreData *restore_dat
 /*  NOTE - you should use this routine only when no encoder uses the dictionary. */
 void glz_enc_dictionary_reset(GlzEncDictContext *opaque_dict, GlzEncoderUsrContext *usr);
 
+/* changes the hash geometry and resets the hash. Returns FALSE, leaving the hash as is, if
+   the geometry is out of range or can't be allocated.
+   NOTE - you should use this routine only when no encoder uses the dictionary. */
+int glz_enc_dictionary_set_hash(GlzEncDictContext *opaque_dict, uint32_t hash_size_log,
+                                uint32_t hash_chain_log, GlzEncoderUsrContext *usr);
+
 /* image: the context returned by the encoder when the image was encoded.
    NOTE - you should use this routine only when no encoder uses the dictionary.*/
 void glz_enc_dictionary_remove_image(GlzEncDictContext *opaque_dict,
@@ -25,21 +25,6 @@ typedef struct WindowImage WindowImage;
 typedef struct WindowImageSegment WindowImageSegment;
 
 
-//#define CHAINED_HASH
-
-#ifdef CHAINED_HASH
-#define HASH_SIZE_LOG 16
-#define HASH_CHAIN_SIZE 4
-#else
-#define HASH_SIZE_LOG 20
-#define HASH_CHAIN_SIZE 1
-#endif
-
-#define HASH_SIZE (1 << HASH_SIZE_LOG)
-#define HASH_MASK (HASH_SIZE - 1)
-
-typedef struct HashEntry HashEntry;
-
 typedef struct SharedDictionary SharedDictionary;
 
 struct WindowImage {
@@ -52,9 +37,14 @@ struct WindowImage {
     uint8_t is_alive;
 };
 
-#define MAX_IMAGE_SEGS_NUM (0xffffffff)
-#define NULL_IMAGE_SEG_ID MAX_IMAGE_SEGS_NUM
-#define INIT_IMAGE_SEGS_NUM 1000
+/* The segments are allocated in blocks that are never moved, so that the
+   window can grow while other encoders are reading it */
+#define IMAGE_SEGS_BLOCK_SIZE_LOG 10
+#define IMAGE_SEGS_BLOCK_SIZE (1 << IMAGE_SEGS_BLOCK_SIZE_LOG)
+#define IMAGE_SEGS_BLOCK_MASK (IMAGE_SEGS_BLOCK_SIZE - 1)
+#define MAX_IMAGE_SEGS_BLOCKS 4096
+#define MAX_IMAGE_SEGS_NUM (MAX_IMAGE_SEGS_BLOCKS * IMAGE_SEGS_BLOCK_SIZE)
+#define NULL_IMAGE_SEG_ID (0xffffffff)
 
 /* Images can be separated into several chunks. The basic unit of the
    dictionary window is one image segment. Each segment is encoded separately.
@@ -71,18 +61,24 @@ struct WindowImageSegment {
 };
 
 
-struct  __attribute__ ((__packed__)) HashEntry {
-    uint32_t image_seg_idx;
-    uint32_t ref_pix_idx;
-};
+/* The segment index is kept in the high 32 bits and the pixel index in the low
+   32 bits. An entry is read and written as a whole with a single atomic access,
+   so encoders update the hash concurrently without locking and never combine the
+   segment of one update with the pixel of another. */
+typedef uint64_t HashEntry;
+
+#define HASH_ENTRY(seg, pix) (((uint64_t)(seg) << 32) | (uint32_t)(pix))
+#define HASH_ENTRY_SEG(entry) ((uint32_t)((entry) >> 32))
+#define HASH_ENTRY_PIX(entry) ((uint32_t)(entry))
+#define HASH_ENTRY_LOAD(entry) __atomic_load_n(&(entry), __ATOMIC_ACQUIRE)
 
 
 struct SharedDictionary {
     struct {
-        /* The segments storage. A dynamic array.
-           By referring to a segment by its index, instead of address,
+        /* The segments storage. Blocks of IMAGE_SEGS_BLOCK_SIZE segments that are
+           added on demand. By referring to a segment by its index, instead of address,
            we save space in the hash entries (32bit instead of 64bit) */
-        WindowImageSegment  *segs;
+        WindowImageSegment  *segs_blocks[MAX_IMAGE_SEGS_BLOCKS];
         uint32_t segs_quota;
 
         /* The window is manged as a linked list rather than as a cyclic
@@ -108,20 +104,19 @@ struct SharedDictionary {
         uint32_t size_limit;                 // max number of pixels in a window (per encoder)
     } window;
 
-    /* Concurrency issues: the reading/writing of each entry field should be atomic.
-       It is allowed that the reading/writing of the whole entry won't be atomic,
-       since before we access a reference we check its validity*/
-#ifdef CHAINED_HASH
-    HashEntry htab[HASH_SIZE][HASH_CHAIN_SIZE];
-    uint8_t htab_counter[HASH_SIZE];  //cyclic counter for the next entry in a chain to be assigned
-#else
-    HashEntry htab[HASH_SIZE];
-#endif
+    /* Concurrency issues: the entries are updated by all the encoders at once,
+       see HashEntry. An entry may refer to a segment that was removed from the
+       window or reused meanwhile, since before we access a reference we check its
+       validity*/
+    HashEntry *htab;                  // (hash_mask + 1) chains of 1 << hash_chain_log entries
+    uint8_t *htab_counter;            // cyclic counter for the next entry in a chain to be
+                                      // assigned, NULL when the chains have one entry
+    uint32_t hash_mask;
+    uint32_t hash_chain_log;
 
     uint64_t last_image_id;
     uint32_t max_encoders;
-    pthread_mutex_t lock;
-    pthread_rwlock_t rw_alloc_lock;
+    pthread_mutex_t lock;                // protects the window lists, not the hash
     GlzEncoderUsrContext       *cur_usr; // each encoder has other context.
 };
 
@@ -150,26 +145,29 @@ WindowImage *glz_dictionary_pre_encode(uint32_t encoder_id, GlzEncoderUsrContext
 void glz_dictionary_post_encode(uint32_t encoder_id, GlzEncoderUsrContext *usr,
                                 SharedDictionary *dict);
 
+#define WINDOW_SEG(dict, seg_id)                                             \
+    (&(dict)->window.segs_blocks[(seg_id) >> IMAGE_SEGS_BLOCK_SIZE_LOG][      \
+        (seg_id) & IMAGE_SEGS_BLOCK_MASK])
+
 #define IMAGE_SEG_IS_EARLIER(dict, dst_seg, src_seg) (                     \
     ((src_seg) == NULL_IMAGE_SEG_ID) || (((dst_seg) != NULL_IMAGE_SEG_ID)  \
-    && ((dict)->window.segs[(dst_seg)].pixels_so_far <                     \
-       (dict)->window.segs[(src_seg)].pixels_so_far)))
-
-
-#ifdef CHAINED_HASH
-#define UPDATE_HASH(dict, hval, seg, pix) {                \
-    uint8_t tmp_count = (dict)->htab_counter[hval];        \
-    (dict)->htab[hval][tmp_count].image_seg_idx = seg;     \
-    (dict)->htab[hval][tmp_count].ref_pix_idx = pix;       \
-    tmp_count = ((tmp_count) + 1) & (HASH_CHAIN_SIZE - 1); \
-    dict->htab_counter[hval] = tmp_count;                  \
-}
-#else
-#define UPDATE_HASH(dict, hval, seg, pix) { \
-    (dict)->htab[hval].image_seg_idx = seg; \
-    (dict)->htab[hval].ref_pix_idx = pix;   \
+    && (WINDOW_SEG(dict, dst_seg)->pixels_so_far <                         \
+        WINDOW_SEG(dict, src_seg)->pixels_so_far)))
+
+
+/* The release store pairs with HASH_ENTRY_LOAD: an encoder that finds the entry
+   also sees the segment it refers to. Concurrent updates of the chain counter
+   may overwrite the same entry twice, which only costs a match. */
+#define UPDATE_HASH(dict, hval, seg, pix) {                                    \
+    uint32_t tmp_idx = (uint32_t)(hval) << (dict)->hash_chain_log;             \
+    if ((dict)->htab_counter) {                                                \
+        uint8_t tmp_count = (dict)->htab_counter[hval];                        \
+        tmp_idx += tmp_count;                                                  \
+        tmp_count = (tmp_count + 1) & ((1 << (dict)->hash_chain_log) - 1);     \
+        (dict)->htab_counter[hval] = tmp_count;                                \
+    }                                                                          \
+    __atomic_store_n(&(dict)->htab[tmp_idx], HASH_ENTRY(seg, pix), __ATOMIC_RELEASE); \
 }
-#endif
 
 /* checks if the reference segment is located in the range of the window
    of the current encoder */
@@ -179,8 +177,8 @@ void glz_dictionary_post_encode(uint32_t encoder_id, GlzEncoderUsrContext *usr,
      (ref_seg)->image->is_alive &&                         \
      (src_seg->image->type == ref_seg->image->type) &&     \
      (ref_seg->pixels_so_far <= src_seg->pixels_so_far) && \
-     ((dict)->window.segs[                                 \
-        (dict)->window.encoders_heads[enc_id]].pixels_so_far <= \
+     (WINDOW_SEG(dict,                                     \
+        (dict)->window.encoders_heads[enc_id])->pixels_so_far <= \
         ref_seg->pixels_so_far)))
 
 #endif // _H_GLZ_ENCODER_DICTIONARY_PROTECTED
@@ -19,9 +19,17 @@
 #endif
 
 #include "red_common.h"
+#include "red_bitmap_simd.h"
 #include "jpeg_encoder.h"
 #include <jpeglib.h>
 
+/* lines handed to libjpeg per jpeg_write_scanlines call: one MCU row of
+ * 2x2 subsampled images */
+#define JPEG_BATCH_LINES 16
+
+/* converts a line of the input image to the layout libjpeg reads */
+typedef void (*JpegConvertLineFunc)(const uint8_t *line, int width, uint8_t *out_line);
+
 typedef struct JpegEncoder {
     JpegEncoderUsrContext *usr;
 
@@ -35,8 +43,13 @@ typedef struct JpegEncoder {
         int height;
         int stride;
         unsigned int out_size;
-        void (*convert_line_to_RGB24) (void *line, int width, uint8_t **out_line);
+        JpegConvertLineFunc convert_line; // NULL - the lines are read in place
+        int out_bytes_per_pixel;
     } cur_image;
+
+    JpegConvertLineFunc convert_RGB16;
+    uint8_t *batch_buf;
+    size_t batch_buf_size;
 } JpegEncoder;
 
 /* jpeg destination manager callbacks */
@@ -75,45 +88,28 @@ static void dest_mgr_term_destination(j_compress_ptr cinfo)
     enc->cur_image.out_size -= enc->dest_mgr.free_in_buffer;
 }
 
-JpegEncoderContext* jpeg_encoder_create(JpegEncoderUsrContext *usr)
+#ifdef JCS_EXTENSIONS
+/* libjpeg-turbo reads the BGR24 and BGRX32 lines in place, only the 16bpp
+ * lines need to be expanded */
+static void convert_RGB16_to_BGRX32(const uint8_t *line, int width, uint8_t *out_pix)
 {
-    JpegEncoder *enc;
-    if (!usr->more_space || !usr->more_lines) {
-        return NULL;
-    }
-
-    enc = spice_new0(JpegEncoder, 1);
-
-    enc->usr = usr;
-
-    enc->dest_mgr.init_destination = dest_mgr_init_destination;
-    enc->dest_mgr.empty_output_buffer = dest_mgr_empty_output_buffer;
-    enc->dest_mgr.term_destination = dest_mgr_term_destination;
-
-    enc->cinfo.err = jpeg_std_error(&enc->jerr);
-
-    jpeg_create_compress(&enc->cinfo);
-    enc->cinfo.client_data = enc;
-    enc->cinfo.dest = &enc->dest_mgr;
-    return (JpegEncoderContext*)enc;
-}
+    const uint16_t *src_line = (const uint16_t *)line;
+    int x;
 
-void jpeg_encoder_destroy(JpegEncoderContext* encoder)
-{
-    jpeg_destroy_compress(&((JpegEncoder*)encoder)->cinfo);
-    free(encoder);
+    for (x = 0; x < width; x++) {
+        uint16_t pixel = *src_line++;
+        *out_pix++ = ((pixel << 3) & 0xf8) | ((pixel >> 2) & 0x7);
+        *out_pix++ = ((pixel >> 2) & 0xf8) | ((pixel >> 7) & 0x7);
+        *out_pix++ = ((pixel >> 7) & 0xf8) | ((pixel >> 12) & 0x7);
+        *out_pix++ = 0;
+    }
 }
-
-static void convert_RGB16_to_RGB24(void *line, int width, uint8_t **out_line)
+#else
+static void convert_RGB16_to_RGB24(const uint8_t *line, int width, uint8_t *out_pix)
 {
-    uint16_t *src_line = line;
-    uint8_t *out_pix;
+    const uint16_t *src_line = (const uint16_t *)line;
     int x;
 
-    spice_assert(out_line && *out_line);
-
-    out_pix = *out_line;
-
     for (x = 0; x < width; x++) {
        uint16_t pixel = *src_line++;
        *out_pix++ = ((pixel >> 7) & 0xf8) | ((pixel >> 12) & 0x7);
@@ -122,14 +118,9 @@ static void convert_RGB16_to_RGB24(void *line, int width, uint8_t **out_line)
    }
 }
 
-static void convert_BGR24_to_RGB24(void *in_line, int width, uint8_t **out_line)
+static void convert_BGR24_to_RGB24(const uint8_t *line, int width, uint8_t *out_pix)
 {
     int x;
-    uint8_t *out_pix;
-    uint8_t *line = in_line;
-    spice_assert(out_line && *out_line);
-
-    out_pix = *out_line;
 
     for (x = 0; x < width; x++) {
         *out_pix++ = line[2];
@@ -139,16 +130,11 @@ static void convert_BGR24_to_RGB24(void *in_line, int width, uint8_t **out_line)
     }
 }
 
-static void convert_BGRX32_to_RGB24(void *line, int width, uint8_t **out_line)
+static void convert_BGRX32_to_RGB24(const uint8_t *line, int width, uint8_t *out_pix)
 {
-    uint32_t *src_line = line;
-    uint8_t *out_pix;
+    const uint32_t *src_line = (const uint32_t *)line;
     int x;
 
-    spice_assert(out_line && *out_line);
-
-    out_pix = *out_line;
-
     for (x = 0; x < width; x++) {
         uint32_t pixel = *src_line++;
         *out_pix++ = (pixel >> 16) & 0xff;
@@ -156,12 +142,52 @@ static void convert_BGRX32_to_RGB24(void *line, int width, uint8_t **out_line)
         *out_pix++ = pixel & 0xff;
     }
 }
+#endif
 
-static void convert_RGB24_to_RGB24(void *line, int width, uint8_t **out_line)
+JpegEncoderContext* jpeg_encoder_create(JpegEncoderUsrContext *usr)
 {
-    *out_line = line;
+    JpegEncoder *enc;
+    if (!usr->more_space || !usr->more_lines) {
+        return NULL;
+    }
+
+    enc = spice_new0(JpegEncoder, 1);
+
+    enc->usr = usr;
+
+    enc->dest_mgr.init_destination = dest_mgr_init_destination;
+    enc->dest_mgr.empty_output_buffer = dest_mgr_empty_output_buffer;
+    enc->dest_mgr.term_destination = dest_mgr_term_destination;
+
+#ifdef JCS_EXTENSIONS
+    enc->convert_RGB16 = convert_RGB16_to_BGRX32;
+#else
+    enc->convert_RGB16 = convert_RGB16_to_RGB24;
+#endif
+
+    enc->cinfo.err = jpeg_std_error(&enc->jerr);
+
+    jpeg_create_compress(&enc->cinfo);
+    enc->cinfo.client_data = enc;
+    enc->cinfo.dest = &enc->dest_mgr;
+    return (JpegEncoderContext*)enc;
+}
+
+void jpeg_encoder_set_simd_ops(JpegEncoderContext *encoder, const RedBitmapSimdOps *simd_ops)
+{
+#ifdef JCS_EXTENSIONS
+    JpegEncoder *enc = (JpegEncoder *)encoder;
+
+    enc->convert_RGB16 = simd_ops ? simd_ops->rgb16_to_bgrx : convert_RGB16_to_BGRX32;
+#endif
 }
 
+void jpeg_encoder_destroy(JpegEncoderContext* encoder)
+{
+    jpeg_destroy_compress(&((JpegEncoder*)encoder)->cinfo);
+    free(((JpegEncoder*)encoder)->batch_buf);
+    free(encoder);
+}
 
 #define FILL_LINES() {                                                  \
     if (lines == lines_end) {                                           \
@@ -176,27 +202,38 @@ static void convert_RGB24_to_RGB24(void *line, int width, uint8_t **out_line)
 static void do_jpeg_encode(JpegEncoder *jpeg, uint8_t *lines, unsigned int num_lines)
 {
     uint8_t *lines_end;
-    uint8_t *RGB24_line;
     int stride, width;
-    JSAMPROW row_pointer[1];
+    size_t row_size;
+    JSAMPROW row_pointers[JPEG_BATCH_LINES];
+    unsigned int batch, i;
     width = jpeg->cur_image.width;
     stride = jpeg->cur_image.stride;
+    row_size = (size_t)width * jpeg->cur_image.out_bytes_per_pixel;
 
-    if (jpeg->cur_image.type != JPEG_IMAGE_TYPE_RGB24) {
-        RGB24_line = (uint8_t *)spice_malloc(width*3);
+    if (jpeg->cur_image.convert_line &&
+        jpeg->batch_buf_size < row_size * JPEG_BATCH_LINES) {
+        free(jpeg->batch_buf);
+        jpeg->batch_buf_size = row_size * JPEG_BATCH_LINES;
+        jpeg->batch_buf = spice_malloc(jpeg->batch_buf_size);
     }
 
     lines_end = lines + (stride * num_lines);
 
-    for (;jpeg->cinfo.next_scanline < jpeg->cinfo.image_height; lines += stride) {
+    while (jpeg->cinfo.next_scanline < jpeg->cinfo.image_height) {
         FILL_LINES();
-        jpeg->cur_image.convert_line_to_RGB24(lines, width, &RGB24_line);
-        row_pointer[0] = RGB24_line;
-        jpeg_write_scanlines(&jpeg->cinfo, row_pointer, 1);
-    }
-
-    if (jpeg->cur_image.type != JPEG_IMAGE_TYPE_RGB24) {
-        free(RGB24_line);
+        // as many lines of the current chunk as fit in a batch
+        batch = MIN((unsigned int)((lines_end - lines) / stride),
+                    jpeg->cinfo.image_height - jpeg->cinfo.next_scanline);
+        batch = MIN(batch, JPEG_BATCH_LINES);
+        for (i = 0; i < batch; i++, lines += stride) {
+            if (jpeg->cur_image.convert_line) {
+                row_pointers[i] = jpeg->batch_buf + i * row_size;
+                jpeg->cur_image.convert_line(lines, width, row_pointers[i]);
+            } else {
+                row_pointers[i] = lines;
+            }
+        }
+        jpeg_write_scanlines(&jpeg->cinfo, row_pointers, batch);
     }
 }
 
@@ -212,18 +249,36 @@ int jpeg_encode(JpegEncoderContext *jpeg, int quality, JpegEncoderImageType type
     enc->cur_image.stride = stride;
     enc->cur_image.out_size = 0;
 
+    enc->cinfo.input_components = 3;
+    enc->cinfo.in_color_space = JCS_RGB;
+    enc->cur_image.convert_line = NULL;
+    enc->cur_image.out_bytes_per_pixel = 3;
+
     switch (type) {
     case JPEG_IMAGE_TYPE_RGB16:
-        enc->cur_image.convert_line_to_RGB24 = convert_RGB16_to_RGB24;
+        enc->cur_image.convert_line = enc->convert_RGB16;
+#ifdef JCS_EXTENSIONS
+        enc->cinfo.input_components = 4;
+        enc->cinfo.in_color_space = JCS_EXT_BGRX;
+        enc->cur_image.out_bytes_per_pixel = 4;
+#endif
         break;
     case JPEG_IMAGE_TYPE_RGB24:
-        enc->cur_image.convert_line_to_RGB24 = convert_RGB24_to_RGB24;
         break;
     case JPEG_IMAGE_TYPE_BGR24:
-        enc->cur_image.convert_line_to_RGB24 = convert_BGR24_to_RGB24;
+#ifdef JCS_EXTENSIONS
+        enc->cinfo.in_color_space = JCS_EXT_BGR;
+#else
+        enc->cur_image.convert_line = convert_BGR24_to_RGB24;
+#endif
         break;
     case JPEG_IMAGE_TYPE_BGRX32:
-        enc->cur_image.convert_line_to_RGB24 = convert_BGRX32_to_RGB24;
+#ifdef JCS_EXTENSIONS
+        enc->cinfo.input_components = 4;
+        enc->cinfo.in_color_space = JCS_EXT_BGRX;
+#else
+        enc->cur_image.convert_line = convert_BGRX32_to_RGB24;
+#endif
         break;
     default:
         spice_error("bad image type");
@@ -231,8 +286,6 @@ int jpeg_encode(JpegEncoderContext *jpeg, int quality, JpegEncoderImageType type
 
     enc->cinfo.image_width = width;
     enc->cinfo.image_height = height;
-    enc->cinfo.input_components = 3;
-    enc->cinfo.in_color_space = JCS_RGB;
     jpeg_set_defaults(&enc->cinfo);
     jpeg_set_quality(&enc->cinfo, quality, TRUE);
 
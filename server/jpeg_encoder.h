@@ -31,6 +31,7 @@
 #define _H_JPEG_ENCODER
 
 #include <spice/types.h>
+#include "red_bitmap_simd.h"
 
 typedef enum {
     JPEG_IMAGE_TYPE_INVALID,
@@ -53,6 +54,9 @@ struct JpegEncoderUsrContext {
 JpegEncoderContext* jpeg_encoder_create(JpegEncoderUsrContext *usr);
 void jpeg_encoder_destroy(JpegEncoderContext *encoder);
 
+/* the bitmap scans picked with SPICE_BITMAP_SIMD, NULL - the scalar ones */
+void jpeg_encoder_set_simd_ops(JpegEncoderContext *encoder, const RedBitmapSimdOps *simd_ops);
+
 /* returns the total size of the encoded data. Images must be supplied from the
    top line to the bottom */
 int jpeg_encode(JpegEncoderContext *jpeg, int quality, JpegEncoderImageType type,
@@ -24,11 +24,24 @@
 
 #include <arpa/inet.h>
 #include <lz4.h>
+#include <lz4hc.h>
 #include "red_common.h"
 #include "lz4_encoder.h"
 
+/* Blocks are compressed straight into the output buffers, as long as the
+ * worst case block size fits in the space left. Otherwise a block of at
+ * most LZ4_SCRATCH_INPUT_SIZE bytes is compressed into the scratch buffer
+ * and copied across the output buffers. The client decodes the blocks in
+ * sequence into the image, so where the input is cut doesn't matter. */
+#define LZ4_SCRATCH_INPUT_SIZE (16 * 1024)
+#define LZ4_BLOCK_HEADER_SIZE 4
+
 typedef struct Lz4Encoder {
     Lz4EncoderUsrContext *usr;
+    int level;
+    LZ4_stream_t *stream;
+    LZ4_streamHC_t *stream_hc;
+    uint8_t *scratch;
 } Lz4Encoder;
 
 Lz4EncoderContext* lz4_encoder_create(Lz4EncoderUsrContext *usr)
@@ -40,13 +53,75 @@ Lz4EncoderContext* lz4_encoder_create(Lz4EncoderUsrContext *usr)
 
     enc = spice_new0(Lz4Encoder, 1);
     enc->usr = usr;
+    enc->stream = LZ4_createStream();
+    enc->scratch = spice_malloc(LZ4_BLOCK_HEADER_SIZE +
+                                LZ4_COMPRESSBOUND(LZ4_SCRATCH_INPUT_SIZE));
 
     return (Lz4EncoderContext*)enc;
 }
 
 void lz4_encoder_destroy(Lz4EncoderContext* encoder)
 {
-    free(encoder);
+    Lz4Encoder *enc = (Lz4Encoder *)encoder;
+
+    LZ4_freeStream(enc->stream);
+    if (enc->stream_hc) {
+        LZ4_freeStreamHC(enc->stream_hc);
+    }
+    free(enc->scratch);
+    free(enc);
+}
+
+void lz4_encoder_set_level(Lz4EncoderContext *lz4, int level)
+{
+    Lz4Encoder *enc = (Lz4Encoder *)lz4;
+
+    enc->level = level;
+    if (level > 0 && !enc->stream_hc) {
+        enc->stream_hc = LZ4_createStreamHC();
+    }
+}
+
+static void lz4_encoder_reset(Lz4Encoder *enc)
+{
+    if (enc->level > 0) {
+        LZ4_resetStreamHC(enc->stream_hc, enc->level);
+    } else {
+        LZ4_resetStream(enc->stream);
+    }
+}
+
+/* compresses a block to dest, after its header, and returns the size of the
+ * block including the header */
+static int lz4_encoder_compress_block(Lz4Encoder *enc, const uint8_t *src, int src_size,
+                                      uint8_t *dest, int dest_size)
+{
+    int enc_size;
+
+    if (enc->level > 0) {
+        enc_size = LZ4_compress_HC_continue(enc->stream_hc, (const char *)src,
+                                            (char *)dest + LZ4_BLOCK_HEADER_SIZE,
+                                            src_size, dest_size - LZ4_BLOCK_HEADER_SIZE);
+    } else {
+        enc_size = LZ4_compress_fast_continue(enc->stream, (const char *)src,
+                                              (char *)dest + LZ4_BLOCK_HEADER_SIZE,
+                                              src_size, dest_size - LZ4_BLOCK_HEADER_SIZE,
+                                              enc->level < 0 ? -enc->level : 1);
+    }
+    if (enc_size <= 0) {
+        return 0;
+    }
+    *((uint32_t *)dest) = htonl(enc_size);
+    return enc_size + LZ4_BLOCK_HEADER_SIZE;
+}
+
+/* returns the largest input whose worst case block fits in dest_size */
+static inline int lz4_block_input_size(int dest_size)
+{
+    int avail = dest_size - LZ4_BLOCK_HEADER_SIZE - 16;
+
+    // LZ4_COMPRESSBOUND(n) is n + n / 255 + 16
+    return avail > 0 ? avail - avail / 256 - 1 : 0;
 }
 
 int lz4_encode(Lz4EncoderContext *lz4, int height, int stride, uint8_t *io_ptr,
@@ -56,10 +131,10 @@ int lz4_encode(Lz4EncoderContext *lz4, int height, int stride, uint8_t *io_ptr,
     uint8_t *lines;
     int num_lines = 0;
     int total_lines = 0;
-    int in_size, enc_size, out_size, already_copied;
-    uint8_t *in_buf, *compressed_lines;
+    int in_size, block_size, enc_size, out_size, already_copied;
     uint8_t *out_buf = io_ptr;
-    LZ4_stream_t *stream = LZ4_createStream();
+
+    lz4_encoder_reset(enc);
 
     // Encode direction and format
     *(out_buf++) = top_down ? 1 : 0;
@@ -71,47 +146,58 @@ int lz4_encode(Lz4EncoderContext *lz4, int height, int stride, uint8_t *io_ptr,
         num_lines = enc->usr->more_lines(enc->usr, &lines);
         if (num_lines <= 0) {
             spice_error("more lines failed");
-            LZ4_freeStream(stream);
             return 0;
         }
-        in_buf = lines;
         in_size = stride * num_lines;
-        lines += in_size;
-        compressed_lines = (uint8_t *) malloc(LZ4_compressBound(in_size) + 4);
-        enc_size = LZ4_compress_continue(stream, (const char *) in_buf,
-                                         (char *) compressed_lines + 4, in_size);
-        if (enc_size <= 0) {
-            spice_error("compress failed!");
-            free(compressed_lines);
-            LZ4_freeStream(stream);
-            return 0;
-        }
-        *((uint32_t *)compressed_lines) = htonl(enc_size);
-
-        out_size += enc_size += 4;
-        already_copied = 0;
-        while (num_io_bytes < enc_size) {
-            memcpy(out_buf, compressed_lines + already_copied, num_io_bytes);
-            already_copied += num_io_bytes;
-            enc_size -= num_io_bytes;
-            num_io_bytes = enc->usr->more_space(enc->usr, &io_ptr);
-            if (num_io_bytes <= 0) {
-                spice_error("more space failed");
-                free(compressed_lines);
-                LZ4_freeStream(stream);
+        total_lines += num_lines;
+
+        while (in_size > 0) {
+            block_size = MIN(in_size, lz4_block_input_size(num_io_bytes));
+            if (block_size >= LZ4_SCRATCH_INPUT_SIZE || block_size == in_size) {
+                enc_size = lz4_encoder_compress_block(enc, lines, block_size,
+                                                      out_buf, num_io_bytes);
+                if (enc_size <= 0) {
+                    spice_error("compress failed!");
+                    return 0;
+                }
+                out_buf += enc_size;
+                num_io_bytes -= enc_size;
+                out_size += enc_size;
+                lines += block_size;
+                in_size -= block_size;
+                continue;
+            }
+
+            // the output buffer is almost full, the block spans to the next one
+            block_size = MIN(in_size, LZ4_SCRATCH_INPUT_SIZE);
+            enc_size = lz4_encoder_compress_block(enc, lines, block_size, enc->scratch,
+                                                  LZ4_BLOCK_HEADER_SIZE +
+                                                  LZ4_COMPRESSBOUND(LZ4_SCRATCH_INPUT_SIZE));
+            if (enc_size <= 0) {
+                spice_error("compress failed!");
                 return 0;
             }
-            out_buf = io_ptr;
+            lines += block_size;
+            in_size -= block_size;
+            out_size += enc_size;
+            already_copied = 0;
+            while (num_io_bytes < enc_size) {
+                memcpy(out_buf, enc->scratch + already_copied, num_io_bytes);
+                already_copied += num_io_bytes;
+                enc_size -= num_io_bytes;
+                num_io_bytes = enc->usr->more_space(enc->usr, &io_ptr);
+                if (num_io_bytes <= 0) {
+                    spice_error("more space failed");
+                    return 0;
+                }
+                out_buf = io_ptr;
+            }
+            memcpy(out_buf, enc->scratch + already_copied, enc_size);
+            out_buf += enc_size;
+            num_io_bytes -= enc_size;
         }
-        memcpy(out_buf, compressed_lines + already_copied, enc_size);
-        out_buf += enc_size;
-        num_io_bytes -= enc_size;
-
-        free(compressed_lines);
-        total_lines += num_lines;
     } while (total_lines < height);
 
-    LZ4_freeStream(stream);
     if (total_lines != height) {
         spice_error("too many lines\n");
         out_size = 0;
@@ -43,6 +43,9 @@ struct Lz4EncoderUsrContext {
 Lz4EncoderContext* lz4_encoder_create(Lz4EncoderUsrContext *usr);
 void lz4_encoder_destroy(Lz4EncoderContext *encoder);
 
+/* 0 - default, < 0 - faster with acceleration -level, > 0 - LZ4 HC level */
+void lz4_encoder_set_level(Lz4EncoderContext *lz4, int level);
+
 /* returns the total size of the encoded data. */
 int lz4_encode(Lz4EncoderContext *lz4, int height, int stride, uint8_t *io_ptr,
                unsigned int num_io_bytes, int top_down, uint8_t format);
@@ -20,10 +20,15 @@
 #endif
 
 #include "red_common.h"
+#include "red_bitmap_simd.h"
 #include "mjpeg_encoder.h"
 #include <jerror.h>
 #include <jpeglib.h>
 #include <inttypes.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <unistd.h>
 
 #define MJPEG_MAX_FPS 25
 #define MJPEG_MIN_FPS 1
@@ -33,11 +38,45 @@ static const int mjpeg_quality_samples[MJPEG_QUALITY_SAMPLE_NUM] = {20, 30, 40,
 
 #define MJPEG_LEGACY_STATIC_QUALITY_ID 5 // jpeg quality 70
 
+/*
+ * The size of a frame encoded at each of the sampled qualities, relative to
+ * the median one, as measured on detailed content. The model of each stream
+ * starts from them, see MJpegEncoderQualityModel.
+ */
+static const double mjpeg_quality_size_factors[MJPEG_QUALITY_SAMPLE_NUM] =
+    {0.45, 0.63, 0.81, 1.0, 1.24, 1.52, 1.90};
+#define MJPEG_QUALITY_MODEL_WEIGHT 0.25 // of a new size factor sample
+
 #define MJPEG_IMPROVE_QUALITY_FPS_STRICT_TH 10
 #define MJPEG_IMPROVE_QUALITY_FPS_PERMISSIVE_TH 5
 
 #define MJPEG_AVERAGE_SIZE_WINDOW 3
 
+/* lines handed to libjpeg per jpeg_write_scanlines call: one MCU row of
+ * 2x2 subsampled frames */
+#define MJPEG_BATCH_LINES 16
+
+/*
+ * Big frames are split in up to MJPEG_MAX_STRIPES horizontal stripes of at
+ * least MJPEG_STRIPE_MIN_LINES lines, encoded in parallel, see
+ * mjpeg_encoder_encode_stripes
+ */
+#define MJPEG_MAX_STRIPES 8
+#define MJPEG_STRIPE_MIN_LINES 64
+
+/*
+ * When even the lowest quality leaves the stream below
+ * MJPEG_SCALE_DOWN_FPS_TH fps, the frames are encoded at half or a quarter
+ * of their width and height, and the client scales them back to the stream
+ * area. The frames are scaled up again once the current quality would allow
+ * MJPEG_SCALE_UP_FPS_TH fps with frames MJPEG_SCALE_SIZE_FACTOR times bigger.
+ */
+#define MJPEG_MAX_SCALE_SHIFT 2
+#define MJPEG_SCALE_MIN_SIZE 64 // width and height of a scaled frame
+#define MJPEG_SCALE_DOWN_FPS_TH MJPEG_IMPROVE_QUALITY_FPS_STRICT_TH
+#define MJPEG_SCALE_UP_FPS_TH 15
+#define MJPEG_SCALE_SIZE_FACTOR 4
+
 #define MJPEG_BIT_RATE_EVAL_MIN_NUM_FRAMES 3
 #define MJPEG_LOW_FPS_RATE_TH 3
 
@@ -96,6 +135,22 @@ typedef struct MJpegEncoderQualityEval {
     int max_sampled_fps_quality_id;
 } MJpegEncoderQualityEval;
 
+/*
+ * Predicts the encoded size of a frame at the sampled qualities, so that
+ * the quality evaluation does not need to encode frames at each quality it
+ * scans: size = pixels * complexity * size_factors[quality_id].
+ * complexity is the bytes per pixel of the last frame, brought back to the
+ * median quality. When consecutive frames are encoded at different
+ * qualities, the size factor of the new quality moves towards the observed
+ * one; they start from mjpeg_quality_size_factors.
+ */
+typedef struct MJpegEncoderQualityModel {
+    double size_factors[MJPEG_QUALITY_SAMPLE_NUM];
+    double complexity; // 0 - no frame was encoded yet
+    uint64_t pixels;   // of the last frame
+    int quality_id;    // of the last frame
+} MJpegEncoderQualityModel;
+
 typedef struct MJpegEncoderClientState {
     int max_video_latency;
     uint32_t max_audio_latency;
@@ -131,6 +186,7 @@ typedef struct MJpegEncoderBitRateInfo {
 typedef struct MJpegEncoderRateControl {
     int during_quality_eval;
     MJpegEncoderQualityEval quality_eval_data;
+    MJpegEncoderQualityModel quality_model;
     MJpegEncoderBitRateInfo bit_rate_info;
     MJpegEncoderClientState client_state;
     MJpegEncoderServerState server_state;
@@ -151,18 +207,69 @@ typedef struct MJpegEncoderRateControl {
     uint32_t num_recent_enc_frames;
 
     uint64_t warmup_start_time;
+
+    int scale_shift;        // the frames are scaled by 1 / (1 << scale_shift)
+    int max_scale_shift;    // 0 - the client cannot upscale frames
+
+    uint32_t max_playback_delay; // 0 - the client playback delay may grow
 } MJpegEncoderRateControl;
 
+/* converts a line of the frame to the layout libjpeg reads */
+typedef void (*MJpegConvertLineFunc)(const uint8_t *src, int width, uint8_t *dest);
+
+/* averages the 2x2 pixel boxes of two converted lines, see RedHalveBgrxFunc */
+typedef void (*MJpegHalveLinesFunc)(const uint8_t *line0, const uint8_t *line1,
+                                    int width, uint8_t *dest);
+
+typedef struct MJpegStripe {
+    int created;
+    struct jpeg_compress_struct cinfo;
+    struct jpeg_error_mgr jerr;
+    uint8_t *rows; // MJPEG_BATCH_LINES converted lines
+    uint32_t row_size;
+    uint8_t *out;
+    size_t out_size;
+    size_t out_len;
+    int first_line;
+    int num_lines;
+} MJpegStripe;
+
+typedef struct MJpegCachedFrame {
+    uint64_t frame_id;
+    int width;
+    int height;
+    uint8_t *data;
+    size_t size;
+    size_t buf_size;
+} MJpegCachedFrame;
+
+struct MJpegFrameCache {
+    MJpegCachedFrame frames[MJPEG_QUALITY_SAMPLE_NUM];
+};
+
 struct MJpegEncoder {
-    uint8_t *row;
+    uint8_t *rows; // MJPEG_BATCH_LINES converted lines
     uint32_t row_size;
     int first_frame;
 
+    uint8_t **lines; // the lines of the current frame
+    uint32_t lines_size;
+    int quality;
+    MJpegStripe stripes[MJPEG_MAX_STRIPES];
+    int num_stripes;
+    unsigned int stripe_restart_interval;
+
     struct jpeg_compress_struct cinfo;
     struct jpeg_error_mgr jerr;
 
     unsigned int bytes_per_pixel; /* bytes per pixel of the input buffer */
-    void (*pixel_converter)(void *src, uint8_t *dest);
+    MJpegConvertLineFunc line_converter; // NULL - the lines are read in place
+    MJpegConvertLineFunc rgb16_converter;
+
+    int scale_shift; // of the current frame
+    uint8_t *scaled; // the lines of the scaled frame
+    size_t scaled_size;
+    MJpegHalveLinesFunc bgrx_halver;
 
     MJpegEncoderRateControl rate_control;
     MJpegEncoderRateControlCbs cbs;
@@ -172,9 +279,16 @@ struct MJpegEncoder {
     uint64_t starting_bit_rate;
     uint64_t avg_quality;
     uint32_t num_frames;
+    uint64_t num_shared_frames;
+    uint64_t num_scaled_frames;
+    uint64_t num_quality_evals;
+    uint64_t num_eval_frames;
+    uint64_t quality_eval_time;
+    uint64_t pool_cpu_time; // of the stripe pool threads, see mjpeg_encoder_get_cpu_time
 };
 
 static void mjpeg_encoder_process_server_drops(MJpegEncoder *encoder);
+static void mjpeg_encoder_eval_scale(MJpegEncoder *encoder, uint64_t enc_size, uint32_t src_fps);
 static uint32_t get_min_required_playback_delay(uint64_t frame_enc_size,
                                                 uint64_t byte_rate,
                                                 uint32_t latency);
@@ -184,11 +298,53 @@ static inline int rate_control_is_active(MJpegEncoder* encoder)
     return encoder->cbs.get_roundtrip_ms != NULL;
 }
 
+/* nanoseconds */
+static uint64_t mjpeg_encoder_get_time(MJpegEncoder *encoder)
+{
+    struct timespec time;
+
+    if (encoder->cbs.get_time) {
+        return encoder->cbs.get_time(encoder->cbs_opaque);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return ((uint64_t) time.tv_sec) * 1000000000 + time.tv_nsec;
+}
+
+/* nanoseconds of cpu time of the calling thread */
+static uint64_t mjpeg_get_thread_cpu_time(void)
+{
+    struct timespec time;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &time);
+    return ((uint64_t) time.tv_sec) * 1000000000 + time.tv_nsec;
+}
+
+/* nanoseconds of cpu time of the calling thread, plus the time the stripe
+ * pool threads spent on the frames of the encoder */
+static uint64_t mjpeg_encoder_get_cpu_time(MJpegEncoder *encoder)
+{
+    return mjpeg_get_thread_cpu_time() + encoder->pool_cpu_time;
+}
+
 void mjpeg_encoder_destroy(MJpegEncoder *encoder)
 {
+    int i;
+
+    for (i = 0; i < MJPEG_MAX_STRIPES; i++) {
+        MJpegStripe *stripe = &encoder->stripes[i];
+
+        if (stripe->created) {
+            free(stripe->cinfo.dest);
+            jpeg_destroy_compress(&stripe->cinfo);
+        }
+        free(stripe->rows);
+        free(stripe->out);
+    }
     free(encoder->cinfo.dest);
     jpeg_destroy_compress(&encoder->cinfo);
-    free(encoder->row);
+    free(encoder->rows);
+    free(encoder->lines);
+    free(encoder->scaled);
     free(encoder);
 }
 
@@ -197,32 +353,89 @@ static uint8_t mjpeg_encoder_get_bytes_per_pixel(MJpegEncoder *encoder)
     return encoder->bytes_per_pixel;
 }
 
+/* Line conversion routines */
 #ifndef JCS_EXTENSIONS
-/* Pixel conversion routines */
-static void pixel_rgb24bpp_to_24(void *src_ptr, uint8_t *dest)
+static void line_rgb24bpp_to_24(const uint8_t *src, int width, uint8_t *dest)
 {
-    uint8_t *src = src_ptr;
-    /* libjpegs stores rgb, spice/win32 stores bgr */
-    *dest++ = src[2]; /* red */
-    *dest++ = src[1]; /* green */
-    *dest++ = src[0]; /* blue */
+    int x;
+
+    for (x = 0; x < width; x++) {
+        /* libjpegs stores rgb, spice/win32 stores bgr */
+        *dest++ = src[2]; /* red */
+        *dest++ = src[1]; /* green */
+        *dest++ = src[0]; /* blue */
+        src += 3;
+    }
 }
 
-static void pixel_rgb32bpp_to_24(void *src, uint8_t *dest)
+static void line_rgb32bpp_to_24(const uint8_t *src, int width, uint8_t *dest)
 {
-    uint32_t pixel = *(uint32_t *)src;
-    *dest++ = (pixel >> 16) & 0xff;
-    *dest++ = (pixel >>  8) & 0xff;
-    *dest++ = (pixel >>  0) & 0xff;
+    const uint32_t *src_pixels = (const uint32_t *)src;
+    int x;
+
+    for (x = 0; x < width; x++) {
+        uint32_t pixel = *src_pixels++;
+        *dest++ = (pixel >> 16) & 0xff;
+        *dest++ = (pixel >>  8) & 0xff;
+        *dest++ = (pixel >>  0) & 0xff;
+    }
+}
+
+static void line_rgb16bpp_to_24(const uint8_t *src, int width, uint8_t *dest)
+{
+    const uint16_t *src_pixels = (const uint16_t *)src;
+    int x;
+
+    for (x = 0; x < width; x++) {
+        uint16_t pixel = *src_pixels++;
+        *dest++ = ((pixel >> 7) & 0xf8) | ((pixel >> 12) & 0x7);
+        *dest++ = ((pixel >> 2) & 0xf8) | ((pixel >> 7) & 0x7);
+        *dest++ = ((pixel << 3) & 0xf8) | ((pixel >> 2) & 0x7);
+    }
+}
+#else
+/* libjpeg-turbo reads 24 and 32 bpp lines in place, 16 bpp lines are
+ * expanded to BGRX */
+static void line_rgb16bpp_to_bgrx(const uint8_t *src, int width, uint8_t *dest)
+{
+    const uint16_t *src_pixels = (const uint16_t *)src;
+    int x;
+
+    for (x = 0; x < width; x++) {
+        uint16_t pixel = *src_pixels++;
+        *dest++ = ((pixel << 3) & 0xf8) | ((pixel >> 2) & 0x7);
+        *dest++ = ((pixel >> 2) & 0xf8) | ((pixel >> 7) & 0x7);
+        *dest++ = ((pixel >> 7) & 0xf8) | ((pixel >> 12) & 0x7);
+        *dest++ = 0;
+    }
 }
 #endif
 
-static void pixel_rgb16bpp_to_24(void *src, uint8_t *dest)
+/* see RedHalveBgrxFunc, the lines have components bytes per pixel */
+static inline void line_halve(const uint8_t *line0, const uint8_t *line1,
+                              int width, int components, uint8_t *dest)
+{
+    int x, c;
+
+    for (x = 0; x < width; x += 2) {
+        int right = x + 1 < width ? components : 0;
+
+        for (c = 0; c < components; c++) {
+            *dest++ = (line0[c] + line0[right + c] + line1[c] + line1[right + c] + 2) >> 2;
+        }
+        line0 += components * 2;
+        line1 += components * 2;
+    }
+}
+
+static void line_halve_24(const uint8_t *line0, const uint8_t *line1, int width, uint8_t *dest)
+{
+    line_halve(line0, line1, width, 3, dest);
+}
+
+static void line_halve_bgrx(const uint8_t *line0, const uint8_t *line1, int width, uint8_t *dest)
 {
-    uint16_t pixel = *(uint16_t *)src;
-    *dest++ = ((pixel >> 7) & 0xf8) | ((pixel >> 12) & 0x7);
-    *dest++ = ((pixel >> 2) & 0xf8) | ((pixel >> 7) & 0x7);
-    *dest++ = ((pixel << 3) & 0xf8) | ((pixel >> 2) & 0x7);
+    line_halve(line0, line1, width, 4, dest);
 }
 
 
@@ -384,6 +597,68 @@ static inline void mjpeg_encoder_reset_quality(MJpegEncoder *encoder,
     rate_control->num_recent_enc_frames = 0;
 }
 
+static void mjpeg_encoder_quality_model_update(MJpegEncoder *encoder, size_t enc_size)
+{
+    MJpegEncoderQualityModel *model = &encoder->rate_control.quality_model;
+    int quality_id = encoder->rate_control.quality_id;
+    uint64_t pixels = (uint64_t)encoder->cinfo.image_width * encoder->cinfo.image_height;
+    double bytes_per_pixel;
+    double factor;
+    int i;
+
+    if (!pixels) {
+        return;
+    }
+    bytes_per_pixel = (double)enc_size / pixels;
+    if (model->complexity && model->quality_id != quality_id) {
+        /* assuming the content did not change much since the last frame;
+         * a scene change is kept from moving the factor too far */
+        factor = bytes_per_pixel / model->complexity;
+        factor = MAX(factor, model->size_factors[quality_id] / 2);
+        factor = MIN(factor, model->size_factors[quality_id] * 2);
+        model->size_factors[quality_id] += MJPEG_QUALITY_MODEL_WEIGHT *
+                                           (factor - model->size_factors[quality_id]);
+        /* a better quality never makes the frames smaller */
+        for (i = quality_id + 1; i < MJPEG_QUALITY_SAMPLE_NUM; i++) {
+            model->size_factors[i] = MAX(model->size_factors[i], model->size_factors[i - 1]);
+        }
+        for (i = quality_id - 1; i >= 0; i--) {
+            model->size_factors[i] = MIN(model->size_factors[i], model->size_factors[i + 1]);
+        }
+        factor = model->size_factors[MJPEG_QUALITY_SAMPLE_NUM / 2];
+        for (i = 0; i < MJPEG_QUALITY_SAMPLE_NUM; i++) {
+            model->size_factors[i] /= factor;
+        }
+    }
+    model->complexity = bytes_per_pixel / model->size_factors[quality_id];
+    model->pixels = pixels;
+    model->quality_id = quality_id;
+}
+
+static uint64_t mjpeg_encoder_quality_model_predict(MJpegEncoder *encoder, int quality_id)
+{
+    MJpegEncoderQualityModel *model = &encoder->rate_control.quality_model;
+
+    return MAX(1, model->pixels * model->complexity * model->size_factors[quality_id]);
+}
+
+/* the biggest frame that still reaches the client within max_playback_delay,
+ * see get_min_required_playback_delay */
+static uint64_t mjpeg_encoder_get_max_frame_size(MJpegEncoder *encoder)
+{
+    MJpegEncoderRateControl *rate_control = &encoder->rate_control;
+    uint32_t latency;
+
+    if (!rate_control->max_playback_delay) {
+        return UINT64_MAX;
+    }
+    latency = mjpeg_encoder_get_latency(encoder);
+    if (latency >= rate_control->max_playback_delay) {
+        return 1;
+    }
+    return MAX(1, rate_control->byte_rate * (rate_control->max_playback_delay - latency) / 2000);
+}
+
 #define QUALITY_WAS_EVALUATED(encoder, quality) \
     ((encoder)->rate_control.quality_eval_data.encoded_size_by_quality[(quality)] != 0)
 
@@ -412,6 +687,7 @@ static inline void mjpeg_encoder_eval_quality(MJpegEncoder *encoder)
     uint32_t final_quality_id;
     uint32_t final_fps;
     uint64_t final_quality_enc_size;
+    uint64_t max_frame_size;
 
     rate_control = &encoder->rate_control;
     quality_eval = &rate_control->quality_eval_data;
@@ -502,6 +778,7 @@ static inline void mjpeg_encoder_eval_quality(MJpegEncoder *encoder)
     return;
 
 complete_sample:
+    encoder->num_quality_evals++;
     if (quality_eval->max_sampled_fps != 0) {
         /* covering a case were monotonicity was violated and we sampled
            a better jepg quality, with better frame rate. */
@@ -510,6 +787,17 @@ complete_sample:
     } else {
         final_quality_id = rate_control->quality_id;
     }
+    /* with a bounded playback delay, a lower quality is picked until the
+     * frames are small enough to arrive in time */
+    max_frame_size = mjpeg_encoder_get_max_frame_size(encoder);
+    while (final_quality_id > 0 && final_quality_id > quality_eval->min_quality_id &&
+           quality_eval->encoded_size_by_quality[final_quality_id] > max_frame_size) {
+        final_quality_id--;
+        if (!QUALITY_WAS_EVALUATED(encoder, final_quality_id)) {
+            quality_eval->encoded_size_by_quality[final_quality_id] =
+                mjpeg_encoder_quality_model_predict(encoder, final_quality_id);
+        }
+    }
     final_quality_enc_size = quality_eval->encoded_size_by_quality[final_quality_id];
     final_fps = get_max_fps(final_quality_enc_size,
                             rate_control->byte_rate);
@@ -526,7 +814,8 @@ complete_sample:
 
     spice_debug("MJpeg quality sample end %p: quality %d fps %d",
                 encoder, mjpeg_quality_samples[rate_control->quality_id], rate_control->fps);
-    if (encoder->cbs.update_client_playback_delay) {
+    mjpeg_encoder_eval_scale(encoder, final_quality_enc_size, src_fps);
+    if (encoder->cbs.update_client_playback_delay && !rate_control->max_playback_delay) {
         uint32_t latency = mjpeg_encoder_get_latency(encoder);
         uint32_t min_delay = get_min_required_playback_delay(final_quality_enc_size,
                                                              rate_control->byte_rate,
@@ -564,6 +853,35 @@ static void mjpeg_encoder_quality_eval_set_downgrade(MJpegEncoder *encoder,
     quality_eval->max_quality_fps = max_quality_fps;
 }
 
+/*
+ * Called when a quality evaluation ended, see MJPEG_MAX_SCALE_SHIFT. A new
+ * scale changes the frame sizes the quality and the fps were based on, so
+ * they are evaluated again.
+ */
+static void mjpeg_encoder_eval_scale(MJpegEncoder *encoder, uint64_t enc_size, uint32_t src_fps)
+{
+    MJpegEncoderRateControl *rate_control = &encoder->rate_control;
+
+    if (rate_control->quality_id == 0 &&
+        rate_control->fps < MIN(MJPEG_SCALE_DOWN_FPS_TH, src_fps) &&
+        rate_control->scale_shift < rate_control->max_scale_shift) {
+        rate_control->scale_shift++;
+        spice_debug("mjpeg %p: fps %u at the lowest quality, scale 1/%d",
+                    encoder, rate_control->fps, 1 << rate_control->scale_shift);
+        mjpeg_encoder_quality_eval_set_upgrade(encoder, MJPEG_QUALITY_EVAL_REASON_SIZE_CHANGE,
+                                               0, rate_control->fps);
+    } else if (rate_control->scale_shift > 0 &&
+               get_max_fps(enc_size * MJPEG_SCALE_SIZE_FACTOR,
+                           rate_control->byte_rate) >= MJPEG_SCALE_UP_FPS_TH) {
+        rate_control->scale_shift--;
+        spice_debug("mjpeg %p: quality %d fps %u, scale 1/%d",
+                    encoder, mjpeg_quality_samples[rate_control->quality_id],
+                    rate_control->fps, 1 << rate_control->scale_shift);
+        mjpeg_encoder_quality_eval_set_upgrade(encoder, MJPEG_QUALITY_EVAL_REASON_SIZE_CHANGE,
+                                               0, MJPEG_MIN_FPS);
+    }
+}
+
 static void mjpeg_encoder_adjust_params_to_bit_rate(MJpegEncoder *encoder)
 {
     MJpegEncoderRateControl *rate_control;
@@ -584,8 +902,20 @@ static void mjpeg_encoder_adjust_params_to_bit_rate(MJpegEncoder *encoder)
     }
 
     if (rate_control->during_quality_eval) {
+        int scale_shift = rate_control->scale_shift;
+        int i;
+
         quality_eval->encoded_size_by_quality[rate_control->quality_id] = rate_control->last_enc_size;
         mjpeg_encoder_eval_quality(encoder);
+        /* the sizes of the qualities the evaluation moves to are predicted
+         * instead of sampled from the next frames, until it ends or
+         * changes the scale of the frames */
+        for (i = 0; i < MJPEG_QUALITY_SAMPLE_NUM && rate_control->during_quality_eval &&
+                    rate_control->scale_shift == scale_shift; i++) {
+            quality_eval->encoded_size_by_quality[rate_control->quality_id] =
+                mjpeg_encoder_quality_model_predict(encoder, rate_control->quality_id);
+            mjpeg_encoder_eval_quality(encoder);
+        }
         return;
     }
 
@@ -694,32 +1024,27 @@ static void mjpeg_encoder_adjust_fps(MJpegEncoder *encoder, uint64_t now)
 }
 
 /*
- * dest must be either NULL or allocated by malloc, since it might be freed
- * during the encoding, if its size is too small.
- *
  * return:
  *  MJPEG_ENCODER_FRAME_UNSUPPORTED : frame cannot be encoded
  *  MJPEG_ENCODER_FRAME_DROP        : frame should be dropped. This value can only be returned
  *                                    if mjpeg rate control is active.
  *  MJPEG_ENCODER_FRAME_ENCODE_DONE : frame encoding started. Continue with
- *                                    mjpeg_encoder_encode_scanline.
+ *                                    encode_frame.
+ * A frame part is encoded at the settings of the frame, without rate control.
  */
 static int mjpeg_encoder_start_frame(MJpegEncoder *encoder,
                                      SpiceBitmapFmt format,
                                      int width, int height,
-                                     uint8_t **dest, size_t *dest_len,
-                                     uint32_t frame_mm_time)
+                                     uint32_t frame_mm_time, int frame_part)
 {
     uint32_t quality;
 
-    if (rate_control_is_active(encoder)) {
+    if (rate_control_is_active(encoder) && !frame_part) {
         MJpegEncoderRateControl *rate_control = &encoder->rate_control;
-        struct timespec time;
         uint64_t now;
         uint64_t interval;
 
-        clock_gettime(CLOCK_MONOTONIC, &time);
-        now = ((uint64_t) time.tv_sec) * 1000000000 + time.tv_nsec;
+        now = mjpeg_encoder_get_time(encoder);
 
         if (!rate_control->adjusted_fps_start_time) {
             rate_control->adjusted_fps_start_time = now;
@@ -749,7 +1074,7 @@ static int mjpeg_encoder_start_frame(MJpegEncoder *encoder,
 
     encoder->cinfo.in_color_space   = JCS_RGB;
     encoder->cinfo.input_components = 3;
-    encoder->pixel_converter = NULL;
+    encoder->line_converter = NULL;
 
     switch (format) {
     case SPICE_BITMAP_FMT_32BIT:
@@ -759,19 +1084,23 @@ static int mjpeg_encoder_start_frame(MJpegEncoder *encoder,
         encoder->cinfo.in_color_space   = JCS_EXT_BGRX;
         encoder->cinfo.input_components = 4;
 #else
-        encoder->pixel_converter = pixel_rgb32bpp_to_24;
+        encoder->line_converter = line_rgb32bpp_to_24;
 #endif
         break;
     case SPICE_BITMAP_FMT_16BIT:
         encoder->bytes_per_pixel = 2;
-        encoder->pixel_converter = pixel_rgb16bpp_to_24;
+#ifdef JCS_EXTENSIONS
+        encoder->cinfo.in_color_space   = JCS_EXT_BGRX;
+        encoder->cinfo.input_components = 4;
+#endif
+        encoder->line_converter = encoder->rgb16_converter;
         break;
     case SPICE_BITMAP_FMT_24BIT:
         encoder->bytes_per_pixel = 3;
 #ifdef JCS_EXTENSIONS
         encoder->cinfo.in_color_space = JCS_EXT_BGR;
 #else
-        encoder->pixel_converter = pixel_rgb24bpp_to_24;
+        encoder->line_converter = line_rgb24bpp_to_24;
 #endif
         break;
     default:
@@ -779,19 +1108,26 @@ static int mjpeg_encoder_start_frame(MJpegEncoder *encoder,
         return MJPEG_ENCODER_FRAME_UNSUPPORTED;
     }
 
-    if (encoder->pixel_converter != NULL) {
-        unsigned int stride = width * 3;
+    if (encoder->line_converter != NULL) {
+        unsigned int stride = width * encoder->cinfo.input_components;
         /* check for integer overflow */
-        if (stride < width) {
+        if (stride < width || stride > UINT32_MAX / MJPEG_BATCH_LINES) {
             return MJPEG_ENCODER_FRAME_UNSUPPORTED;
         }
         if (encoder->row_size < stride) {
-            encoder->row = spice_realloc(encoder->row, stride);
+            encoder->rows = spice_realloc(encoder->rows, stride * MJPEG_BATCH_LINES);
             encoder->row_size = stride;
         }
     }
 
-    spice_jpeg_mem_dest(&encoder->cinfo, dest, dest_len);
+    encoder->scale_shift = 0;
+    while (encoder->scale_shift < encoder->rate_control.scale_shift &&
+           (width + 1) / 2 >= MJPEG_SCALE_MIN_SIZE &&
+           (height + 1) / 2 >= MJPEG_SCALE_MIN_SIZE) {
+        width = (width + 1) / 2;
+        height = (height + 1) / 2;
+        encoder->scale_shift++;
+    }
 
     encoder->cinfo.image_width      = width;
     encoder->cinfo.image_height     = height;
@@ -799,52 +1135,57 @@ static int mjpeg_encoder_start_frame(MJpegEncoder *encoder,
     encoder->cinfo.dct_method       = JDCT_IFAST;
     quality = mjpeg_quality_samples[encoder->rate_control.quality_id];
     jpeg_set_quality(&encoder->cinfo, quality, TRUE);
-    jpeg_start_compress(&encoder->cinfo, encoder->first_frame);
+    encoder->quality = quality;
 
-    encoder->num_frames++;
-    encoder->avg_quality += quality;
+    if (!frame_part) {
+        encoder->num_frames++;
+        encoder->avg_quality += quality;
+    }
     return MJPEG_ENCODER_FRAME_ENCODE_DONE;
 }
 
-static int mjpeg_encoder_encode_scanline(MJpegEncoder *encoder,
-                                         uint8_t *src_pixels,
-                                         size_t image_width)
+/* lines holds num_lines pointers to the first pixel of the lines to encode,
+ * num_lines is at most MJPEG_BATCH_LINES, rows has room for as many
+ * converted lines */
+static unsigned int mjpeg_encoder_write_lines(MJpegEncoder *encoder, j_compress_ptr cinfo,
+                                              uint8_t *rows, uint8_t **lines, int num_lines)
 {
-    unsigned int scanlines_written;
-    uint8_t *row;
+    uint8_t *converted[MJPEG_BATCH_LINES];
+    int i;
 
-    row = encoder->row;
-    if (encoder->pixel_converter) {
-        unsigned int x;
-        for (x = 0; x < image_width; x++) {
-            /* src_pixels is expected to be 4 bytes aligned */
-            encoder->pixel_converter(src_pixels, row);
-            row += 3;
-            src_pixels += encoder->bytes_per_pixel;
-        }
-        scanlines_written = jpeg_write_scanlines(&encoder->cinfo, &encoder->row, 1);
-    } else {
-        scanlines_written = jpeg_write_scanlines(&encoder->cinfo, &src_pixels, 1);
+    if (!encoder->line_converter) {
+        return jpeg_write_scanlines(cinfo, lines, num_lines);
     }
-    if (scanlines_written == 0) { /* Not enough space */
-        jpeg_abort_compress(&encoder->cinfo);
-        encoder->rate_control.last_enc_size = 0;
-        return 0;
+    for (i = 0; i < num_lines; i++) {
+        converted[i] = rows + i * encoder->row_size;
+        encoder->line_converter(lines[i], cinfo->image_width, converted[i]);
     }
-
-    return scanlines_written;
+    return jpeg_write_scanlines(cinfo, converted, num_lines);
 }
 
-static size_t mjpeg_encoder_end_frame(MJpegEncoder *encoder)
+static void mjpeg_encoder_end_frame(MJpegEncoder *encoder, size_t enc_size, int frame_part)
 {
-    mem_destination_mgr *dest = (mem_destination_mgr *) encoder->cinfo.dest;
     MJpegEncoderRateControl *rate_control = &encoder->rate_control;
 
-    jpeg_finish_compress(&encoder->cinfo);
+    if (frame_part) {
+        /* the part adds to the size and the area of its frame */
+        rate_control->last_enc_size += enc_size;
+        rate_control->quality_model.pixels +=
+            (uint64_t)encoder->cinfo.image_width * encoder->cinfo.image_height;
+        if (!rate_control->during_quality_eval ||
+            rate_control->quality_eval_data.reason == MJPEG_QUALITY_EVAL_REASON_SIZE_CHANGE) {
+            if (!rate_control->during_quality_eval) {
+                rate_control->sum_recent_enc_size += enc_size;
+            }
+            rate_control->bit_rate_info.sum_enc_size += enc_size;
+        }
+        return;
+    }
 
     encoder->first_frame = FALSE;
-    rate_control->last_enc_size = dest->pub.next_output_byte - dest->buffer;
+    rate_control->last_enc_size = enc_size;
     rate_control->server_state.num_frames_encoded++;
+    mjpeg_encoder_quality_model_update(encoder, enc_size);
 
     if (!rate_control->during_quality_eval ||
         rate_control->quality_eval_data.reason == MJPEG_QUALITY_EVAL_REASON_SIZE_CHANGE) {
@@ -861,7 +1202,6 @@ static size_t mjpeg_encoder_end_frame(MJpegEncoder *encoder)
         rate_control->bit_rate_info.sum_enc_size += encoder->rate_control.last_enc_size;
         rate_control->bit_rate_info.num_enc_frames++;
     }
-    return encoder->rate_control.last_enc_size;
 }
 
 static inline uint8_t *get_image_line(SpiceChunks *chunks, size_t *offset,
@@ -890,8 +1230,279 @@ static inline uint8_t *get_image_line(SpiceChunks *chunks, size_t *offset,
     return ret;
 }
 
-static int encode_frame(MJpegEncoder *encoder, const SpiceRect *src,
-                        const SpiceBitmap *image, int top_down)
+/*
+ * Stripe encoding
+ *
+ * Each stripe is encoded as a JPEG of its own, with the settings of the
+ * frame and a restart interval that spans the whole stripe. The stripes are
+ * then joined in a single JPEG: the headers of the first stripe, with the
+ * height of the frame, and the entropy coded data of the stripes separated
+ * by restart markers. The stripes start at MCU row boundaries and the DC
+ * prediction restarts at every marker, so the result is the frame encoded
+ * at once with that restart interval, which any decoder handles.
+ */
+
+typedef struct MJpegStripePool {
+    pthread_mutex_t lock;
+    pthread_cond_t work_cond;
+    pthread_cond_t done_cond;
+    int num_threads;       // including the thread that encodes the frame
+    MJpegEncoder *encoder; // encoder of the frame being split, NULL if idle
+    int next_stripe;
+    int stripes_left;
+    uint64_t cpu_time;     // of the pool threads on the frame
+} MJpegStripePool;
+
+static MJpegStripePool stripe_pool = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .work_cond = PTHREAD_COND_INITIALIZER,
+    .done_cond = PTHREAD_COND_INITIALIZER,
+    .num_threads = 1,
+};
+static pthread_once_t stripe_pool_once = PTHREAD_ONCE_INIT;
+
+static void mjpeg_encoder_encode_stripe(MJpegEncoder *encoder, MJpegStripe *stripe)
+{
+    j_compress_ptr cinfo = &stripe->cinfo;
+    mem_destination_mgr *dest;
+    int i;
+
+    if (!stripe->created) {
+        cinfo->err = jpeg_std_error(&stripe->jerr);
+        jpeg_create_compress(cinfo);
+        stripe->created = TRUE;
+    }
+    if (encoder->line_converter && stripe->row_size < encoder->row_size) {
+        stripe->rows = spice_realloc(stripe->rows, encoder->row_size * MJPEG_BATCH_LINES);
+        stripe->row_size = encoder->row_size;
+    }
+
+    spice_jpeg_mem_dest(cinfo, &stripe->out, &stripe->out_size);
+    cinfo->in_color_space   = encoder->cinfo.in_color_space;
+    cinfo->input_components = encoder->cinfo.input_components;
+    cinfo->image_width      = encoder->cinfo.image_width;
+    cinfo->image_height     = stripe->num_lines;
+    jpeg_set_defaults(cinfo);
+    cinfo->dct_method       = JDCT_IFAST;
+    jpeg_set_quality(cinfo, encoder->quality, TRUE);
+    cinfo->restart_interval = encoder->stripe_restart_interval;
+    jpeg_start_compress(cinfo, TRUE);
+
+    for (i = 0; i < stripe->num_lines; i += MJPEG_BATCH_LINES) {
+        mjpeg_encoder_write_lines(encoder, cinfo, stripe->rows,
+                                  encoder->lines + stripe->first_line + i,
+                                  MIN(MJPEG_BATCH_LINES, stripe->num_lines - i));
+    }
+
+    jpeg_finish_compress(cinfo);
+    dest = (mem_destination_mgr *) cinfo->dest;
+    stripe->out_len = dest->pub.next_output_byte - dest->buffer;
+}
+
+static void *mjpeg_stripe_thread(void *opaque)
+{
+    MJpegStripePool *pool = opaque;
+    MJpegEncoder *encoder;
+    uint64_t cpu_time;
+    int stripe;
+
+    for (;;) {
+        pthread_mutex_lock(&pool->lock);
+        while (!pool->encoder || pool->next_stripe >= pool->encoder->num_stripes) {
+            pthread_cond_wait(&pool->work_cond, &pool->lock);
+        }
+        encoder = pool->encoder;
+        stripe = pool->next_stripe++;
+        pthread_mutex_unlock(&pool->lock);
+
+        cpu_time = mjpeg_get_thread_cpu_time();
+        mjpeg_encoder_encode_stripe(encoder, &encoder->stripes[stripe]);
+        cpu_time = mjpeg_get_thread_cpu_time() - cpu_time;
+
+        pthread_mutex_lock(&pool->lock);
+        pool->cpu_time += cpu_time;
+        if (--pool->stripes_left == 0) {
+            pthread_cond_signal(&pool->done_cond);
+        }
+        pthread_mutex_unlock(&pool->lock);
+    }
+    return NULL;
+}
+
+static void mjpeg_stripe_pool_init(void)
+{
+    long num_threads;
+    int i;
+
+    num_threads = red_get_env_int("SPICE_MJPEG_THREADS", 1, INT_MAX,
+                                  MAX(sysconf(_SC_NPROCESSORS_ONLN), 1));
+    num_threads = MIN(num_threads, MJPEG_MAX_STRIPES);
+
+    for (i = 1; i < num_threads; i++) {
+        pthread_t thread;
+
+        if (pthread_create(&thread, NULL, mjpeg_stripe_thread, &stripe_pool)) {
+            spice_warning("failed to create mjpeg stripe thread");
+            break;
+        }
+        pthread_detach(thread);
+        stripe_pool.num_threads++;
+    }
+}
+
+/* encodes the stripes of the frame on the pool threads and the calling one */
+static void mjpeg_stripe_pool_run(MJpegEncoder *encoder)
+{
+    MJpegStripePool *pool = &stripe_pool;
+    int stripe;
+
+    pthread_mutex_lock(&pool->lock);
+    if (pool->encoder) {
+        // the pool is busy with the frame of another worker
+        pthread_mutex_unlock(&pool->lock);
+        for (stripe = 0; stripe < encoder->num_stripes; stripe++) {
+            mjpeg_encoder_encode_stripe(encoder, &encoder->stripes[stripe]);
+        }
+        return;
+    }
+
+    pool->encoder = encoder;
+    pool->next_stripe = 0;
+    pool->stripes_left = encoder->num_stripes;
+    pool->cpu_time = 0;
+    pthread_cond_broadcast(&pool->work_cond);
+    while (pool->next_stripe < encoder->num_stripes) {
+        stripe = pool->next_stripe++;
+        pthread_mutex_unlock(&pool->lock);
+        mjpeg_encoder_encode_stripe(encoder, &encoder->stripes[stripe]);
+        pthread_mutex_lock(&pool->lock);
+        pool->stripes_left--;
+    }
+    while (pool->stripes_left > 0) {
+        pthread_cond_wait(&pool->done_cond, &pool->lock);
+    }
+    encoder->pool_cpu_time += pool->cpu_time;
+    pool->encoder = NULL;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/* splits the frame in stripes, returns FALSE if it should be encoded at once */
+static int mjpeg_encoder_split_frame(MJpegEncoder *encoder)
+{
+    j_compress_ptr cinfo = &encoder->cinfo;
+    unsigned int mcu_width, mcu_height, stripe_lines, restart_interval;
+    int max_h_samp_factor = 1, max_v_samp_factor = 1;
+    int num_stripes, i;
+
+    num_stripes = MIN(stripe_pool.num_threads, cinfo->image_height / MJPEG_STRIPE_MIN_LINES);
+    if (num_stripes <= 1) {
+        return FALSE;
+    }
+
+    for (i = 0; i < cinfo->num_components; i++) {
+        max_h_samp_factor = MAX(max_h_samp_factor, cinfo->comp_info[i].h_samp_factor);
+        max_v_samp_factor = MAX(max_v_samp_factor, cinfo->comp_info[i].v_samp_factor);
+    }
+    mcu_width = max_h_samp_factor * DCTSIZE;
+    mcu_height = max_v_samp_factor * DCTSIZE;
+
+    stripe_lines = (cinfo->image_height + num_stripes - 1) / num_stripes;
+    stripe_lines = (stripe_lines + mcu_height - 1) / mcu_height * mcu_height;
+    restart_interval = (cinfo->image_width + mcu_width - 1) / mcu_width *
+                       (stripe_lines / mcu_height);
+    if (restart_interval > 65535) {
+        return FALSE;
+    }
+
+    encoder->num_stripes = (cinfo->image_height + stripe_lines - 1) / stripe_lines;
+    encoder->stripe_restart_interval = restart_interval;
+    for (i = 0; i < encoder->num_stripes; i++) {
+        encoder->stripes[i].first_line = i * stripe_lines;
+        encoder->stripes[i].num_lines = MIN(stripe_lines,
+                                            cinfo->image_height - i * stripe_lines);
+    }
+    return TRUE;
+}
+
+/* returns the offset of the entropy coded data of a JPEG written by libjpeg,
+ * and in o_sof the offset of its frame header, or 0 if they are not found */
+static size_t mjpeg_find_scan_data(const uint8_t *jpeg, size_t len, size_t *o_sof)
+{
+    size_t pos = 2; // SOI
+
+    *o_sof = 0;
+    while (pos + 4 <= len && jpeg[pos] == 0xff) {
+        uint8_t marker = jpeg[pos + 1];
+
+        if (marker >= 0xc0 && marker <= 0xc2) {
+            *o_sof = pos;
+        }
+        pos += 2 + ((jpeg[pos + 2] << 8) | jpeg[pos + 3]);
+        if (marker == 0xda) {
+            return (*o_sof && pos + 2 <= len) ? pos : 0;
+        }
+    }
+    return 0;
+}
+
+/* joins the encoded stripes in dest, see Stripe encoding above; dest is
+ * reallocated like by spice_jpeg_mem_dest */
+static size_t mjpeg_encoder_join_stripes(MJpegEncoder *encoder,
+                                         uint8_t **dest, size_t *dest_len)
+{
+    size_t data_offset[MJPEG_MAX_STRIPES];
+    size_t sof, unused_sof, size;
+    uint8_t *out;
+    int i;
+
+    data_offset[0] = mjpeg_find_scan_data(encoder->stripes[0].out,
+                                          encoder->stripes[0].out_len, &sof);
+    if (!data_offset[0]) {
+        spice_warning("bad stripe jpeg");
+        return 0;
+    }
+    size = encoder->stripes[0].out_len;
+    for (i = 1; i < encoder->num_stripes; i++) {
+        MJpegStripe *stripe = &encoder->stripes[i];
+
+        data_offset[i] = mjpeg_find_scan_data(stripe->out, stripe->out_len, &unused_sof);
+        if (!data_offset[i]) {
+            spice_warning("bad stripe jpeg");
+            return 0;
+        }
+        // the restart marker replaces the end of image of the previous stripe
+        size += stripe->out_len - data_offset[i];
+    }
+
+    if (*dest == NULL || *dest_len < size) {
+        free(*dest);
+        *dest = spice_malloc(size);
+        *dest_len = size;
+    }
+    out = *dest;
+
+    memcpy(out, encoder->stripes[0].out, encoder->stripes[0].out_len - 2);
+    out[sof + 5] = encoder->cinfo.image_height >> 8;
+    out[sof + 6] = encoder->cinfo.image_height & 0xff;
+    out += encoder->stripes[0].out_len - 2;
+    for (i = 1; i < encoder->num_stripes; i++) {
+        MJpegStripe *stripe = &encoder->stripes[i];
+        size_t data_len = stripe->out_len - data_offset[i] - 2;
+
+        *out++ = 0xff;
+        *out++ = JPEG_RST0 + ((i - 1) & 7);
+        memcpy(out, stripe->out + data_offset[i], data_len);
+        out += data_len;
+    }
+    *out++ = 0xff;
+    *out++ = JPEG_EOI;
+    spice_assert(out - *dest == size);
+    return size;
+}
+
+/* collects the lines of the frame in encoder->lines */
+static int mjpeg_encoder_get_frame_lines(MJpegEncoder *encoder, const SpiceRect *src,
+                                         const SpiceBitmap *image, int top_down)
 {
     SpiceChunks *chunks;
     uint32_t image_stride;
@@ -909,8 +1520,11 @@ static int encode_frame(MJpegEncoder *encoder, const SpiceRect *src,
     }
 
     const unsigned int stream_height = src->bottom - src->top;
-    const unsigned int stream_width = src->right - src->left;
 
+    if (encoder->lines_size < stream_height) {
+        encoder->lines = spice_renew(uint8_t *, encoder->lines, stream_height);
+        encoder->lines_size = stream_height;
+    }
     for (i = 0; i < stream_height; i++) {
         uint8_t *src_line = get_image_line(chunks, &offset, &chunk, image_stride);
 
@@ -918,38 +1532,216 @@ static int encode_frame(MJpegEncoder *encoder, const SpiceRect *src,
             return FALSE;
         }
 
-        src_line += src->left * mjpeg_encoder_get_bytes_per_pixel(encoder);
-        if (mjpeg_encoder_encode_scanline(encoder, src_line, stream_width) == 0) {
-            return FALSE;
-        }
+        encoder->lines[i] = src_line + src->left * mjpeg_encoder_get_bytes_per_pixel(encoder);
     }
 
     return TRUE;
 }
 
-int mjpeg_encoder_encode_frame(MJpegEncoder *encoder,
-                               const SpiceBitmap *bitmap, int width, int height,
-                               const SpiceRect *src,
-                               int top_down, uint32_t frame_mm_time,
-                               uint8_t **outbuf, size_t *outbuf_size,
-                               int *data_size)
+/* halves the width and height of the frame in encoder->lines scale_shift
+ * times. The lines then point to the scaled frame, which is already
+ * converted. */
+static void mjpeg_encoder_scale_frame(MJpegEncoder *encoder, int width, int height)
+{
+    unsigned int components = encoder->cinfo.input_components;
+    MJpegHalveLinesFunc halver = components == 4 ? encoder->bgrx_halver : line_halve_24;
+    size_t size = 0;
+    uint8_t *dest;
+    int level, w, h, y;
+
+    for (level = 0, w = width, h = height; level < encoder->scale_shift; level++) {
+        w = (w + 1) / 2;
+        h = (h + 1) / 2;
+        size += (size_t)w * components * h;
+    }
+    if (encoder->scaled_size < size) {
+        free(encoder->scaled);
+        encoder->scaled = spice_malloc(size);
+        encoder->scaled_size = size;
+    }
+
+    dest = encoder->scaled;
+    for (level = 0; level < encoder->scale_shift; level++) {
+        uint32_t stride = (width + 1) / 2 * components;
+
+        for (y = 0; y < (height + 1) / 2; y++) {
+            uint8_t *line0 = encoder->lines[y * 2];
+            uint8_t *line1 = encoder->lines[MIN(y * 2 + 1, height - 1)];
+
+            if (level == 0 && encoder->line_converter) {
+                encoder->line_converter(line0, width, encoder->rows);
+                encoder->line_converter(line1, width, encoder->rows + encoder->row_size);
+                line0 = encoder->rows;
+                line1 = encoder->rows + encoder->row_size;
+            }
+            // the lines still to read are after lines[y]
+            halver(line0, line1, width, dest);
+            encoder->lines[y] = dest;
+            dest += stride;
+        }
+        width = (width + 1) / 2;
+        height = (height + 1) / 2;
+    }
+    encoder->line_converter = NULL;
+    encoder->num_scaled_frames++;
+}
+
+/* returns the size of the encoded frame, 0 on failure */
+static size_t encode_frame(MJpegEncoder *encoder, const SpiceRect *src,
+                           const SpiceBitmap *image, int top_down,
+                           uint8_t **dest, size_t *dest_len)
+{
+    mem_destination_mgr *mem_dest;
+    unsigned int height = encoder->cinfo.image_height;
+    unsigned int i, num_lines;
+
+    if (!mjpeg_encoder_get_frame_lines(encoder, src, image, top_down)) {
+        return 0;
+    }
+    if (encoder->scale_shift) {
+        mjpeg_encoder_scale_frame(encoder, src->right - src->left, src->bottom - src->top);
+    }
+
+    if (mjpeg_encoder_split_frame(encoder)) {
+        mjpeg_stripe_pool_run(encoder);
+        return mjpeg_encoder_join_stripes(encoder, dest, dest_len);
+    }
+
+    spice_jpeg_mem_dest(&encoder->cinfo, dest, dest_len);
+    jpeg_start_compress(&encoder->cinfo, encoder->first_frame);
+    for (i = 0; i < height; i += num_lines) {
+        num_lines = MIN(MJPEG_BATCH_LINES, height - i);
+        if (mjpeg_encoder_write_lines(encoder, &encoder->cinfo, encoder->rows,
+                                      encoder->lines + i, num_lines) == 0) {
+            /* Not enough space */
+            jpeg_abort_compress(&encoder->cinfo);
+            return 0;
+        }
+    }
+    jpeg_finish_compress(&encoder->cinfo);
+
+    mem_dest = (mem_destination_mgr *) encoder->cinfo.dest;
+    return mem_dest->pub.next_output_byte - mem_dest->buffer;
+}
+
+MJpegFrameCache *mjpeg_frame_cache_new(void)
+{
+    return spice_new0(MJpegFrameCache, 1);
+}
+
+void mjpeg_frame_cache_destroy(MJpegFrameCache *cache)
+{
+    int i;
+
+    for (i = 0; i < MJPEG_QUALITY_SAMPLE_NUM; i++) {
+        free(cache->frames[i].data);
+    }
+    free(cache);
+}
+
+static int mjpeg_encoder_encode(MJpegEncoder *encoder, int frame_part,
+                                MJpegFrameCache *cache, uint64_t frame_id,
+                                const SpiceBitmap *bitmap, int width, int height,
+                                const SpiceRect *src,
+                                int top_down, uint32_t frame_mm_time,
+                                uint8_t **outbuf, size_t *outbuf_size,
+                                int *data_size, int *enc_width, int *enc_height)
 {
+    MJpegCachedFrame *cached = NULL;
+    size_t enc_size;
+    uint64_t start_time = mjpeg_encoder_get_cpu_time(encoder);
+    int during_quality_eval = encoder->rate_control.during_quality_eval && !frame_part;
     int ret = mjpeg_encoder_start_frame(encoder, bitmap->format,
-                                    width, height, outbuf, outbuf_size,
-                                    frame_mm_time);
+                                        width, height, frame_mm_time, frame_part);
+    if (during_quality_eval) {
+        /* the evaluation step of mjpeg_encoder_adjust_params_to_bit_rate */
+        encoder->quality_eval_time += mjpeg_encoder_get_cpu_time(encoder) - start_time;
+    }
     if (ret != MJPEG_ENCODER_FRAME_ENCODE_DONE) {
         return ret;
     }
+    during_quality_eval = encoder->rate_control.during_quality_eval && !frame_part;
+    start_time = mjpeg_encoder_get_cpu_time(encoder);
+    width = encoder->cinfo.image_width;
+    height = encoder->cinfo.image_height;
+    *enc_width = width;
+    *enc_height = height;
+
+    if (cache) {
+        cached = &cache->frames[encoder->rate_control.quality_id];
+        if (cached->data && cached->frame_id == frame_id &&
+            cached->width == width && cached->height == height) {
+            if (*outbuf == NULL || *outbuf_size < cached->size) {
+                free(*outbuf);
+                *outbuf = spice_malloc(cached->size);
+                *outbuf_size = cached->size;
+            }
+            memcpy(*outbuf, cached->data, cached->size);
+            encoder->num_shared_frames++;
+            mjpeg_encoder_end_frame(encoder, cached->size, frame_part);
+            *data_size = cached->size;
+            if (during_quality_eval) {
+                encoder->num_eval_frames++;
+            }
+            return MJPEG_ENCODER_FRAME_ENCODE_DONE;
+        }
+    }
 
-    if (!encode_frame(encoder, src, bitmap, top_down)) {
+    enc_size = encode_frame(encoder, src, bitmap, top_down, outbuf, outbuf_size);
+    if (enc_size == 0) {
+        encoder->rate_control.last_enc_size = 0;
         return MJPEG_ENCODER_FRAME_UNSUPPORTED;
     }
 
-    *data_size = mjpeg_encoder_end_frame(encoder);
+    if (cached) {
+        if (cached->buf_size < enc_size) {
+            free(cached->data);
+            cached->data = spice_malloc(enc_size);
+            cached->buf_size = enc_size;
+        }
+        memcpy(cached->data, *outbuf, enc_size);
+        cached->size = enc_size;
+        cached->frame_id = frame_id;
+        cached->width = width;
+        cached->height = height;
+    }
+
+    mjpeg_encoder_end_frame(encoder, enc_size, frame_part);
+    *data_size = enc_size;
+    if (during_quality_eval) {
+        /* the frame is encoded at a quality the evaluation samples */
+        encoder->num_eval_frames++;
+        encoder->quality_eval_time += mjpeg_encoder_get_cpu_time(encoder) - start_time;
+    }
 
     return MJPEG_ENCODER_FRAME_ENCODE_DONE;
 }
 
+int mjpeg_encoder_encode_frame(MJpegEncoder *encoder,
+                               MJpegFrameCache *cache, uint64_t frame_id,
+                               const SpiceBitmap *bitmap, int width, int height,
+                               const SpiceRect *src,
+                               int top_down, uint32_t frame_mm_time,
+                               uint8_t **outbuf, size_t *outbuf_size,
+                               int *data_size, int *enc_width, int *enc_height)
+{
+    return mjpeg_encoder_encode(encoder, FALSE, cache, frame_id, bitmap, width, height, src,
+                                top_down, frame_mm_time, outbuf, outbuf_size,
+                                data_size, enc_width, enc_height);
+}
+
+int mjpeg_encoder_encode_frame_part(MJpegEncoder *encoder,
+                                    MJpegFrameCache *cache, uint64_t frame_id,
+                                    const SpiceBitmap *bitmap, int width, int height,
+                                    const SpiceRect *src,
+                                    int top_down, uint32_t frame_mm_time,
+                                    uint8_t **outbuf, size_t *outbuf_size,
+                                    int *data_size, int *enc_width, int *enc_height)
+{
+    return mjpeg_encoder_encode(encoder, TRUE, cache, frame_id, bitmap, width, height, src,
+                                top_down, frame_mm_time, outbuf, outbuf_size,
+                                data_size, enc_width, enc_height);
+}
 
 static void mjpeg_encoder_quality_eval_stop(MJpegEncoder *encoder)
 {
@@ -996,11 +1788,9 @@ static void mjpeg_encoder_decrease_bit_rate(MJpegEncoder *encoder)
     rate_control->client_state.max_video_latency = 0;
     rate_control->client_state.max_audio_latency = 0;
     if (rate_control->warmup_start_time) {
-        struct timespec time;
         uint64_t now;
 
-        clock_gettime(CLOCK_MONOTONIC, &time);
-        now = ((uint64_t) time.tv_sec) * 1000000000 + time.tv_nsec;
+        now = mjpeg_encoder_get_time(encoder);
         if (now - rate_control->warmup_start_time < MJPEG_WARMUP_TIME*1000*1000) {
             spice_debug("during warmup. ignoring");
             return;
@@ -1220,6 +2010,18 @@ void mjpeg_encoder_client_stream_report(MJpegEncoder *encoder,
                                                          mjpeg_encoder_get_latency(encoder));
     spice_debug("min-delay %u client-delay %d", min_playback_delay, end_frame_delay);
 
+    if (rate_control->max_playback_delay) {
+        /* the delay does not grow, the bit rate is lowered until the frames
+         * fit in it */
+        if (min_playback_delay > rate_control->max_playback_delay ||
+            end_frame_delay < MJPEG_VIDEO_DELAY_TH) {
+            mjpeg_encoder_handle_negative_client_stream_report(encoder, end_frame_mm_time);
+        } else if (!num_drops) {
+            mjpeg_encoder_handle_positive_client_stream_report(encoder, start_frame_mm_time);
+        }
+        return;
+    }
+
     if (min_playback_delay > end_frame_delay) {
         uint32_t src_fps = encoder->cbs.get_source_fps(encoder->cbs_opaque);
         /*
@@ -1331,12 +2133,52 @@ uint64_t mjpeg_encoder_get_bit_rate(MJpegEncoder *encoder)
     return encoder->rate_control.byte_rate * 8;
 }
 
+void mjpeg_encoder_get_last_frame_quality(MJpegEncoder *encoder, int *quality, int *scale_shift)
+{
+    *quality = encoder->quality;
+    *scale_shift = encoder->scale_shift;
+}
+
+void mjpeg_encoder_get_next_frame_quality(MJpegEncoder *encoder, int *quality, int *scale_shift)
+{
+    *quality = mjpeg_quality_samples[encoder->rate_control.quality_id];
+    *scale_shift = encoder->rate_control.scale_shift;
+}
+
 void mjpeg_encoder_get_stats(MJpegEncoder *encoder, MJpegEncoderStats *stats)
 {
     spice_assert(encoder != NULL && stats != NULL);
     stats->starting_bit_rate = encoder->starting_bit_rate;
     stats->cur_bit_rate = mjpeg_encoder_get_bit_rate(encoder);
     stats->avg_quality = (double)encoder->avg_quality / encoder->num_frames;
+    stats->num_shared_frames = encoder->num_shared_frames;
+    stats->num_scaled_frames = encoder->num_scaled_frames;
+    stats->num_quality_evals = encoder->num_quality_evals;
+    stats->num_eval_frames = encoder->num_eval_frames;
+    stats->quality_eval_time = encoder->quality_eval_time;
+}
+
+void mjpeg_encoder_set_max_playback_delay(MJpegEncoder *encoder, uint32_t delay_ms)
+{
+    encoder->rate_control.max_playback_delay = delay_ms;
+}
+
+void mjpeg_encoder_enable_scaling(MJpegEncoder *encoder)
+{
+    if (rate_control_is_active(encoder)) {
+        encoder->rate_control.max_scale_shift = MJPEG_MAX_SCALE_SHIFT;
+    }
+}
+
+void mjpeg_encoder_set_simd_ops(MJpegEncoder *encoder, const RedBitmapSimdOps *simd_ops)
+{
+#ifdef JCS_EXTENSIONS
+    encoder->rgb16_converter = simd_ops ? simd_ops->rgb16_to_bgrx : line_rgb16bpp_to_bgrx;
+    encoder->bgrx_halver = simd_ops ? simd_ops->halve_bgrx : line_halve_bgrx;
+#else
+    encoder->rgb16_converter = line_rgb16bpp_to_24;
+    encoder->bgrx_halver = line_halve_bgrx;
+#endif
 }
 
 MJpegEncoder *mjpeg_encoder_new(uint64_t starting_bit_rate,
@@ -1349,19 +2191,19 @@ MJpegEncoder *mjpeg_encoder_new(uint64_t starting_bit_rate,
 
     encoder->first_frame = TRUE;
     encoder->rate_control.byte_rate = starting_bit_rate / 8;
+    mjpeg_encoder_set_simd_ops(encoder, NULL);
     encoder->starting_bit_rate = starting_bit_rate;
+    memcpy(encoder->rate_control.quality_model.size_factors, mjpeg_quality_size_factors,
+           sizeof(mjpeg_quality_size_factors));
 
     if (cbs) {
-        struct timespec time;
-
-        clock_gettime(CLOCK_MONOTONIC, &time);
         encoder->cbs = *cbs;
         encoder->cbs_opaque = cbs_opaque;
         mjpeg_encoder_reset_quality(encoder, MJPEG_QUALITY_SAMPLE_NUM / 2, 5, 0);
         encoder->rate_control.during_quality_eval = TRUE;
         encoder->rate_control.quality_eval_data.type = MJPEG_QUALITY_EVAL_TYPE_SET;
         encoder->rate_control.quality_eval_data.reason = MJPEG_QUALITY_EVAL_REASON_RATE_CHANGE;
-        encoder->rate_control.warmup_start_time = ((uint64_t) time.tv_sec) * 1000000000 + time.tv_nsec;
+        encoder->rate_control.warmup_start_time = mjpeg_encoder_get_time(encoder);
     } else {
         encoder->cbs.get_roundtrip_ms = NULL;
         mjpeg_encoder_reset_quality(encoder, MJPEG_LEGACY_STATIC_QUALITY_ID, MJPEG_MAX_FPS, 0);
@@ -1369,6 +2211,7 @@ MJpegEncoder *mjpeg_encoder_new(uint64_t starting_bit_rate,
 
     encoder->cinfo.err = jpeg_std_error(&encoder->jerr);
     jpeg_create_compress(&encoder->cinfo);
+    pthread_once(&stripe_pool_once, mjpeg_stripe_pool_init);
 
     return encoder;
 }
@@ -20,6 +20,7 @@
 #define _H_MJPEG_ENCODER
 
 #include "red_common.h"
+#include "red_bitmap_simd.h"
 
 enum {
     MJPEG_ENCODER_FRAME_UNSUPPORTED = -1,
@@ -29,6 +30,17 @@ enum {
 
 typedef struct MJpegEncoder MJpegEncoder;
 
+/*
+ * Frames of a stream that were already encoded for other clients, one per
+ * quality level. The encoders of the clients of a stream share a cache, so
+ * that each frame is encoded once per quality their rate control picked,
+ * rather than once per client.
+ */
+typedef struct MJpegFrameCache MJpegFrameCache;
+
+MJpegFrameCache *mjpeg_frame_cache_new(void);
+void mjpeg_frame_cache_destroy(MJpegFrameCache *cache);
+
 /*
  * Callbacks required for controling and adjusting
  * the stream bit rate:
@@ -36,29 +48,71 @@ typedef struct MJpegEncoder MJpegEncoder;
  * get_source_fps: the input frame rate (#frames per second), i.e.,
  * the rate of frames arriving from the guest to spice-server,
  * before any drops.
+ * get_time: the current time in nanoseconds, used instead of the monotonic
+ * clock when not NULL, e.g. by the rate control simulator.
  */
 typedef struct MJpegEncoderRateControlCbs {
     uint32_t (*get_roundtrip_ms)(void *opaque);
     uint32_t (*get_source_fps)(void *opaque);
     void (*update_client_playback_delay)(void *opaque, uint32_t delay_ms);
+    uint64_t (*get_time)(void *opaque);
 } MJpegEncoderRateControlCbs;
 
 typedef struct MJpegEncoderStats {
     uint64_t starting_bit_rate;
     uint64_t cur_bit_rate;
     double avg_quality;
+    uint64_t num_shared_frames; // frames taken from the frame cache
+    uint64_t num_scaled_frames; // frames encoded at a reduced size
+    uint64_t num_quality_evals;
+    uint64_t num_eval_frames;   // frames encoded while the quality was evaluated
+    uint64_t quality_eval_time; // ns of cpu the evaluations and these frames took
 } MJpegEncoderStats;
 
 MJpegEncoder *mjpeg_encoder_new(uint64_t starting_bit_rate,
                                 MJpegEncoderRateControlCbs *cbs, void *opaque);
 void mjpeg_encoder_destroy(MJpegEncoder *encoder);
 
+/*
+ * Lets the rate control downscale the frames when the bit rate is too low
+ * for the lowest quality. The client must then scale the frames to the
+ * stream area, see SPICE_DISPLAY_CAP_SIZED_STREAM.
+ */
+void mjpeg_encoder_enable_scaling(MJpegEncoder *encoder);
+
+/* the bitmap scans picked with SPICE_BITMAP_SIMD, NULL - the scalar ones */
+void mjpeg_encoder_set_simd_ops(MJpegEncoder *encoder, const RedBitmapSimdOps *simd_ops);
+
+/*
+ * The client plays the frames at most delay_ms after they were sent: the
+ * rate control keeps the frames small enough to arrive in time, lowering
+ * the quality and the bit rate instead of asking for a longer playback
+ * delay through update_client_playback_delay. 0 - no limit.
+ */
+void mjpeg_encoder_set_max_playback_delay(MJpegEncoder *encoder, uint32_t delay_ms);
+
+/* cache may be NULL; frame_id identifies the frame in the cache.
+ * enc_width and enc_height receive the size of the encoded frame, smaller
+ * than width and height when the frame was downscaled. */
 int mjpeg_encoder_encode_frame(MJpegEncoder *encoder,
+                               MJpegFrameCache *cache, uint64_t frame_id,
                                const SpiceBitmap *bitmap, int width, int height,
                                const SpiceRect *src,
                                int top_down, uint32_t frame_mm_time,
                                uint8_t **outbuf, size_t *outbuf_size,
-                               int *data_size);
+                               int *data_size, int *enc_width, int *enc_height);
+
+/* encodes another part of the frame that the last mjpeg_encoder_encode_frame
+ * call encoded, e.g. a tile of a tiled stream: at the same quality and
+ * scale, and without being dropped. The rate control counts its size as
+ * part of that frame. */
+int mjpeg_encoder_encode_frame_part(MJpegEncoder *encoder,
+                                    MJpegFrameCache *cache, uint64_t frame_id,
+                                    const SpiceBitmap *bitmap, int width, int height,
+                                    const SpiceRect *src,
+                                    int top_down, uint32_t frame_mm_time,
+                                    uint8_t **outbuf, size_t *outbuf_size,
+                                    int *data_size, int *enc_width, int *enc_height);
 
 /*
  * bit rate control
@@ -95,6 +149,12 @@ void mjpeg_encoder_client_stream_report(MJpegEncoder *encoder,
 void mjpeg_encoder_notify_server_frame_drop(MJpegEncoder *encoder);
 
 uint64_t mjpeg_encoder_get_bit_rate(MJpegEncoder *encoder);
+
+/* the jpeg quality and the scale shift (the frame is scaled by
+ * 1 / (1 << scale_shift)) of the last encoded frame, or the ones the rate
+ * control currently picks for the next frame */
+void mjpeg_encoder_get_last_frame_quality(MJpegEncoder *encoder, int *quality, int *scale_shift);
+void mjpeg_encoder_get_next_frame_quality(MJpegEncoder *encoder, int *quality, int *scale_shift);
 void mjpeg_encoder_get_stats(MJpegEncoder *encoder, MJpegEncoderStats *stats);
 
 #endif
@@ -0,0 +1,470 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2015 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+#include <string.h>
+#include <glib.h>
+
+#include "red_bitmap_simd.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define RED_BITMAP_SIMD_X86
+#endif
+
+#ifdef RED_BITMAP_SIMD_X86
+#include <immintrin.h>
+
+/*
+ * Graduality
+ *
+ * The sample positions are exactly those of compute_lines_gradual_score in
+ * red_bitmap_utils_tmpl.c. For every sample the pixel, its right, bottom and
+ * bottom-right neighbours are unpacked to b | g << 8 | r << 16 and scored in
+ * batches. The pair weights of the template (0.5, 1.0, -0.25) are counted in
+ * quarters (2, 4, -1) so the sum is an integer and the result is exact.
+ */
+
+#define GRADUAL_BATCH 8
+#define GRADUAL_SAMPLE_JUMP 15
+#define GRADUAL_CONTRAST_TH 60
+#define GRADUAL_CONTRAST_TH_RGB16 8
+
+typedef struct GradualBatch {
+    uint32_t pix[GRADUAL_BATCH];
+    uint32_t right[GRADUAL_BATCH];
+    uint32_t below[GRADUAL_BATCH];
+    uint32_t below_right[GRADUAL_BATCH];
+} GradualBatch;
+
+/* returns the sum of the batch square scores, in quarters */
+typedef int (*GradualBatchFunc)(const GradualBatch *batch, int contrast_th);
+
+enum {
+    GRADUAL_RGB16,
+    GRADUAL_RGB24,
+    GRADUAL_RGB32,
+};
+
+static inline uint32_t gradual_load_pixel(const uint8_t *lines, int pos, int format)
+{
+    const uint8_t *p;
+    uint32_t pix;
+
+    switch (format) {
+    case GRADUAL_RGB16:
+        p = lines + pos * 2;
+        pix = p[0] | (p[1] << 8);
+        return (pix & 0x1f) | (((pix >> 5) & 0x1f) << 8) | (((pix >> 10) & 0x1f) << 16);
+    case GRADUAL_RGB24:
+        p = lines + pos * 3;
+        return p[0] | (p[1] << 8) | (p[2] << 16);
+    default:
+        p = lines + pos * 4;
+        return p[0] | (p[1] << 8) | (p[2] << 16);
+    }
+}
+
+static inline void gradual_score(const uint8_t *lines, int width, int num_lines,
+                                 double *o_samples_sum_score, int *o_num_samples,
+                                 int format, GradualBatchFunc batch_func)
+{
+    int jump = (GRADUAL_SAMPLE_JUMP % width) ? GRADUAL_SAMPLE_JUMP : GRADUAL_SAMPLE_JUMP - 1;
+    int contrast_th = format == GRADUAL_RGB16 ? GRADUAL_CONTRAST_TH_RGB16 : GRADUAL_CONTRAST_TH;
+    int cur_pix = width / 2;
+    int last_line;
+    int num_samples = 0;
+    int sum = 0;
+    int n = 0;
+    GradualBatch batch;
+
+    if ((width <= 1) || (num_lines <= 1)) {
+        *o_num_samples = 1;
+        *o_samples_sum_score = 1.0;
+        return;
+    }
+
+    last_line = (num_lines - 1) * width;
+    while (cur_pix < last_line) {
+        if ((cur_pix + 1) % width == 0) { // last pixel in the row
+            cur_pix--;
+        }
+        batch.pix[n] = gradual_load_pixel(lines, cur_pix, format);
+        batch.right[n] = gradual_load_pixel(lines, cur_pix + 1, format);
+        batch.below[n] = gradual_load_pixel(lines, cur_pix + width, format);
+        batch.below_right[n] = gradual_load_pixel(lines, cur_pix + width + 1, format);
+        if (++n == GRADUAL_BATCH) {
+            sum += batch_func(&batch, contrast_th);
+            num_samples += n;
+            n = 0;
+        }
+        cur_pix += jump;
+    }
+
+    if (n) {
+        // identical pixels score 0
+        memset(&batch.pix[n], 0, (GRADUAL_BATCH - n) * sizeof(uint32_t));
+        memset(&batch.right[n], 0, (GRADUAL_BATCH - n) * sizeof(uint32_t));
+        memset(&batch.below[n], 0, (GRADUAL_BATCH - n) * sizeof(uint32_t));
+        memset(&batch.below_right[n], 0, (GRADUAL_BATCH - n) * sizeof(uint32_t));
+        sum += batch_func(&batch, contrast_th);
+        num_samples += n;
+    }
+
+    *o_samples_sum_score = sum / 4.0;
+    *o_num_samples = num_samples * 3;
+}
+
+__attribute__((target("sse2")))
+static inline __m128i gradual_pair_weight_sse2(__m128i a, __m128i b, __m128i th,
+                                               __m128i *eq_out)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i ones = _mm_set1_epi32(-1);
+    __m128i absdiff, contrast, eq, other;
+
+    absdiff = _mm_or_si128(_mm_subs_epu8(a, b), _mm_subs_epu8(b, a));
+    contrast = _mm_andnot_si128(_mm_cmpeq_epi32(_mm_subs_epu8(absdiff, th), zero), ones);
+    eq = _mm_cmpeq_epi32(a, b);
+    other = _mm_andnot_si128(_mm_or_si128(eq, contrast), ones);
+    *eq_out = eq;
+    return _mm_or_si128(_mm_or_si128(_mm_and_si128(eq, _mm_set1_epi32(2)),
+                                     _mm_and_si128(contrast, _mm_set1_epi32(4))),
+                        other);
+}
+
+__attribute__((target("sse2")))
+static int gradual_batch_sse2(const GradualBatch *batch, int contrast_th)
+{
+    const __m128i th = _mm_set1_epi8(contrast_th - 1);
+    __m128i acc = _mm_setzero_si128();
+    int32_t out[4];
+    int i;
+
+    for (i = 0; i < GRADUAL_BATCH; i += 4) {
+        __m128i pix = _mm_loadu_si128((const __m128i *)&batch->pix[i]);
+        __m128i right = _mm_loadu_si128((const __m128i *)&batch->right[i]);
+        __m128i below = _mm_loadu_si128((const __m128i *)&batch->below[i]);
+        __m128i below_right = _mm_loadu_si128((const __m128i *)&batch->below_right[i]);
+        __m128i eq1, eq2, eq3, score;
+
+        score = gradual_pair_weight_sse2(pix, right, th, &eq1);
+        score = _mm_add_epi32(score, gradual_pair_weight_sse2(pix, below, th, &eq2));
+        score = _mm_add_epi32(score, gradual_pair_weight_sse2(pix, below_right, th, &eq3));
+        // ignore squares where all pixels are identical
+        score = _mm_andnot_si128(_mm_and_si128(_mm_and_si128(eq1, eq2), eq3), score);
+        acc = _mm_add_epi32(acc, score);
+    }
+
+    _mm_storeu_si128((__m128i *)out, acc);
+    return out[0] + out[1] + out[2] + out[3];
+}
+
+__attribute__((target("avx2")))
+static inline __m256i gradual_pair_weight_avx2(__m256i a, __m256i b, __m256i th,
+                                               __m256i *eq_out)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i ones = _mm256_set1_epi32(-1);
+    __m256i absdiff, contrast, eq, other;
+
+    absdiff = _mm256_or_si256(_mm256_subs_epu8(a, b), _mm256_subs_epu8(b, a));
+    contrast = _mm256_andnot_si256(_mm256_cmpeq_epi32(_mm256_subs_epu8(absdiff, th), zero),
+                                   ones);
+    eq = _mm256_cmpeq_epi32(a, b);
+    other = _mm256_andnot_si256(_mm256_or_si256(eq, contrast), ones);
+    *eq_out = eq;
+    return _mm256_or_si256(_mm256_or_si256(_mm256_and_si256(eq, _mm256_set1_epi32(2)),
+                                           _mm256_and_si256(contrast, _mm256_set1_epi32(4))),
+                           other);
+}
+
+__attribute__((target("avx2")))
+static int gradual_batch_avx2(const GradualBatch *batch, int contrast_th)
+{
+    const __m256i th = _mm256_set1_epi8(contrast_th - 1);
+    __m256i pix = _mm256_loadu_si256((const __m256i *)batch->pix);
+    __m256i right = _mm256_loadu_si256((const __m256i *)batch->right);
+    __m256i below = _mm256_loadu_si256((const __m256i *)batch->below);
+    __m256i below_right = _mm256_loadu_si256((const __m256i *)batch->below_right);
+    __m256i eq1, eq2, eq3, score;
+    __m128i sum;
+
+    score = gradual_pair_weight_avx2(pix, right, th, &eq1);
+    score = _mm256_add_epi32(score, gradual_pair_weight_avx2(pix, below, th, &eq2));
+    score = _mm256_add_epi32(score, gradual_pair_weight_avx2(pix, below_right, th, &eq3));
+    score = _mm256_andnot_si256(_mm256_and_si256(_mm256_and_si256(eq1, eq2), eq3), score);
+
+    sum = _mm_add_epi32(_mm256_castsi256_si128(score), _mm256_extracti128_si256(score, 1));
+    sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(1, 0, 3, 2)));
+    sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(2, 3, 0, 1)));
+    return _mm_cvtsi128_si32(sum);
+}
+
+#define GRADUAL_SCORE_FUNC(level, fmt, format)                                          \
+static void gradual_score_##fmt##_##level(const uint8_t *lines, int width, int num_lines, \
+                                          double *o_samples_sum_score, int *o_num_samples) \
+{                                                                                       \
+    gradual_score(lines, width, num_lines, o_samples_sum_score, o_num_samples,          \
+                  format, gradual_batch_##level);                                       \
+}
+
+GRADUAL_SCORE_FUNC(sse2, rgb16, GRADUAL_RGB16)
+GRADUAL_SCORE_FUNC(sse2, rgb24, GRADUAL_RGB24)
+GRADUAL_SCORE_FUNC(sse2, rgb32, GRADUAL_RGB32)
+GRADUAL_SCORE_FUNC(avx2, rgb16, GRADUAL_RGB16)
+GRADUAL_SCORE_FUNC(avx2, rgb24, GRADUAL_RGB24)
+GRADUAL_SCORE_FUNC(avx2, rgb32, GRADUAL_RGB32)
+
+/*
+ * Alpha scan
+ *
+ * Same result as rgb32_data_has_alpha: TRUE with *all_set_out = FALSE as
+ * soon as an alpha other than 0 or 0xff is found, otherwise whether any alpha
+ * is set, with *all_set_out equal to it.
+ */
+
+#define ALPHA_MASK 0xff000000U
+
+static inline int has_alpha_tail(const uint32_t *line, int width, uint32_t *alpha_or)
+{
+    uint32_t alpha;
+    int i;
+
+    for (i = 0; i < width; i++) {
+        alpha = line[i] & ALPHA_MASK;
+        if (alpha != 0 && alpha != ALPHA_MASK) {
+            return FALSE;
+        }
+        *alpha_or |= alpha;
+    }
+    return TRUE;
+}
+
+__attribute__((target("sse2")))
+static int rgb32_has_alpha_sse2(int width, int height, size_t stride,
+                                uint8_t *data, int *all_set_out)
+{
+    const __m128i mask = _mm_set1_epi32(ALPHA_MASK);
+    const __m128i zero = _mm_setzero_si128();
+    __m128i acc = zero;
+    uint32_t alpha_or = 0;
+    int x;
+
+    while (height-- > 0) {
+        const uint32_t *line = (const uint32_t *)data;
+
+        data += stride;
+        for (x = 0; x + 4 <= width; x += 4) {
+            __m128i alpha = _mm_and_si128(_mm_loadu_si128((const __m128i *)(line + x)), mask);
+            __m128i valid = _mm_or_si128(_mm_cmpeq_epi32(alpha, zero),
+                                         _mm_cmpeq_epi32(alpha, mask));
+
+            if (_mm_movemask_epi8(valid) != 0xffff) {
+                *all_set_out = FALSE;
+                return TRUE;
+            }
+            acc = _mm_or_si128(acc, alpha);
+        }
+        if (!has_alpha_tail(line + x, width - x, &alpha_or)) {
+            *all_set_out = FALSE;
+            return TRUE;
+        }
+    }
+
+    if (_mm_movemask_epi8(_mm_cmpeq_epi32(acc, zero)) != 0xffff) {
+        alpha_or = ALPHA_MASK;
+    }
+    *all_set_out = alpha_or != 0;
+    return alpha_or != 0;
+}
+
+__attribute__((target("avx2")))
+static int rgb32_has_alpha_avx2(int width, int height, size_t stride,
+                                uint8_t *data, int *all_set_out)
+{
+    const __m256i mask = _mm256_set1_epi32(ALPHA_MASK);
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i acc = zero;
+    uint32_t alpha_or = 0;
+    int x;
+
+    while (height-- > 0) {
+        const uint32_t *line = (const uint32_t *)data;
+
+        data += stride;
+        for (x = 0; x + 8 <= width; x += 8) {
+            __m256i alpha = _mm256_and_si256(_mm256_loadu_si256((const __m256i *)(line + x)),
+                                             mask);
+            __m256i valid = _mm256_or_si256(_mm256_cmpeq_epi32(alpha, zero),
+                                            _mm256_cmpeq_epi32(alpha, mask));
+
+            if (_mm256_movemask_epi8(valid) != -1) {
+                *all_set_out = FALSE;
+                return TRUE;
+            }
+            acc = _mm256_or_si256(acc, alpha);
+        }
+        if (!has_alpha_tail(line + x, width - x, &alpha_or)) {
+            *all_set_out = FALSE;
+            return TRUE;
+        }
+    }
+
+    if (!_mm256_testz_si256(acc, acc)) {
+        alpha_or = ALPHA_MASK;
+    }
+    *all_set_out = alpha_or != 0;
+    return alpha_or != 0;
+}
+
+/*
+ * 16bpp expansion
+ *
+ * Each 5 bit channel is widened to 8 bits by repeating its top 3 bits in
+ * the low bits, like the per pixel converters of the jpeg encoders.
+ */
+
+static inline void rgb16_to_bgrx_tail(const uint16_t *src, int width, uint8_t *dest)
+{
+    int x;
+
+    for (x = 0; x < width; x++) {
+        uint16_t pixel = src[x];
+
+        *dest++ = ((pixel << 3) & 0xf8) | ((pixel >> 2) & 0x7);
+        *dest++ = ((pixel >> 2) & 0xf8) | ((pixel >> 7) & 0x7);
+        *dest++ = ((pixel >> 7) & 0xf8) | ((pixel >> 12) & 0x7);
+        *dest++ = 0;
+    }
+}
+
+__attribute__((target("sse2")))
+static void rgb16_to_bgrx_sse2(const uint8_t *src_bytes, int width, uint8_t *dest)
+{
+    const uint16_t *src = (const uint16_t *)src_bytes;
+    const __m128i high = _mm_set1_epi16(0xf8);
+    const __m128i low = _mm_set1_epi16(0x7);
+    int x;
+
+    for (x = 0; x + 8 <= width; x += 8) {
+        __m128i pixels = _mm_loadu_si128((const __m128i *)(src + x));
+        __m128i r = _mm_or_si128(_mm_and_si128(_mm_srli_epi16(pixels, 7), high),
+                                 _mm_and_si128(_mm_srli_epi16(pixels, 12), low));
+        __m128i g = _mm_or_si128(_mm_and_si128(_mm_srli_epi16(pixels, 2), high),
+                                 _mm_and_si128(_mm_srli_epi16(pixels, 7), low));
+        __m128i b = _mm_or_si128(_mm_and_si128(_mm_slli_epi16(pixels, 3), high),
+                                 _mm_and_si128(_mm_srli_epi16(pixels, 2), low));
+        __m128i bg = _mm_or_si128(b, _mm_slli_epi16(g, 8));
+
+        // interleaving b | g << 8 with r | 0 << 8 gives the b, g, r, 0 bytes
+        _mm_storeu_si128((__m128i *)(dest + x * 4), _mm_unpacklo_epi16(bg, r));
+        _mm_storeu_si128((__m128i *)(dest + x * 4 + 16), _mm_unpackhi_epi16(bg, r));
+    }
+    rgb16_to_bgrx_tail(src + x, width - x, dest + x * 4);
+}
+
+/*
+ * Downscaling
+ *
+ * The channels of 8 pixels of each line are widened to 16 bits, the lines
+ * are summed, then the pixel pairs, and the sums are rounded like the
+ * scalar (sum + 2) / 4.
+ */
+
+static inline void halve_bgrx_tail(const uint8_t *line0, const uint8_t *line1,
+                                   int width, uint8_t *dest)
+{
+    int x, c;
+
+    for (x = 0; x < width; x += 2) {
+        int right = x + 1 < width ? 4 : 0;
+
+        for (c = 0; c < 4; c++) {
+            *dest++ = (line0[c] + line0[right + c] + line1[c] + line1[right + c] + 2) >> 2;
+        }
+        line0 += 8;
+        line1 += 8;
+    }
+}
+
+__attribute__((target("sse2")))
+static void halve_bgrx_sse2(const uint8_t *line0, const uint8_t *line1,
+                            int width, uint8_t *dest)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i round = _mm_set1_epi16(2);
+    __m128i sums[2];
+    int x, i;
+
+    for (x = 0; x + 8 <= width; x += 8) {
+        for (i = 0; i < 2; i++) {
+            __m128i a = _mm_loadu_si128((const __m128i *)(line0 + x * 4 + i * 16));
+            __m128i b = _mm_loadu_si128((const __m128i *)(line1 + x * 4 + i * 16));
+            // pixels 0, 1 and 2, 3 of the vector, with the ones below them
+            __m128i lo = _mm_add_epi16(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero));
+            __m128i hi = _mm_add_epi16(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero));
+            __m128i sum = _mm_add_epi16(_mm_unpacklo_epi64(lo, hi), _mm_unpackhi_epi64(lo, hi));
+
+            sums[i] = _mm_srli_epi16(_mm_add_epi16(sum, round), 2);
+        }
+        _mm_storeu_si128((__m128i *)(dest + x * 2), _mm_packus_epi16(sums[0], sums[1]));
+    }
+    halve_bgrx_tail(line0 + x * 4, line1 + x * 4, width - x, dest + x * 2);
+}
+
+static const RedBitmapSimdOps sse2_ops = {
+    "sse2",
+    gradual_score_rgb16_sse2,
+    gradual_score_rgb24_sse2,
+    gradual_score_rgb32_sse2,
+    rgb32_has_alpha_sse2,
+    rgb16_to_bgrx_sse2,
+    halve_bgrx_sse2,
+};
+
+static const RedBitmapSimdOps avx2_ops = {
+    "avx2",
+    gradual_score_rgb16_avx2,
+    gradual_score_rgb24_avx2,
+    gradual_score_rgb32_avx2,
+    rgb32_has_alpha_avx2,
+    rgb16_to_bgrx_sse2, // memory bound, wider vectors do not help
+    halve_bgrx_sse2,
+};
+
+const RedBitmapSimdOps *red_bitmap_simd_get_ops(RedBitmapSimdLevel max_level)
+{
+    __builtin_cpu_init();
+    if (max_level >= RED_BITMAP_SIMD_AVX2 && __builtin_cpu_supports("avx2")) {
+        return &avx2_ops;
+    }
+    if (max_level >= RED_BITMAP_SIMD_SSE2 && __builtin_cpu_supports("sse2")) {
+        return &sse2_ops;
+    }
+    return NULL;
+}
+
+#else
+
+const RedBitmapSimdOps *red_bitmap_simd_get_ops(RedBitmapSimdLevel max_level)
+{
+    return NULL;
+}
+
+#endif
@@ -0,0 +1,65 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2015 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef H_RED_BITMAP_SIMD
+#define H_RED_BITMAP_SIMD
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Vectorized versions of the bitmap scans of red_worker.c: the graduality
+ * scorer of red_bitmap_utils_tmpl.c and rgb32_data_has_alpha, and of the
+ * 16bpp pixel expansion and the frame downscaling of the jpeg encoders. They
+ * return exactly the same results as the scalar code. */
+
+typedef enum {
+    RED_BITMAP_SIMD_NONE,
+    RED_BITMAP_SIMD_SSE2,
+    RED_BITMAP_SIMD_AVX2,
+} RedBitmapSimdLevel;
+
+/* same as compute_lines_gradual_score_rgb16/24/32, lines holds num_lines
+ * lines of width pixels without padding */
+typedef void (*RedGradualScoreFunc)(const uint8_t *lines, int width, int num_lines,
+                                    double *o_samples_sum_score, int *o_num_samples);
+
+typedef int (*RedHasAlphaFunc)(int width, int height, size_t stride,
+                               uint8_t *data, int *all_set_out);
+
+/* expands width x1r5g5b5 pixels to 8 bits per channel b, g, r, 0 bytes */
+typedef void (*RedRgb16ToBgrxFunc)(const uint8_t *src, int width, uint8_t *dest);
+
+/* averages the 2x2 pixel boxes of two lines of width bgrx pixels into
+ * (width + 1) / 2 pixels, the last box of an odd width is 1 pixel wide */
+typedef void (*RedHalveBgrxFunc)(const uint8_t *line0, const uint8_t *line1,
+                                 int width, uint8_t *dest);
+
+typedef struct RedBitmapSimdOps {
+    const char *name;
+    RedGradualScoreFunc gradual_score_rgb16;
+    RedGradualScoreFunc gradual_score_rgb24;
+    RedGradualScoreFunc gradual_score_rgb32;
+    RedHasAlphaFunc rgb32_has_alpha;
+    RedRgb16ToBgrxFunc rgb16_to_bgrx;
+    RedHalveBgrxFunc halve_bgrx;
+} RedBitmapSimdOps;
+
+/* Returns the ops of the best level, up to max_level, that the CPU supports,
+ * or NULL if none is, in which case the scalar code should be used. */
+const RedBitmapSimdOps *red_bitmap_simd_get_ops(RedBitmapSimdLevel max_level);
+
+#endif
@@ -19,6 +19,8 @@
 #define _H_RED_COMMON
 
 #include <spice/macros.h>
+#include <errno.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "common/mem.h"
@@ -57,4 +59,26 @@ static inline int bitmap_fmt_is_rgb(uint8_t fmt)
     return BITMAP_FMT_IS_RGB[fmt];
 }
 
+/* the value of the integer environment variable name, or default_value when
+ * it is not set or is not an integer between min and max */
+static inline int64_t red_get_env_int(const char *name, int64_t min, int64_t max,
+                                      int64_t default_value)
+{
+    const char *env_str = getenv(name);
+    char *end;
+    long long value;
+
+    if (env_str == NULL) {
+        return default_value;
+    }
+    errno = 0;
+    value = strtoll(env_str, &end, 10);
+    if (errno != 0 || end == env_str || *end != '\0' || value < min || value > max) {
+        spice_warning("error parsing %s: %s", name, env_str);
+        return default_value;
+    }
+    spice_info("%s=%lld", name, value);
+    return value;
+}
+
 #endif
@@ -0,0 +1,206 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2015 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+#include <glib.h>
+
+#include "red_stream_detector.h"
+
+/* updates closer than this to an area are merged into it */
+#define STREAM_DETECTOR_MAX_GAP 16
+/* part of the extents of a frame its updates must cover */
+#define STREAM_DETECTOR_MIN_COVERAGE 0.5
+/* same as RED_STREAM_GRADUAL_FRAMES_START_CONDITION */
+#define STREAM_DETECTOR_GRADUAL_CONDITION 0.2
+
+void stream_detector_init(StreamDetector *detector, int start_frames, red_time_t max_delta)
+{
+    detector->start_frames = start_frames;
+    detector->max_delta = max_delta;
+    stream_detector_reset(detector);
+}
+
+void stream_detector_reset(StreamDetector *detector)
+{
+    memset(detector->areas, 0, sizeof(detector->areas));
+}
+
+static inline int stream_detector_area_is_free(const StreamDetectorArea *area)
+{
+    return rect_is_empty(&area->area) && rect_is_empty(&area->frame);
+}
+
+static inline int stream_detector_is_near(const SpiceRect *r1, const SpiceRect *r2)
+{
+    return r1->left <= r2->right + STREAM_DETECTOR_MAX_GAP &&
+           r2->left <= r1->right + STREAM_DETECTOR_MAX_GAP &&
+           r1->top <= r2->bottom + STREAM_DETECTOR_MAX_GAP &&
+           r2->top <= r1->bottom + STREAM_DETECTOR_MAX_GAP;
+}
+
+static int stream_detector_area_is_near(const StreamDetectorArea *area, const SpiceRect *rect)
+{
+    return (!rect_is_empty(&area->area) && stream_detector_is_near(&area->area, rect)) ||
+           (!rect_is_empty(&area->frame) && stream_detector_is_near(&area->frame, rect));
+}
+
+static void stream_detector_add_frame_rect(StreamDetectorArea *area, const SpiceRect *rect)
+{
+    if (area->num_frame_rects < STREAM_DETECTOR_FRAME_RECTS) {
+        area->frame_rects[area->num_frame_rects++] = *rect;
+    }
+}
+
+static int stream_detector_frame_intersects(const StreamDetectorArea *area,
+                                            const SpiceRect *rect)
+{
+    int i;
+
+    if (!rect_intersects(&area->frame, rect)) {
+        return FALSE;
+    }
+    for (i = 0; i < area->num_frame_rects; i++) {
+        if (rect_intersects(&area->frame_rects[i], rect)) {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+/* both areas were painted lately, so the history of the busier one is kept */
+static void stream_detector_merge_areas(StreamDetectorArea *dest, StreamDetectorArea *src)
+{
+    int i;
+
+    if (rect_is_empty(&dest->area)) {
+        dest->area = src->area;
+    } else if (!rect_is_empty(&src->area)) {
+        rect_union(&dest->area, &src->area);
+    }
+    if (rect_is_empty(&dest->frame)) {
+        dest->frame = src->frame;
+    } else if (!rect_is_empty(&src->frame)) {
+        rect_union(&dest->frame, &src->frame);
+    }
+    dest->frame_pixels += src->frame_pixels;
+    for (i = 0; i < src->num_frame_rects; i++) {
+        stream_detector_add_frame_rect(dest, &src->frame_rects[i]);
+    }
+    dest->last_time = MAX(dest->last_time, src->last_time);
+    dest->frames_count = MAX(dest->frames_count, src->frames_count);
+    dest->updates_count += src->updates_count;
+    dest->gradual_updates_count += src->gradual_updates_count;
+    memset(src, 0, sizeof(*src));
+}
+
+static void stream_detector_end_frame(StreamDetectorArea *area)
+{
+    if (area->frame_pixels >= STREAM_DETECTOR_MIN_COVERAGE * rect_get_area(&area->frame)) {
+        if (rect_is_empty(&area->area)) {
+            area->area = area->frame;
+        } else {
+            rect_union(&area->area, &area->frame);
+        }
+        area->frames_count++;
+    } else {
+        /* scattered updates, like a blinking cursor next to a clock */
+        area->area = area->frame;
+        area->frames_count = 0;
+        area->updates_count = 0;
+        area->gradual_updates_count = 0;
+    }
+    memset(&area->frame, 0, sizeof(area->frame));
+    area->frame_pixels = 0;
+    area->num_frame_rects = 0;
+}
+
+static int stream_detector_is_start(const StreamDetector *detector,
+                                    const StreamDetectorArea *area, int min_size)
+{
+    return area->frames_count >= detector->start_frames &&
+           area->gradual_updates_count >=
+           STREAM_DETECTOR_GRADUAL_CONDITION * area->updates_count &&
+           rect_get_area(&area->area) >= min_size;
+}
+
+int stream_detector_add(StreamDetector *detector, const SpiceRect *rect, red_time_t time,
+                        int gradual, int min_size, SpiceRect *stream_area)
+{
+    StreamDetectorArea *area = NULL;
+    StreamDetectorArea *oldest = NULL;
+    StreamDetectorArea *free_area = NULL;
+    int i;
+
+    if (!detector->start_frames || rect_is_empty(rect)) {
+        return FALSE;
+    }
+
+    for (i = 0; i < STREAM_DETECTOR_NUM_AREAS; i++) {
+        StreamDetectorArea *now = &detector->areas[i];
+
+        if (stream_detector_area_is_free(now)) {
+            free_area = free_area ? free_area : now;
+            continue;
+        }
+        if (time - now->last_time > detector->max_delta) {
+            memset(now, 0, sizeof(*now));
+            free_area = free_area ? free_area : now;
+            continue;
+        }
+        if (stream_detector_area_is_near(now, rect)) {
+            if (area) {
+                stream_detector_merge_areas(area, now);
+                free_area = free_area ? free_area : now;
+            } else {
+                area = now;
+            }
+            continue;
+        }
+        if (!oldest || now->last_time < oldest->last_time) {
+            oldest = now;
+        }
+    }
+
+    if (!area) {
+        area = free_area ? free_area : oldest;
+        memset(area, 0, sizeof(*area));
+    } else if (stream_detector_frame_intersects(area, rect)) {
+        stream_detector_end_frame(area);
+    }
+    if (rect_is_empty(&area->frame)) {
+        area->frame = *rect;
+    } else {
+        rect_union(&area->frame, rect);
+    }
+    area->frame_pixels += rect_get_area(rect);
+    stream_detector_add_frame_rect(area, rect);
+    area->last_time = time;
+    area->updates_count++;
+    if (gradual) {
+        area->gradual_updates_count++;
+    }
+
+    if (!stream_detector_is_start(detector, area, min_size)) {
+        return FALSE;
+    }
+    *stream_area = area->area;
+    rect_union(stream_area, &area->frame);
+    memset(area, 0, sizeof(*area));
+    return TRUE;
+}
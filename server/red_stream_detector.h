@@ -0,0 +1,69 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2015 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef H_RED_STREAM_DETECTOR
+#define H_RED_STREAM_DETECTOR
+
+#include "red_common.h"
+#include "common/rect.h"
+#include "utils.h"
+
+/* Damage history based video detection.
+ *
+ * The per drawable detection of red_worker.c needs many frames of the same
+ * geometry. Browsers often paint a video as several adjacent tiles, or as
+ * rects that change from frame to frame, which it never recognizes. The
+ * detector merges nearby updates into areas and splits the updates of an
+ * area into frames: a frame ends when an update overlaps a part of the area
+ * that was already painted in it. An area whose frames cover it densely and
+ * follow each other quickly enough is reported as a stream area. */
+
+#define STREAM_DETECTOR_NUM_AREAS 8
+/* updates of a frame checked for overlaps. The next frame of a video starts
+ * with one of the first updates of the previous one, so checking the first
+ * ones is enough. */
+#define STREAM_DETECTOR_FRAME_RECTS 32
+
+typedef struct StreamDetectorArea {
+    SpiceRect area;         // the frames counted so far, empty if the slot is free
+    SpiceRect frame;        // the extents of the updates of the current frame
+    uint64_t frame_pixels;  // their total size
+    SpiceRect frame_rects[STREAM_DETECTOR_FRAME_RECTS];
+    int num_frame_rects;
+    red_time_t last_time;   // of the last update
+    int frames_count;
+    int updates_count;
+    int gradual_updates_count;
+} StreamDetectorArea;
+
+typedef struct StreamDetector {
+    StreamDetectorArea areas[STREAM_DETECTOR_NUM_AREAS];
+    int start_frames;       // 0 - disabled
+    red_time_t max_delta;   // between the updates of an area
+} StreamDetector;
+
+void stream_detector_init(StreamDetector *detector, int start_frames, red_time_t max_delta);
+void stream_detector_reset(StreamDetector *detector);
+
+/* Adds an update of rect at time. gradual tells whether its content looks
+ * like video. Returns TRUE, with the area to stream in stream_area, once the
+ * area rect belongs to had start_frames frames and is at least min_size
+ * pixels. The area is then forgotten. */
+int stream_detector_add(StreamDetector *detector, const SpiceRect *rect, red_time_t time,
+                        int gradual, int min_size, SpiceRect *stream_area);
+
+#endif
@@ -91,6 +91,8 @@
 #include "main_dispatcher.h"
 #include "spice_server_utils.h"
 #include "spice_bitmap_utils.h"
+#include "red_bitmap_simd.h"
+#include "red_stream_detector.h"
 #include "spice_image_cache.h"
 #include "pixmap-cache.h"
 #include "display-channel.h"
@@ -118,6 +120,8 @@
 #define RED_STREAM_GRADUAL_FRAMES_START_CONDITION 0.2
 #define RED_STREAM_FRAMES_RESET_CONDITION 100
 #define RED_STREAM_MIN_SIZE (96 * 96)
+/* frames of a merged update area before it is streamed, see red_stream_detector_update */
+#define RED_STREAM_DETECTOR_START_FRAMES 5
 #define RED_STREAM_INPUT_FPS_TIMEOUT ((uint64_t)5 * 1000 * 1000 * 1000) // 5 sec
 #define RED_STREAM_CHANNEL_CAPACITY 0.8
 /* the client's stream report frequency is the minimum of the 2 values below */
@@ -125,12 +129,93 @@
 #define RED_STREAM_CLIENT_REPORT_TIMEOUT 1000 // milliseconds
 #define RED_STREAM_DEFAULT_HIGH_START_BIT_RATE (10 * 1024 * 1024) // 10Mbps
 #define RED_STREAM_DEFAULT_LOW_START_BIT_RATE (2.5 * 1024 * 1024) // 2.5Mbps
+/* milliseconds of its bit rate a stream agent may send at once, see red_stream_pacer_admit */
+#define RED_STREAM_PACER_BURST_MS 200
+/* percent of a stream area drawables that are not opaque may cover without
+ * stopping the stream, see red_stream_overlay_fits */
+#define RED_STREAM_OVERLAY_MAX_PERCENT 15
+/* the lowest playback delay of the low latency streaming, see stream_latency_ms */
+#define RED_STREAM_MIN_LATENCY 20 // milliseconds
+/* above any jpeg quality, for the frames the clients were sent lossless */
+#define RED_STREAM_LOSSLESS_QUALITY 1000
 
 #define FPS_TEST_INTERVAL 1
 #define MAX_FPS 30
 
+#define RED_DISPLAY_LOW_BANDWIDTH_UPDATE_INTERVAL 100 // milliseconds
+/* above this number of damage rects, a single image of their extents is sent */
+#define RED_DISPLAY_UPDATE_DAMAGE_MAX_RECTS 16
+
+/* surface area images with both dimensions of at least 2 tiles are split into
+ * tiles that are cached by content in the client's pixmap cache */
+#define RED_IMAGE_TILE_MIN_SIZE 16
+/* surface area images of at least 2 bands are split into bands of about
+ * this size, which are encoded and sent one after the other */
+#define RED_IMAGE_BAND_SIZE (2 * 1024 * 1024)
+#define RED_IMAGE_BAND_MIN_HEIGHT 16
+
+/* small drawables of the primary surface that wait in a client's pipe are
+ * replaced by one image of their extents, when the image is estimated to
+ * be cheaper: its area is compared with the sum of the drawables areas plus
+ * a per message overhead */
+#define RED_COALESCE_SMALL_DRAWABLE_AREA (64 * 64)
+#define RED_COALESCE_MIN_DRAWABLES 16
+#define RED_COALESCE_MAX_DRAWABLES 128
+#define RED_COALESCE_MESSAGE_OVERHEAD_AREA 256
+/* the pipe is checked on every push, so the small drawables are only looked
+ * for among this many of its oldest items */
+#define RED_COALESCE_MAX_SCAN_ITEMS 256
+
+/* lossless compression is skipped for bitmaps that are estimated to shrink
+ * by less than RED_INCOMPRESSIBLE_MIN_RATIO, see red_bitmap_is_incompressible */
+#define RED_INCOMPRESSIBLE_MIN_SIZE (16 * 1024)
+#define RED_INCOMPRESSIBLE_SAMPLE_LINES 8
+#define RED_INCOMPRESSIBLE_MIN_RATIO 1.1
+/* with COMPRESS_STAT, one in this many bitmaps estimated incompressible is
+ * compressed anyway, to count the estimations that were wrong */
+#define RED_INCOMPRESSIBLE_CHECK_INTERVAL 16
+
+/* adaptive codec selection, see red_codec_select_quic: the estimates of a
+ * codec are used once they have RED_CODEC_MIN_SAMPLES samples, and every
+ * RED_CODEC_EXPLORE_INTERVAL-th decision of a content class picks the least
+ * sampled codec, to keep the estimates up to date */
+#define RED_CODEC_MIN_SAMPLES 8
+#define RED_CODEC_EXPLORE_INTERVAL 16
+#define RED_CODEC_EWMA_WEIGHT 0.125
+/* the jpeg quality is lowered while an average jpeg image is expected to
+ * take longer than this to reach the client */
+#define RED_CODEC_JPEG_TARGET_MS 100
+
+/* encoded images shared by the clients of the display channel, see
+ * EncodedImageCache */
+#define RED_ENCODED_IMAGE_CACHE_SIZE (32 * 1024 * 1024)
+#define ENCODED_IMAGE_CACHE_HASH_SHIFT 10
+#define ENCODED_IMAGE_CACHE_HASH_SIZE (1 << ENCODED_IMAGE_CACHE_HASH_SHIFT)
+#define ENCODED_IMAGE_CACHE_HASH_MASK (ENCODED_IMAGE_CACHE_HASH_SIZE - 1)
+#define ENCODED_IMAGE_CACHE_HASH_KEY(id) ((id) & ENCODED_IMAGE_CACHE_HASH_MASK)
+
+/* released compress buffers are kept for reuse; when more than the high
+ * watermark are free, the least recently released ones are freed down to
+ * the low watermark */
+#define RED_COMPRESS_BUFS_HIGH_WATERMARK 256 // 16MB
+#define RED_COMPRESS_BUFS_LOW_WATERMARK 64
+
+/* bitmaps that the guest doesn't ask to cache are identified by a hash of
+ * their content, see red_display_content_cache_tag. Bigger bitmaps are
+ * rarely repeated and would push the guest cached ones out of the cache. */
+#define RED_CONTENT_CACHE_MIN_PIXELS 256
+#define RED_CONTENT_CACHE_MAX_PIXELS (512 * 512)
+#define RED_CONTENT_CACHE_SEEN_SIZE 4096
+
 #define ZLIB_DEFAULT_COMPRESSION_LEVEL 3
 #define MIN_GLZ_SIZE_FOR_ZLIB 100
+/* per client zlib level of the ZLIB_GLZ wrap, see red_zlib_select_level:
+ * zlib may use RED_ZLIB_CPU_BUDGET percent of each RED_ZLIB_BUDGET_WINDOW,
+ * and every RED_ZLIB_BACKLOG_ITEMS items waiting in the client pipe make
+ * the transmission of a byte count once more */
+#define RED_ZLIB_CPU_BUDGET 20
+#define RED_ZLIB_BUDGET_WINDOW (1000 * 1000 * 1000) // 1 second
+#define RED_ZLIB_BACKLOG_ITEMS 8
 
 #define VALIDATE_SURFACE_RET(worker, surface_id) \
     if (!validate_surface(worker, surface_id)) { \
@@ -220,6 +305,9 @@ static const char *jpeg_stat_name = "jpeg";
 static const char *zlib_stat_name = "zlib_glz";
 static const char *jpeg_alpha_stat_name = "jpeg_alpha";
 static const char *lz4_stat_name = "lz4";
+static const char *estimate_stat_name = "estimate";
+static const char *incompressible_stat_name = "incompressible";
+static const char *content_hash_stat_name = "content_hash";
 
 static inline void stat_compress_init(stat_info_t *info, const char *name)
 {
@@ -309,6 +397,7 @@ typedef struct ImageItem {
     int image_format;
     uint32_t image_flags;
     int can_lossy;
+    uint64_t cache_id; // content based pixmap cache id of tiles, 0 otherwise
     uint8_t data[0];
 } ImageItem;
 
@@ -395,6 +484,56 @@ struct RedGlzDrawable {
     DisplayChannelClient *dcc;
 };
 
+/* With several clients connected to the display channel, the same bitmap is
+ * compressed for each of them in fill_bits. Encodings that do not depend on
+ * client state, i.e. all but GLZ and LZ palette images, are kept here and
+ * reused by the other clients. Images are identified by their id when the
+ * guest caches them, and by their content otherwise. */
+typedef struct EncodedImageKey {
+    uint64_t id;
+    uint32_t width;
+    uint32_t height;
+    uint8_t format;
+    uint8_t flags;
+    uint8_t by_content;
+    uint8_t can_lossy;
+    uint8_t compression;
+    uint8_t enable_jpeg;
+    uint8_t jpeg_quality;
+    uint8_t lz4;
+} EncodedImageKey;
+
+typedef struct EncodedImage EncodedImage;
+struct EncodedImage {
+    RingItem lru_link;
+    EncodedImage *next;
+    uint32_t refs; // the cache and the messages being sent
+    EncodedImageKey key;
+    SpiceImage image; // descriptor.type and u of the encoded image
+    int is_lossy;
+    int graduality;   // the codec was chosen for, see red_encoded_image_codec_matches
+    uint32_t size;
+    uint8_t data[0];
+};
+
+typedef struct EncodedImageCache {
+    EncodedImage *hash_table[ENCODED_IMAGE_CACHE_HASH_SIZE];
+    Ring lru;
+    uint64_t size;
+    uint64_t max_size; // 0 - disabled
+    uint32_t hits;
+    uint32_t misses;
+} EncodedImageCache;
+
+/* the content ids that were seen once, indexed by their high bits. Content
+ * gets a cache id only when it is seen a second time. */
+typedef struct ContentCache {
+    uint32_t min_pixels; // 0 - disabled
+    uint64_t seen[RED_CONTENT_CACHE_SEEN_SIZE];
+    uint32_t tagged;
+    uint32_t hits;
+} ContentCache;
+
 pthread_mutex_t glz_dictionary_list_lock = PTHREAD_MUTEX_INITIALIZER;
 Ring glz_dictionary_list = {&glz_dictionary_list, &glz_dictionary_list};
 
@@ -407,12 +546,35 @@ struct DisplayChannel {
     int zlib_level;
 
     RedCompressBuf *free_compress_bufs;
+    uint32_t num_free_compress_bufs;
+    uint32_t num_compress_bufs; // free and in use
+    EncodedImageCache encoded_image_cache;
+    ContentCache content_cache;
 
 #ifdef RED_STATISTICS
     StatNodeRef stat;
     uint64_t *cache_hits_counter;
     uint64_t *add_to_cache_counter;
     uint64_t *non_cache_counter;
+    uint64_t *deferred_drawables_counter;
+    uint64_t *damage_images_counter;
+    uint64_t *tile_cache_hits_counter;
+    uint64_t *tile_cache_misses_counter;
+    uint64_t *coalesced_drawables_counter;
+    uint64_t *encoded_cache_hits_counter;
+    uint64_t *encoded_cache_misses_counter;
+    uint64_t *compress_bufs_alloc_counter;
+    uint64_t *compress_bufs_reuse_counter;
+    uint64_t *compress_bufs_trim_counter;
+    uint64_t *codec_quic_counter;
+    uint64_t *codec_lz_counter;
+    uint64_t *codec_explore_counter;
+    uint64_t *jpeg_quality_changes_counter;
+    uint64_t *content_cache_tagged_counter;
+    uint64_t *content_cache_hits_counter;
+    uint64_t *zlib_glz_skipped_counter;
+    uint64_t *zlib_glz_saved_bytes_counter;
+    uint64_t *zlib_glz_cpu_us_counter;
 #endif
 #ifdef COMPRESS_STAT
     stat_info_t lz_stat;
@@ -422,6 +584,12 @@ struct DisplayChannel {
     stat_info_t zlib_glz_stat;
     stat_info_t jpeg_alpha_stat;
     stat_info_t lz4_stat;
+    stat_info_t estimate_stat;       // compressibility estimations
+    stat_info_t incompressible_stat; // bitmaps sent uncompressed after estimation
+    stat_info_t content_hash_stat;
+    uint32_t mispredicted_compressible;   // estimated compressible, but did not shrink
+    uint32_t mispredicted_incompressible; // estimated incompressible, but shrunk when checked
+    uint32_t zlib_glz_skipped;               // glz images the zlib level selection left as is
 #endif
 };
 
@@ -497,6 +665,9 @@ struct Drawable {
     int last_gradual_frame;
     Stream *stream;
     Stream *sized_stream;
+    uint64_t frame_hash; // of the stream frame content, 0 - not computed yet
+    uint32_t stream_frame; // video frame of a tile of a tiled stream, 0 - not a tile
+    int stream_overlay;    // drawn over a running stream, see red_stream_add_overlay
     int streamable;
     BitmapGradualType copy_bitmap_graduality;
     uint32_t group_id;
@@ -604,6 +775,13 @@ typedef struct RedWorker {
     uint32_t stream_count;
 
     uint32_t bits_unique;
+    uint32_t image_tile_size; // 0 - surface area images are not tiled
+    const RedBitmapSimdOps *bitmap_simd_ops; // NULL - scalar bitmap scans
+    uint32_t zlib_cpu_budget; // percent, see ZlibLevelSelector
+    int adaptive_codec;       // see red_codec_select_quic
+    int glz_hash_size_log;    // -1 - chosen per client, see red_init_glz_dictionary_hash
+    int glz_hash_chain_log;
+    int display_update_interval_ms; // -1 - chosen per client, see red_display_get_update_interval
 
     _Drawable drawables[NUM_DRAWABLES];
     _Drawable *free_drawables;
@@ -622,7 +800,14 @@ typedef struct RedWorker {
     Ring streams;
     ItemTrace items_trace[NUM_TRACE_ITEMS];
     uint32_t next_item_trace;
+    StreamDetector stream_detector;
     uint64_t streams_size_total;
+    uint32_t stream_pacer_burst_ms; // 0 - the stream frames are not paced
+    uint32_t stream_overlay_max_percent; // 0 - any drawable over a stream detaches it
+    /* low latency streaming: the frames are played stream_latency_ms after
+     * they are sent instead of the client latency after they were drawn, see
+     * red_stream_get_frame_mm_time. 0 - disabled */
+    uint32_t stream_latency_ms;
 
     QuicData quic_data;
     QuicContext *quic;
@@ -653,6 +838,7 @@ typedef struct RedWorker {
     StatNodeRef stat;
     uint64_t *wakeup_counter;
     uint64_t *command_counter;
+    uint64_t *merged_streams_counter;
 #endif
 
     int driver_cap_monitors_config;
@@ -705,11 +891,14 @@ static void display_channel_push_release(DisplayChannelClient *dcc, uint8_t type
 static void red_display_release_stream_clip(RedWorker *worker, StreamClipItem *item);
 static int red_display_free_some_independent_glz_drawables(DisplayChannelClient *dcc);
 static void red_display_free_glz_drawable(DisplayChannelClient *dcc, RedGlzDrawable *drawable);
+static void red_drawable_content_cache_tag(RedWorker *worker, Drawable *drawable);
 static ImageItem *red_add_surface_area_image(DisplayChannelClient *dcc, int surface_id,
                                              SpiceRect *area, PipeItem *pos, int can_lossy);
 static BitmapGradualType _get_bitmap_graduality_level(RedWorker *worker, SpiceBitmap *bitmap,
                                                       uint32_t group_id);
 static inline int _stride_is_extra(SpiceBitmap *bitmap);
+static uint64_t red_stream_frame_hash(Drawable *drawable);
+static void red_stream_agent_set_frame_lossless(StreamAgent *agent, Drawable *drawable);
 
 static void display_channel_client_release_item_before_push(DisplayChannelClient *dcc,
                                                             PipeItem *item);
@@ -847,6 +1036,34 @@ static void print_compress_stats(DisplayChannel *display_channel)
                                     display_channel->lz4_stat.total +
                                     display_channel->jpeg_alpha_stat.total)
                );
+    spice_info("Estimated %d images in %.2f(s): %d (%.2f MB) incompressible, "
+               "%d compressed with ratio below %.2f, %d of %d checked compressed above it",
+               display_channel->estimate_stat.count,
+               stat_cpu_time_to_sec(display_channel->estimate_stat.total),
+               display_channel->incompressible_stat.count,
+               stat_byte_to_mega(display_channel->incompressible_stat.orig_size),
+               display_channel->mispredicted_compressible,
+               RED_INCOMPRESSIBLE_MIN_RATIO,
+               display_channel->mispredicted_incompressible,
+               display_channel->incompressible_stat.count / RED_INCOMPRESSIBLE_CHECK_INTERVAL);
+    spice_info("Shared encoded images: %u hits, %u misses, %.2f MB cached",
+               display_channel->encoded_image_cache.hits,
+               display_channel->encoded_image_cache.misses,
+               stat_byte_to_mega(display_channel->encoded_image_cache.size));
+    spice_info("Content hashed %d bitmaps, %.2f MB in %.2f(s): %u cache ids, %u hits",
+               display_channel->content_hash_stat.count,
+               stat_byte_to_mega(display_channel->content_hash_stat.orig_size),
+               stat_cpu_time_to_sec(display_channel->content_hash_stat.total),
+               display_channel->content_cache.tagged,
+               display_channel->content_cache.hits);
+    spice_info("ZLIB GLZ saved %.2f MB in %.2f(s), %u images left as GLZ",
+               stat_byte_to_mega(display_channel->zlib_glz_stat.orig_size -
+                                 display_channel->zlib_glz_stat.comp_size),
+               stat_cpu_time_to_sec(display_channel->zlib_glz_stat.total),
+               display_channel->zlib_glz_skipped);
+    spice_info("Compress buffers: %u allocated, %u free",
+               display_channel->num_compress_bufs,
+               display_channel->num_free_compress_bufs);
 }
 
 #endif
@@ -1094,10 +1311,108 @@ static inline DrawablePipeItem *ref_drawable_pipe_item(DrawablePipeItem *dpi)
     return dpi;
 }
 
+/* Sends the accumulated damage of the primary surface as images, one per
+ * damage rect (or one for their extents when the region is fragmented). The
+ * images are read from the surface after rendering, so they replace all the
+ * drawables that were deferred during the window. */
+static void dcc_flush_update_damage(DisplayChannelClient *dcc)
+{
+    DisplayChannel *display_channel = DCC_TO_DC(dcc);
+    RedWorker *worker = DCC_TO_WORKER(dcc);
+    SpiceRect *rects;
+    int num_rects;
+    int i;
+
+    if (region_is_empty(&dcc->update_damage)) {
+        return;
+    }
+    if (!worker->surfaces[0].context.canvas || !dcc->surface_client_created[0]) {
+        region_clear(&dcc->update_damage);
+        return;
+    }
+
+    num_rects = pixman_region32_n_rects(&dcc->update_damage);
+    if (num_rects > RED_DISPLAY_UPDATE_DAMAGE_MAX_RECTS) {
+        num_rects = 1;
+        rects = spice_new(SpiceRect, 1);
+        region_extents(&dcc->update_damage, rects);
+    } else {
+        rects = spice_new(SpiceRect, num_rects);
+        region_ret_rects(&dcc->update_damage, rects, num_rects);
+    }
+    region_clear(&dcc->update_damage);
+
+    for (i = 0; i < num_rects; i++) {
+        red_update_area(worker, &rects[i], 0);
+        red_add_surface_area_image(dcc, 0, &rects[i], NULL, TRUE);
+        stat_inc_counter(display_channel->damage_images_counter, 1);
+    }
+    free(rects);
+}
+
+static inline int dcc_drawable_reads_update_damage(DisplayChannelClient *dcc,
+                                                   Drawable *drawable)
+{
+    RedDrawable *red_drawable = drawable->red_drawable;
+    SpiceRect damage_area;
+    int x;
+
+    if (region_is_empty(&dcc->update_damage)) {
+        return FALSE;
+    }
+    region_extents(&dcc->update_damage, &damage_area);
+    if (is_primary_surface(dcc->common.worker, drawable->surface_id) &&
+        rect_intersects(&damage_area, &red_drawable->bbox)) {
+        return TRUE;
+    }
+    for (x = 0; x < 3; ++x) {
+        if (is_primary_surface(dcc->common.worker, drawable->surfaces_dest[x]) &&
+            rect_intersects(&damage_area, &red_drawable->surfaces_rects[x])) {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+/* Returns TRUE if the drawable was absorbed into the client's update damage
+ * instead of being added to its pipe. Only non-stream drawables of the primary
+ * surface are deferred; any other drawable that touches the pending damage
+ * flushes it first, so that the client renders it on up-to-date content. */
+static int dcc_defer_drawable(DisplayChannelClient *dcc, Drawable *drawable)
+{
+    red_time_t now;
+
+    if (!dcc->update_interval_ms) {
+        return FALSE;
+    }
+
+    if (drawable->stream ||
+        !is_primary_surface(dcc->common.worker, drawable->surface_id) ||
+        !dcc->surface_client_created[drawable->surface_id]) {
+        if (dcc_drawable_reads_update_damage(dcc, drawable)) {
+            dcc_flush_update_damage(dcc);
+        }
+        return FALSE;
+    }
+
+    now = red_get_monotonic_time();
+    if (!dcc->update_window_start) {
+        /* first update after an idle period is sent right away */
+        dcc->update_window_start = now;
+        return FALSE;
+    }
+    region_add(&dcc->update_damage, &drawable->red_drawable->bbox);
+    stat_inc_counter(DCC_TO_DC(dcc)->deferred_drawables_counter, 1);
+    return TRUE;
+}
+
 static inline void red_pipe_add_drawable(DisplayChannelClient *dcc, Drawable *drawable)
 {
     DrawablePipeItem *dpi;
 
+    if (dcc_defer_drawable(dcc, drawable)) {
+        return;
+    }
     red_handle_drawable_surfaces_client_synced(dcc, drawable);
     dpi = get_drawable_pipe_item(dcc, drawable);
     red_channel_client_pipe_add(&dcc->common.base, &dpi->dpi_pipe_item);
@@ -1114,11 +1429,24 @@ static inline void red_pipes_add_drawable(RedWorker *worker, Drawable *drawable)
     }
 }
 
+/* For the drawables queued at another place than the head of the pipe:
+ * returns TRUE if the drawable was deferred, or if it builds on the update
+ * damage and was queued at the head, after the damage images the flush
+ * queues there. */
+static int dcc_defer_drawable_at(DisplayChannelClient *dcc, Drawable *drawable)
+{
+    if (dcc_drawable_reads_update_damage(dcc, drawable)) {
+        red_pipe_add_drawable(dcc, drawable);
+        return TRUE;
+    }
+    return dcc_defer_drawable(dcc, drawable);
+}
+
 static inline void red_pipe_add_drawable_to_tail(DisplayChannelClient *dcc, Drawable *drawable)
 {
     DrawablePipeItem *dpi;
 
-    if (!dcc) {
+    if (!dcc || dcc_defer_drawable_at(dcc, drawable)) {
         return;
     }
     red_handle_drawable_surfaces_client_synced(dcc, drawable);
@@ -1137,6 +1465,9 @@ static inline void red_pipes_add_drawable_after(RedWorker *worker,
     DRAWABLE_FOREACH_DPI_SAFE(pos_after, dpi_link, dpi_next, dpi_pos_after) {
         num_other_linked++;
         dcc = dpi_pos_after->dcc;
+        if (dcc_defer_drawable_at(dcc, drawable)) {
+            continue;
+        }
         red_handle_drawable_surfaces_client_synced(dcc, drawable);
         dpi = get_drawable_pipe_item(dcc, drawable);
         red_channel_client_pipe_add_after(&dcc->common.base, &dpi->dpi_pipe_item,
@@ -1313,6 +1644,9 @@ static inline void red_destroy_surface_item(RedWorker *worker,
         return;
     }
     dcc->surface_client_created[surface_id] = FALSE;
+    if (is_primary_surface(worker, surface_id)) {
+        region_clear(&dcc->update_damage);
+    }
     channel = &worker->display_channel->common.base;
     destroy = get_surface_destroy_item(channel, surface_id);
     red_channel_client_pipe_add(&dcc->common.base, &destroy->pipe_item);
@@ -1482,10 +1816,22 @@ static inline void container_cleanup(RedWorker *worker, Container *container)
     }
 }
 
+/* in filter mode, drawables smaller than RED_STREAM_MIN_SIZE are streamed
+ * only as tiles of a merged stream */
+static inline int red_is_stream_size(RedWorker *worker, Drawable *drawable)
+{
+    SpiceRect* rect = &drawable->red_drawable->u.copy.src_area;
+
+    if (worker->streaming_video != SPICE_STREAM_VIDEO_FILTER) {
+        return TRUE;
+    }
+    return (rect->right - rect->left) * (rect->bottom - rect->top) >= RED_STREAM_MIN_SIZE;
+}
+
 static inline void red_add_item_trace(RedWorker *worker, Drawable *item)
 {
     ItemTrace *trace;
-    if (!item->streamable) {
+    if (!item->streamable || !red_is_stream_size(worker, item)) {
         return;
     }
 
@@ -2009,6 +2355,11 @@ static void red_release_stream(RedWorker *worker, Stream *stream)
 {
     if (!--stream->refs) {
         spice_assert(!ring_item_is_linked(&stream->link));
+        if (stream->frame_cache) {
+            mjpeg_frame_cache_destroy(stream->frame_cache);
+            stream->frame_cache = NULL;
+        }
+        region_destroy(&stream->tile_frame_rgn);
         red_free_stream(worker, stream);
         worker->stream_count--;
     }
@@ -2069,16 +2420,62 @@ static inline int get_stream_id(RedWorker *worker, Stream *stream)
     return (int)(stream - worker->streams_buf);
 }
 
+/* The tiles of a tiled stream belong to the same video frame until one of
+ * them repaints a part that a tile of the frame already painted. */
+static int red_stream_is_new_tile_frame(Stream *stream, Drawable *drawable)
+{
+    QRegion tile;
+    int new_frame;
+
+    region_init(&tile);
+    region_add(&tile, &drawable->red_drawable->bbox);
+    new_frame = region_intersects(&tile, &stream->tile_frame_rgn);
+    region_destroy(&tile);
+    return new_frame;
+}
+
+/*
+ * A stream that repeats the same frame, like a paused video, is idle: once
+ * it was idle for RED_STREAM_TIMOUT, the frame is sent lossless like when
+ * the stream times out, but the stream keeps running (see
+ * red_handle_streams_timout). The frames of tiled streams are not compared.
+ */
+static void red_stream_update_idle_time(RedWorker *worker, Stream *stream, Drawable *drawable)
+{
+    uint64_t hash = 0;
+
+    if (!stream->tiled && display_is_connected(worker)) {
+        hash = red_stream_frame_hash(drawable);
+    }
+    if (!hash || hash != stream->last_frame_hash) {
+        stream->last_change_time = drawable->creation_time;
+        stream->idle_upgraded = FALSE;
+    }
+    stream->last_frame_hash = hash;
+}
+
 static void red_attach_stream(RedWorker *worker, Drawable *drawable, Stream *stream)
 {
     DisplayChannelClient *dcc;
     RingItem *item, *next;
+    int new_frame = TRUE;
 
     spice_assert(!drawable->stream && !stream->current);
     spice_assert(drawable && stream);
     stream->current = drawable;
     drawable->stream = stream;
     stream->last_time = drawable->creation_time;
+    red_stream_update_idle_time(worker, stream, drawable);
+
+    if (stream->tiled) {
+        new_frame = red_stream_is_new_tile_frame(stream, drawable);
+        if (new_frame) {
+            stream->tile_frame++;
+            region_clear(&stream->tile_frame_rgn);
+        }
+        region_add(&stream->tile_frame_rgn, &drawable->red_drawable->bbox);
+        drawable->stream_frame = stream->tile_frame;
+    }
 
     uint64_t duration = drawable->creation_time - stream->input_fps_start_time;
     if (duration >= RED_STREAM_INPUT_FPS_TIMEOUT) {
@@ -2087,7 +2484,7 @@ static void red_attach_stream(RedWorker *worker, Drawable *drawable, Stream *str
         spice_debug("input-fps=%u", stream->input_fps);
         stream->num_input_frames = 0;
         stream->input_fps_start_time = drawable->creation_time;
-    } else {
+    } else if (new_frame) {
         stream->num_input_frames++;
     }
 
@@ -2108,7 +2505,9 @@ static void red_attach_stream(RedWorker *worker, Drawable *drawable, Stream *str
             push_stream_clip(dcc, agent);
         }
 #ifdef STREAM_STATS
-        agent->stats.num_input_frames++;
+        if (new_frame) {
+            agent->stats.num_input_frames++;
+        }
 #endif
     }
 }
@@ -2125,19 +2524,29 @@ static void red_print_stream_stats(DisplayChannelClient *dcc, StreamAgent *agent
     }
 
     spice_debug("stream=%"PRIdPTR" dim=(%dx%d) #in-frames=%"PRIu64" #in-avg-fps=%.2f #out-frames=%"PRIu64" "
-                "out/in=%.2f #drops=%"PRIu64" (#pipe=%"PRIu64" #fps=%"PRIu64") out-avg-fps=%.2f "
+                "out/in=%.2f #drops=%"PRIu64" (#pipe=%"PRIu64" #fps=%"PRIu64" #pacer=%"PRIu64" "
+                "#late=%"PRIu64") "
+                "#skipped=%"PRIu64" #overlays=%"PRIu64" out-avg-fps=%.2f "
                 "passed-mm-time(sec)=%.2f size-total(MB)=%.2f size-per-sec(Mbps)=%.2f "
                 "size-per-frame(KBpf)=%.2f avg-quality=%.2f "
-                "start-bit-rate(Mbps)=%.2f end-bit-rate(Mbps)=%.2f",
+                "start-bit-rate(Mbps)=%.2f end-bit-rate(Mbps)=%.2f #shared-frames=%"PRIu64" "
+                "#scaled-frames=%"PRIu64" #quality-evals=%"PRIu64" #eval-frames=%"PRIu64" "
+                "eval-cpu(ms)=%.2f",
                 agent - dcc->stream_agents, agent->stream->width, agent->stream->height,
                 stats->num_input_frames,
                 stats->num_input_frames / passed_mm_time,
                 stats->num_frames_sent,
                 (stats->num_frames_sent + 0.0) / stats->num_input_frames,
                 stats->num_drops_pipe +
-                stats->num_drops_fps,
+                stats->num_drops_fps +
+                stats->num_drops_pacer +
+                stats->num_drops_late,
                 stats->num_drops_pipe,
                 stats->num_drops_fps,
+                stats->num_drops_pacer,
+                stats->num_drops_late,
+                stats->num_frames_skipped,
+                stats->num_overlays,
                 stats->num_frames_sent / passed_mm_time,
                 passed_mm_time,
                 stats->size_sent / 1024.0 / 1024.0,
@@ -2145,7 +2554,12 @@ static void red_print_stream_stats(DisplayChannelClient *dcc, StreamAgent *agent
                 stats->size_sent / 1000.0 / stats->num_frames_sent,
                 encoder_stats.avg_quality,
                 encoder_stats.starting_bit_rate / (1024.0 * 1024),
-                encoder_stats.cur_bit_rate / (1024.0 * 1024));
+                encoder_stats.cur_bit_rate / (1024.0 * 1024),
+                encoder_stats.num_shared_frames,
+                encoder_stats.num_scaled_frames,
+                encoder_stats.num_quality_evals,
+                encoder_stats.num_eval_frames,
+                encoder_stats.quality_eval_time / 1000.0 / 1000.0);
 #endif
 }
 
@@ -2197,6 +2611,27 @@ static int red_display_drawable_is_in_pipe(DisplayChannelClient *dcc, Drawable *
     return FALSE;
 }
 
+/* sends the drawable lossless, in its current region */
+static void red_display_push_upgrade(DisplayChannelClient *dcc, Drawable *drawable)
+{
+    RedChannelClient *rcc = &dcc->common.base;
+    UpgradeItem *upgrade_item;
+    int n_rects;
+
+    upgrade_item = spice_new(UpgradeItem, 1);
+    upgrade_item->refs = 1;
+    red_channel_pipe_item_init(rcc->channel,
+            &upgrade_item->base, PIPE_ITEM_TYPE_UPGRADE);
+    upgrade_item->drawable = drawable;
+    upgrade_item->drawable->refs++;
+    n_rects = pixman_region32_n_rects(&upgrade_item->drawable->tree_item.base.rgn);
+    upgrade_item->rects = spice_malloc_n_m(n_rects, sizeof(SpiceRect), sizeof(SpiceClipRects));
+    upgrade_item->rects->num_rects = n_rects;
+    region_ret_rects(&upgrade_item->drawable->tree_item.base.rgn,
+                     upgrade_item->rects->rects, n_rects);
+    red_channel_client_pipe_add(rcc, &upgrade_item->base);
+}
+
 /*
  * after red_display_detach_stream_gracefully is called for all the display channel clients,
  * red_detach_stream should be called. See comment (1).
@@ -2219,11 +2654,6 @@ static inline void red_display_detach_stream_gracefully(DisplayChannelClient *dc
 
     if (stream->current &&
         region_contains(&stream->current->tree_item.base.rgn, &agent->vis_region)) {
-        RedChannel *channel;
-        RedChannelClient *rcc;
-        UpgradeItem *upgrade_item;
-        int n_rects;
-
         /* (1) The caller should detach the drawable from the stream. This will
          * lead to sending the drawable losslessly, as an ordinary drawable. */
         if (red_display_drawable_is_in_pipe(dcc, stream->current)) {
@@ -2235,21 +2665,7 @@ static inline void red_display_detach_stream_gracefully(DisplayChannelClient *dc
         spice_debug("stream %d: upgrade by drawable. sized %d, box ==>",
                     stream_id, stream->current->sized_stream != NULL);
         rect_debug(&stream->current->red_drawable->bbox);
-        rcc = &dcc->common.base;
-        channel = rcc->channel;
-        upgrade_item = spice_new(UpgradeItem, 1);
-        upgrade_item->refs = 1;
-        red_channel_pipe_item_init(channel,
-                &upgrade_item->base, PIPE_ITEM_TYPE_UPGRADE);
-        upgrade_item->drawable = stream->current;
-        upgrade_item->drawable->refs++;
-        n_rects = pixman_region32_n_rects(&upgrade_item->drawable->tree_item.base.rgn);
-        upgrade_item->rects = spice_malloc_n_m(n_rects, sizeof(SpiceRect), sizeof(SpiceClipRects));
-        upgrade_item->rects->num_rects = n_rects;
-        region_ret_rects(&upgrade_item->drawable->tree_item.base.rgn,
-                         upgrade_item->rects->rects, n_rects);
-        red_channel_client_pipe_add(rcc, &upgrade_item->base);
-
+        red_display_push_upgrade(dcc, stream->current);
     } else {
         SpiceRect upgrade_area;
 
@@ -2268,6 +2684,31 @@ clear_vis_region:
     region_clear(&agent->vis_region);
 }
 
+/* the stream repeats a frame the clients were sent lossy, see
+ * red_stream_update_idle_time */
+static void red_upgrade_idle_stream(RedWorker *worker, Stream *stream)
+{
+    RingItem *item, *next;
+    DisplayChannelClient *dcc;
+
+    stream->idle_upgraded = TRUE;
+    if (!stream->current) {
+        return;
+    }
+    WORKER_FOREACH_DCC_SAFE(worker, item, next, dcc) {
+        StreamAgent *agent = &dcc->stream_agents[get_stream_id(worker, stream)];
+
+        /* a frame still in the pipe is sent lossy after the upgrade */
+        if (region_is_empty(&agent->vis_region) ||
+            red_display_drawable_is_in_pipe(dcc, stream->current)) {
+            continue;
+        }
+        spice_debug("stream %d: idle, upgrade by drawable", get_stream_id(worker, stream));
+        red_display_push_upgrade(dcc, stream->current);
+        red_stream_agent_set_frame_lossless(agent, stream->current);
+    }
+}
+
 static inline void red_detach_stream_gracefully(RedWorker *worker, Stream *stream,
                                                 Drawable *update_area_limit)
 {
@@ -2282,9 +2723,132 @@ static inline void red_detach_stream_gracefully(RedWorker *worker, Stream *strea
     }
 }
 
+static uint64_t red_region_get_area(QRegion *region)
+{
+    pixman_box32_t *rects;
+    uint64_t area = 0;
+    int n_rects, i;
+
+    rects = pixman_region32_rectangles(region, &n_rects);
+    for (i = 0; i < n_rects; i++) {
+        area += (uint64_t)(rects[i].x2 - rects[i].x1) * (rects[i].y2 - rects[i].y1);
+    }
+    return area;
+}
+
+/* whether the drawable combines its source with the surface content it is
+ * drawn on, unlike painting over parts of it */
+static int red_drawable_reads_dest(RedDrawable *drawable)
+{
+    uint16_t rop;
+
+    switch (drawable->type) {
+    case QXL_DRAW_FILL:
+        rop = drawable->u.fill.rop_descriptor;
+        break;
+    case QXL_DRAW_OPAQUE:
+        rop = drawable->u.opaque.rop_descriptor;
+        break;
+    case QXL_DRAW_COPY:
+        rop = drawable->u.copy.rop_descriptor;
+        break;
+    case QXL_DRAW_STROKE:
+        rop = drawable->u.stroke.fore_mode;
+        break;
+    case QXL_DRAW_TEXT:
+        rop = drawable->u.text.fore_mode;
+        if (drawable->u.text.back_brush.type != SPICE_BRUSH_TYPE_NONE) {
+            rop |= drawable->u.text.back_mode;
+        }
+        break;
+    case QXL_DRAW_TRANSPARENT:
+    case QXL_DRAW_BLACKNESS:
+    case QXL_DRAW_WHITENESS:
+        return FALSE;
+    default:
+        // blend, alpha blend, invers, rop3, composite and copy bits
+        return TRUE;
+    }
+    return (rop & SPICE_ROPD_INVERS_DEST) || (rop & SPICE_ROPD_OP_OR) ||
+           (rop & SPICE_ROPD_OP_AND) || (rop & SPICE_ROPD_OP_XOR) ||
+           (rop & SPICE_ROPD_OP_INVERS);
+}
+
+/*
+ * Drawables that are not opaque, like player controls, subtitles or
+ * tooltips, used to stop the streams under them and upgrade their area.
+ * When the stream keeps at least 100 - stream_overlay_max_percent of its
+ * area visible for each client, the video is clipped out of the drawable
+ * instead, like for opaque drawables (see red_streams_update_visible_region),
+ * and the next frame that covers it restores the clip (see red_attach_stream).
+ *
+ * The client draws the overlay on the last video frame it shows, which is
+ * lossy and older than the surface. So only drawables that do not read their
+ * destination qualify, and their area is marked lossy once they are sent (see
+ * marshall_qxl_drawable) to be upgraded before anything reads it. Blending
+ * drawables still detach the stream.
+ */
+static int red_stream_overlay_fits(RedWorker *worker, Stream *stream, Drawable *drawable,
+                                   QRegion *region)
+{
+    RingItem *item, *next;
+    DisplayChannelClient *dcc;
+    uint64_t max_hidden_area;
+    int covers_video = FALSE;
+
+    if (!worker->stream_overlay_max_percent || red_drawable_reads_dest(drawable->red_drawable)) {
+        return FALSE;
+    }
+    max_hidden_area = (uint64_t)rect_get_area(&stream->dest_area) *
+                      worker->stream_overlay_max_percent / 100;
+    WORKER_FOREACH_DCC_SAFE(worker, item, next, dcc) {
+        StreamAgent *agent = &dcc->stream_agents[get_stream_id(worker, stream)];
+        QRegion visible;
+        uint64_t visible_area;
+
+        if (!region_intersects(&agent->vis_region, region)) {
+            continue;
+        }
+        covers_video = TRUE;
+        region_clone(&visible, &agent->vis_region);
+        region_exclude(&visible, region);
+        visible_area = red_region_get_area(&visible);
+        region_destroy(&visible);
+        if (!visible_area ||
+            visible_area + max_hidden_area < rect_get_area(&stream->dest_area)) {
+            return FALSE;
+        }
+    }
+    // no client shows the stream there, there is nothing to keep
+    return covers_video;
+}
+
+static void red_stream_add_overlay(RedWorker *worker, Stream *stream, Drawable *drawable,
+                                   QRegion *region)
+{
+    RingItem *item, *next;
+    DisplayChannelClient *dcc;
+
+    WORKER_FOREACH_DCC_SAFE(worker, item, next, dcc) {
+        StreamAgent *agent = &dcc->stream_agents[get_stream_id(worker, stream)];
+
+        if (!region_intersects(&agent->vis_region, region)) {
+            continue;
+        }
+        drawable->stream_overlay = TRUE;
+        region_exclude(&agent->vis_region, region);
+        region_exclude(&agent->clip, region);
+        push_stream_clip(dcc, agent);
+#ifdef STREAM_STATS
+        agent->stats.num_overlays++;
+#endif
+    }
+}
+
 /*
  * region  : a primary surface region. Streams that intersects with the given
- *           region will be detached.
+ *           region will be detached, unless drawable is a small overlay (see
+ *           red_stream_overlay_fits).
  * drawable: If detaching the stream is triggered by the addition of a new drawable
  *           that is dependent on the given region, and the drawable is already a part
  *           of the "current tree", the drawable parameter should be set with
@@ -2305,6 +2869,13 @@ static void red_detach_streams_behind(RedWorker *worker, QRegion *region, Drawab
         int detach_stream = 0;
         item = ring_next(ring, item);
 
+        /* shadows and surface dependencies pass no drawable: they read the
+         * stream area */
+        if (drawable && has_clients && red_stream_overlay_fits(worker, stream, drawable, region)) {
+            red_stream_add_overlay(worker, stream, drawable, region);
+            continue;
+        }
+
         WORKER_FOREACH_DCC_SAFE(worker, dcc_ring_item, next, dcc) {
             StreamAgent *agent = &dcc->stream_agents[get_stream_id(worker, stream)];
 
@@ -2378,6 +2949,10 @@ static inline unsigned int red_get_streams_timout(RedWorker *worker)
         stream = SPICE_CONTAINEROF(item, Stream, link);
         red_time_t delta = (stream->last_time + RED_STREAM_TIMOUT) - now;
 
+        if (!stream->idle_upgraded) {
+            delta = MIN(delta, (red_time_t)(stream->last_change_time + RED_STREAM_TIMOUT) - now);
+        }
+
         if (delta < 1000 * 1000) {
             return 0;
         }
@@ -2399,6 +2974,55 @@ static inline void red_handle_streams_timout(RedWorker *worker)
         if (now >= (stream->last_time + RED_STREAM_TIMOUT)) {
             red_detach_stream_gracefully(worker, stream, NULL);
             red_stop_stream(worker, stream);
+        } else if (!stream->idle_upgraded &&
+                   now >= (stream->last_change_time + RED_STREAM_TIMOUT)) {
+            red_upgrade_idle_stream(worker, stream);
+        }
+    }
+}
+
+static inline red_time_t dcc_update_window_end(DisplayChannelClient *dcc)
+{
+    return dcc->update_window_start + (red_time_t)dcc->update_interval_ms * 1000 * 1000;
+}
+
+static inline unsigned int red_get_display_update_timeout(RedWorker *worker)
+{
+    unsigned int timeout = -1;
+    DisplayChannelClient *dcc;
+    RingItem *link, *next;
+
+    red_time_t now = red_get_monotonic_time();
+    WORKER_FOREACH_DCC_SAFE(worker, link, next, dcc) {
+        red_time_t delta;
+
+        if (!dcc->update_window_start) {
+            continue;
+        }
+        delta = dcc_update_window_end(dcc) - now;
+        if (delta < 1000 * 1000) {
+            return 0;
+        }
+        timeout = MIN(timeout, (unsigned int)(delta / (1000 * 1000)));
+    }
+    return timeout;
+}
+
+static inline void red_handle_display_update_timeout(RedWorker *worker)
+{
+    DisplayChannelClient *dcc;
+    RingItem *link, *next;
+
+    red_time_t now = red_get_monotonic_time();
+    WORKER_FOREACH_DCC_SAFE(worker, link, next, dcc) {
+        if (!dcc->update_window_start || now < dcc_update_window_end(dcc)) {
+            continue;
+        }
+        if (region_is_empty(&dcc->update_damage)) {
+            dcc->update_window_start = 0;
+        } else {
+            dcc_flush_update_damage(dcc);
+            dcc->update_window_start = now;
         }
     }
 }
@@ -2468,15 +3092,13 @@ static uint64_t red_stream_get_initial_bit_rate(DisplayChannelClient *dcc,
            stream->width * stream->height) / dcc->common.worker->streams_size_total;
 }
 
-static uint32_t red_stream_mjpeg_encoder_get_roundtrip(void *opaque)
+static uint32_t red_display_client_roundtrip_ms(DisplayChannelClient *dcc)
 {
-    StreamAgent *agent = opaque;
     int roundtrip;
 
-    spice_assert(agent);
-    roundtrip = red_channel_client_get_roundtrip_ms(&agent->dcc->common.base);
+    roundtrip = red_channel_client_get_roundtrip_ms(&dcc->common.base);
     if (roundtrip < 0) {
-        MainChannelClient *mcc = red_client_get_main(agent->dcc->common.base.client);
+        MainChannelClient *mcc = red_client_get_main(dcc->common.base.client);
 
         /*
          * the main channel client roundtrip might not have been
@@ -2489,54 +3111,188 @@ static uint32_t red_stream_mjpeg_encoder_get_roundtrip(void *opaque)
     return roundtrip;
 }
 
-static uint32_t red_stream_mjpeg_encoder_get_source_fps(void *opaque)
+/* bits per second */
+static uint64_t red_display_client_bit_rate(DisplayChannelClient *dcc)
 {
-    StreamAgent *agent = opaque;
+    MainChannelClient *mcc = red_client_get_main(dcc->common.base.client);
+    uint64_t bit_rate;
 
-    spice_assert(agent);
-    return agent->stream->input_fps;
+    if (main_channel_client_is_network_info_initialized(mcc) &&
+        (bit_rate = main_channel_client_get_bitrate_per_sec(mcc))) {
+        return bit_rate;
+    }
+    return dcc->common.is_low_bandwidth ? RED_STREAM_DEFAULT_LOW_START_BIT_RATE :
+                                          RED_STREAM_DEFAULT_HIGH_START_BIT_RATE;
 }
 
-static void red_display_update_streams_max_latency(DisplayChannelClient *dcc, StreamAgent *remove_agent)
+/* bytes per second the frames of the stream of agent may use */
+static uint64_t red_stream_agent_byte_rate(DisplayChannelClient *dcc, StreamAgent *agent)
 {
-    uint32_t new_max_latency = 0;
-    int i;
+    Stream *stream = agent->stream;
+    uint64_t size_total = dcc->common.worker->streams_size_total;
 
-    if (dcc->streams_max_latency != remove_agent->client_required_latency) {
-        return;
+    if (dcc->use_mjpeg_encoder_rate_control) {
+        return mjpeg_encoder_get_bit_rate(agent->mjpeg_encoder) / 8;
     }
+    if (size_total < stream->width * stream->height) {
+        // the stream was already stopped, it has the bandwidth of all the streams
+        size_total = stream->width * stream->height;
+    }
+    /* the same share of the bandwidth as red_stream_get_initial_bit_rate */
+    return (RED_STREAM_CHANNEL_CAPACITY * red_display_client_bit_rate(dcc) / 8 *
+           stream->width * stream->height) / size_total;
+}
 
-    dcc->streams_max_latency = 0;
-    if (dcc->common.worker->stream_count == 1) {
-        return;
+/*
+ * Token bucket pacing the frames of a stream agent: the bucket fills at the
+ * agent's byte rate, up to stream_pacer_burst_ms of it, and each frame sent
+ * takes its size from it. While the bucket is in debt, frames are dropped
+ * before they are encoded, so they leave at an even pace instead of in
+ * bursts that fill the pipe and delay the frames behind them.
+ * Returns FALSE if the frame should be dropped.
+ */
+static int red_stream_pacer_admit(DisplayChannelClient *dcc, StreamAgent *agent, uint64_t now)
+{
+    uint32_t burst_ms = dcc->common.worker->stream_pacer_burst_ms;
+    uint64_t byte_rate;
+    int64_t burst;
+
+    if (!burst_ms) {
+        return TRUE;
     }
-    for (i = 0; i < NUM_STREAMS; i++) {
-        StreamAgent *other_agent = &dcc->stream_agents[i];
-        if (other_agent == remove_agent || !other_agent->mjpeg_encoder) {
-            continue;
-        }
-        if (other_agent->client_required_latency > new_max_latency) {
-            new_max_latency = other_agent->client_required_latency;
-        }
+    byte_rate = red_stream_agent_byte_rate(dcc, agent);
+    burst = byte_rate * burst_ms / 1000;
+    if (agent->pacer_last_time) {
+        uint64_t elapsed = MIN(now - agent->pacer_last_time, 1000 * 1000 * 1000);
+
+        agent->pacer_tokens += elapsed * byte_rate / (1000 * 1000 * 1000);
+        agent->pacer_tokens = MIN(agent->pacer_tokens, burst);
+    } else {
+        agent->pacer_tokens = burst;
     }
-    dcc->streams_max_latency = new_max_latency;
+    agent->pacer_last_time = now;
+    return agent->pacer_tokens >= 0;
 }
 
-static void red_display_stream_agent_stop(DisplayChannelClient *dcc, StreamAgent *agent)
+static void red_stream_agent_reset_sent_frames(StreamAgent *agent)
 {
-    red_display_update_streams_max_latency(dcc, agent);
-    if (agent->mjpeg_encoder) {
-        mjpeg_encoder_destroy(agent->mjpeg_encoder);
-        agent->mjpeg_encoder = NULL;
-    }
+    memset(agent->sent_frames, 0, sizeof(agent->sent_frames));
+    agent->next_sent_frame = 0;
 }
 
-static void red_stream_update_client_playback_latency(void *opaque, uint32_t delay_ms)
+/*
+ * Paused videos and static slides repeat the same frame. The client still
+ * shows a frame sent at the same place with the same content, unless a
+ * frame at another place overlapped it since, or the clip of the stream
+ * changed (see red_display_marshall_stream_clip): such a frame is neither
+ * encoded nor sent again, unless the rate control now picks a higher
+ * quality or a smaller downscale for it.
+ */
+static int red_stream_agent_is_frame_shown(StreamAgent *agent, Drawable *drawable)
 {
-    StreamAgent *agent = opaque;
-    DisplayChannelClient *dcc = agent->dcc;
+    uint64_t hash = red_stream_frame_hash(drawable);
+    int quality, scale_shift;
+    int i;
 
-    red_display_update_streams_max_latency(dcc, agent);
+    mjpeg_encoder_get_next_frame_quality(agent->mjpeg_encoder, &quality, &scale_shift);
+    for (i = 0; i < STREAM_AGENT_SENT_FRAMES; i++) {
+        StreamSentFrame *sent = &agent->sent_frames[i];
+
+        if (sent->hash == hash && rect_is_equal(&sent->dest, &drawable->red_drawable->bbox)) {
+            return quality <= sent->quality && scale_shift >= sent->scale_shift;
+        }
+    }
+    return FALSE;
+}
+
+static void red_stream_agent_add_sent_frame(StreamAgent *agent, Drawable *drawable)
+{
+    SpiceRect *dest = &drawable->red_drawable->bbox;
+    StreamSentFrame *sent;
+    int i;
+
+    for (i = 0; i < STREAM_AGENT_SENT_FRAMES; i++) {
+        sent = &agent->sent_frames[i];
+        if (sent->hash && rect_intersects(&sent->dest, dest)) {
+            sent->hash = 0;
+        }
+    }
+    sent = &agent->sent_frames[agent->next_sent_frame];
+    agent->next_sent_frame = (agent->next_sent_frame + 1) % STREAM_AGENT_SENT_FRAMES;
+    sent->dest = *dest;
+    sent->hash = red_stream_frame_hash(drawable);
+    mjpeg_encoder_get_last_frame_quality(agent->mjpeg_encoder, &sent->quality,
+                                         &sent->scale_shift);
+}
+
+/* the client shows the frame lossless, see red_upgrade_idle_stream */
+static void red_stream_agent_set_frame_lossless(StreamAgent *agent, Drawable *drawable)
+{
+    StreamSentFrame *sent;
+
+    red_stream_agent_add_sent_frame(agent, drawable);
+    sent = &agent->sent_frames[(agent->next_sent_frame + STREAM_AGENT_SENT_FRAMES - 1) %
+                               STREAM_AGENT_SENT_FRAMES];
+    sent->quality = RED_STREAM_LOSSLESS_QUALITY;
+    sent->scale_shift = 0;
+}
+
+static uint32_t red_stream_mjpeg_encoder_get_roundtrip(void *opaque)
+{
+    StreamAgent *agent = opaque;
+
+    spice_assert(agent);
+    return red_display_client_roundtrip_ms(agent->dcc);
+}
+
+static uint32_t red_stream_mjpeg_encoder_get_source_fps(void *opaque)
+{
+    StreamAgent *agent = opaque;
+
+    spice_assert(agent);
+    return agent->stream->input_fps;
+}
+
+static void red_display_update_streams_max_latency(DisplayChannelClient *dcc, StreamAgent *remove_agent)
+{
+    uint32_t new_max_latency = 0;
+    int i;
+
+    if (dcc->streams_max_latency != remove_agent->client_required_latency) {
+        return;
+    }
+
+    dcc->streams_max_latency = 0;
+    if (dcc->common.worker->stream_count == 1) {
+        return;
+    }
+    for (i = 0; i < NUM_STREAMS; i++) {
+        StreamAgent *other_agent = &dcc->stream_agents[i];
+        if (other_agent == remove_agent || !other_agent->mjpeg_encoder) {
+            continue;
+        }
+        if (other_agent->client_required_latency > new_max_latency) {
+            new_max_latency = other_agent->client_required_latency;
+        }
+    }
+    dcc->streams_max_latency = new_max_latency;
+}
+
+static void red_display_stream_agent_stop(DisplayChannelClient *dcc, StreamAgent *agent)
+{
+    red_display_update_streams_max_latency(dcc, agent);
+    if (agent->mjpeg_encoder) {
+        mjpeg_encoder_destroy(agent->mjpeg_encoder);
+        agent->mjpeg_encoder = NULL;
+    }
+}
+
+static void red_stream_update_client_playback_latency(void *opaque, uint32_t delay_ms)
+{
+    StreamAgent *agent = opaque;
+    DisplayChannelClient *dcc = agent->dcc;
+
+    red_display_update_streams_max_latency(dcc, agent);
 
     agent->client_required_latency = delay_ms;
     if (delay_ms > agent->dcc->streams_max_latency) {
@@ -2562,6 +3318,11 @@ static void red_display_create_stream(DisplayChannelClient *dcc, Stream *stream)
     agent->drops = 0;
     agent->fps = MAX_FPS;
     agent->dcc = dcc;
+    agent->pacer_tokens = 0;
+    agent->pacer_last_time = 0;
+    agent->tile_frame = 0;
+    agent->tile_frame_dropped = FALSE;
+    red_stream_agent_reset_sent_frames(agent);
 
     if (dcc->use_mjpeg_encoder_rate_control) {
         MJpegEncoderRateControlCbs mjpeg_cbs;
@@ -2570,12 +3331,22 @@ static void red_display_create_stream(DisplayChannelClient *dcc, Stream *stream)
         mjpeg_cbs.get_roundtrip_ms = red_stream_mjpeg_encoder_get_roundtrip;
         mjpeg_cbs.get_source_fps = red_stream_mjpeg_encoder_get_source_fps;
         mjpeg_cbs.update_client_playback_delay = red_stream_update_client_playback_latency;
+        mjpeg_cbs.get_time = NULL;
 
         initial_bit_rate = red_stream_get_initial_bit_rate(dcc, stream);
         agent->mjpeg_encoder = mjpeg_encoder_new(initial_bit_rate, &mjpeg_cbs, agent);
+        if (red_channel_client_test_remote_cap(&dcc->common.base,
+                                               SPICE_DISPLAY_CAP_SIZED_STREAM)) {
+            mjpeg_encoder_enable_scaling(agent->mjpeg_encoder);
+        }
+        if (dcc->common.worker->stream_latency_ms) {
+            mjpeg_encoder_set_max_playback_delay(agent->mjpeg_encoder,
+                                                 dcc->common.worker->stream_latency_ms);
+        }
     } else {
         agent->mjpeg_encoder = mjpeg_encoder_new(0, NULL, NULL);
     }
+    mjpeg_encoder_set_simd_ops(agent->mjpeg_encoder, dcc->common.worker->bitmap_simd_ops);
     red_channel_client_pipe_add(&dcc->common.base, &agent->create_item);
 
     if (red_channel_client_test_remote_cap(&dcc->common.base, SPICE_DISPLAY_CAP_STREAM_REPORT)) {
@@ -2595,12 +3366,15 @@ static void red_display_create_stream(DisplayChannelClient *dcc, Stream *stream)
 #endif
 }
 
-static void red_create_stream(RedWorker *worker, Drawable *drawable)
+/* the stream shows dest_area, scaled from width x height, and starts with
+ * drawable. A tiled stream shows drawables that each cover a part of
+ * dest_area, as sized frames. */
+static void __red_create_stream(RedWorker *worker, Drawable *drawable, int width, int height,
+                                const SpiceRect *dest_area, int tiled)
 {
     DisplayChannelClient *dcc;
     RingItem *dcc_ring_item, *next;
     Stream *stream;
-    SpiceRect* src_rect;
 
     spice_assert(!drawable->stream);
 
@@ -2609,18 +3383,28 @@ static void red_create_stream(RedWorker *worker, Drawable *drawable)
     }
 
     spice_assert(drawable->red_drawable->type == QXL_DRAW_COPY);
-    src_rect = &drawable->red_drawable->u.copy.src_area;
 
     ring_add(&worker->streams, &stream->link);
     stream->current = drawable;
     stream->last_time = drawable->creation_time;
-    stream->width = src_rect->right - src_rect->left;
-    stream->height = src_rect->bottom - src_rect->top;
-    stream->dest_area = drawable->red_drawable->bbox;
+    stream->last_change_time = drawable->creation_time;
+    stream->last_frame_hash = 0;
+    stream->idle_upgraded = FALSE;
+    stream->width = width;
+    stream->height = height;
+    stream->dest_area = *dest_area;
     stream->refs = 1;
     SpiceBitmap *bitmap = &drawable->red_drawable->u.copy.src_bitmap->u.bitmap;
     stream->top_down = !!(bitmap->flags & SPICE_BITMAP_FLAGS_TOP_DOWN);
+    stream->tiled = tiled;
+    stream->tile_frame = 1;
+    region_init(&stream->tile_frame_rgn);
     drawable->stream = stream;
+    if (tiled) {
+        drawable->sized_stream = stream;
+        drawable->stream_frame = stream->tile_frame;
+        region_add(&stream->tile_frame_rgn, &drawable->red_drawable->bbox);
+    }
     stream->input_fps = MAX_FPS;
     stream->num_input_frames = 0;
     stream->input_fps_start_time = drawable->creation_time;
@@ -2629,12 +3413,20 @@ static void red_create_stream(RedWorker *worker, Drawable *drawable)
     WORKER_FOREACH_DCC_SAFE(worker, dcc_ring_item, next, dcc) {
         red_display_create_stream(dcc, stream);
     }
-    spice_debug("stream %d %dx%d (%d, %d) (%d, %d)", (int)(stream - worker->streams_buf), stream->width,
-                stream->height, stream->dest_area.left, stream->dest_area.top,
-                stream->dest_area.right, stream->dest_area.bottom);
+    spice_debug("stream %d %dx%d (%d, %d) (%d, %d)%s", (int)(stream - worker->streams_buf),
+                stream->width, stream->height, stream->dest_area.left, stream->dest_area.top,
+                stream->dest_area.right, stream->dest_area.bottom, tiled ? " tiled" : "");
     return;
 }
 
+static void red_create_stream(RedWorker *worker, Drawable *drawable)
+{
+    SpiceRect* src_rect = &drawable->red_drawable->u.copy.src_area;
+
+    __red_create_stream(worker, drawable, src_rect->right - src_rect->left,
+                        src_rect->bottom - src_rect->top, &drawable->red_drawable->bbox, FALSE);
+}
+
 static void red_disply_start_streams(DisplayChannelClient *dcc)
 {
     Ring *ring = &dcc->common.worker->streams;
@@ -2726,6 +3518,12 @@ static inline int __red_is_next_stream_frame(RedWorker *worker,
             candidate_src->bottom - candidate_src->top != other_src_height) {
             return STREAM_FRAME_NONE;
         }
+    } else if (stream && stream->tiled) {
+        /* tiles are sent as sized frames */
+        if (!rect_contains(other_dest, &red_drawable->bbox)) {
+            return STREAM_FRAME_NONE;
+        }
+        is_frame_container = TRUE;
     } else {
         if (rect_contains(&red_drawable->bbox, other_dest)) {
             int candidate_area = rect_get_area(&red_drawable->bbox);
@@ -2796,6 +3594,11 @@ static inline void pre_stream_item_swap(RedWorker *worker, Stream *stream, Drawa
         return;
     }
 
+    if (stream->tiled && !red_stream_is_new_tile_frame(stream, new_frame)) {
+        /* another tile of the frame, the current one is still sent */
+        return;
+    }
+
     index = get_stream_id(worker, stream);
     DRAWABLE_FOREACH_DPI_SAFE(stream->current, ring_item, next, dpi) {
         dcc = dpi->dcc;
@@ -2875,9 +3678,10 @@ static inline void red_update_copy_graduality(RedWorker* worker, Drawable *drawa
     }
 }
 
-static inline int red_is_stream_start(Drawable *drawable)
+static inline int red_is_stream_start(RedWorker *worker, Drawable *drawable)
 {
-    return ((drawable->frames_count >= RED_STREAM_FRAMES_START_CONDITION) &&
+    return red_is_stream_size(worker, drawable) &&
+           ((drawable->frames_count >= RED_STREAM_FRAMES_START_CONDITION) &&
             (drawable->gradual_frames_count >=
             (RED_STREAM_GRADUAL_FRAMES_START_CONDITION * drawable->frames_count)));
 }
@@ -2907,13 +3711,87 @@ static int red_stream_add_frame(RedWorker *worker,
         frame_drawable->last_gradual_frame = last_gradual_frame;
     }
 
-    if (red_is_stream_start(frame_drawable)) {
+    if (red_is_stream_start(worker, frame_drawable)) {
         red_create_stream(worker, frame_drawable);
         return TRUE;
     }
     return FALSE;
 }
 
+/*
+ * Feeds the damage history with a streamable drawable that did not become a
+ * stream frame. It is called once per drawable, when it is added to the
+ * tree, since a repeated bbox would be taken for the next frame. Once it
+ * shows a video that is painted as several rects, or
+ * as rects that vary from frame to frame, a tiled stream of their merged
+ * area is started, and the drawables that paint it are sent as sized frames.
+ */
+static void red_stream_detector_update(RedWorker *worker, Drawable *drawable)
+{
+    RingItem *item, *next;
+    DisplayChannelClient *dcc;
+    SpiceRect area;
+    int min_size;
+
+    if (drawable->stream || !drawable->streamable) {
+        return;
+    }
+
+    red_update_copy_graduality(worker, drawable);
+    min_size = worker->streaming_video == SPICE_STREAM_VIDEO_FILTER ? RED_STREAM_MIN_SIZE : 0;
+    if (!stream_detector_add(&worker->stream_detector, &drawable->red_drawable->bbox,
+                             drawable->creation_time,
+                             drawable->copy_bitmap_graduality != BITMAP_GRADUAL_LOW,
+                             min_size, &area)) {
+        return;
+    }
+
+    if (rect_is_equal(&area, &drawable->red_drawable->bbox) &&
+        red_is_stream_size(worker, drawable)) {
+        red_create_stream(worker, drawable);
+        return;
+    }
+
+    /* clients without sized streams would get the tiles as images anyway */
+    WORKER_FOREACH_DCC_SAFE(worker, item, next, dcc) {
+        if (!red_channel_client_test_remote_cap(&dcc->common.base,
+                                                SPICE_DISPLAY_CAP_SIZED_STREAM)) {
+            return;
+        }
+    }
+    __red_create_stream(worker, drawable, area.right - area.left, area.bottom - area.top,
+                        &area, TRUE);
+    stat_inc_counter(worker->merged_streams_counter, 1);
+}
+
+/* attaches a drawable that repaints a part of a tiled stream */
+static int red_attach_stream_tile(RedWorker *worker, Drawable *drawable)
+{
+    Ring *ring = &worker->streams;
+    RingItem *item = ring_get_head(ring);
+
+    while (item) {
+        Stream *stream = SPICE_CONTAINEROF(item, Stream, link);
+
+        item = ring_next(ring, item);
+        if (!stream->tiled ||
+            __red_is_next_stream_frame(worker, drawable, stream->width, stream->height,
+                                       &stream->dest_area, stream->last_time, stream,
+                                       TRUE) == STREAM_FRAME_NONE) {
+            continue;
+        }
+        if (stream->current) {
+            stream->current->streamable = FALSE; //prevent item trace
+            pre_stream_item_swap(worker, stream, drawable);
+            red_detach_stream(worker, stream, FALSE);
+        }
+        red_attach_stream(worker, drawable, stream);
+        drawable->sized_stream = stream;
+        return TRUE;
+    }
+    return FALSE;
+}
+
 static inline void red_stream_maintenance(RedWorker *worker, Drawable *candidate, Drawable *prev)
 {
     Stream *stream;
@@ -2940,7 +3818,7 @@ static inline void red_stream_maintenance(RedWorker *worker, Drawable *candidate
                 candidate->sized_stream = stream;
             }
         }
-    } else {
+    } else if (!red_attach_stream_tile(worker, candidate)) {
         if (red_is_next_stream_frame(worker, candidate, prev) != STREAM_FRAME_NONE) {
             red_stream_add_frame(worker, candidate,
                                  prev->frames_count,
@@ -2984,6 +3862,7 @@ static inline int red_current_add_equal(RedWorker *worker, DrawItem *item, TreeI
         int add_after = !!other_drawable->stream &&
                         is_drawable_independent_from_surfaces(drawable);
         red_stream_maintenance(worker, drawable, other_drawable);
+        red_stream_detector_update(worker, drawable);
         __current_add_drawable(worker, drawable, &other->siblings_link);
         other_drawable->refs++;
         current_remove_drawable(worker, other_drawable);
@@ -3130,6 +4009,7 @@ static void red_reset_stream_trace(RedWorker *worker)
 
     worker->next_item_trace = 0;
     memset(worker->items_trace, 0, sizeof(worker->items_trace));
+    stream_detector_reset(&worker->stream_detector);
 }
 
 static inline int red_current_add(RedWorker *worker, Ring *ring, Drawable *drawable)
@@ -3228,6 +4108,7 @@ static inline int red_current_add(RedWorker *worker, Ring *ring, Drawable *drawa
         region_or(&exclude_rgn, &item->base.rgn);
         exclude_region(worker, ring, exclude_base, &exclude_rgn, NULL, drawable);
         red_use_stream_trace(worker, drawable);
+        red_stream_detector_update(worker, drawable);
         red_streams_update_visible_region(worker, drawable);
         /*
          * Performing the insertion after exclude_region for
@@ -3345,15 +4226,8 @@ static inline void red_update_streamable(RedWorker *worker, Drawable *drawable,
         return;
     }
 
-    if (worker->streaming_video == SPICE_STREAM_VIDEO_FILTER) {
-        SpiceRect* rect;
-        int size;
-
-        rect = &drawable->red_drawable->u.copy.src_area;
-        size = (rect->right - rect->left) * (rect->bottom - rect->top);
-        if (size < RED_STREAM_MIN_SIZE) {
-            return;
-        }
+    if (!worker->stream_detector.start_frames && !red_is_stream_size(worker, drawable)) {
+        return;
     }
 
     drawable->streamable = TRUE;
@@ -3419,12 +4293,17 @@ static void red_get_area(RedWorker *worker, int surface_id, const SpiceRect *are
     canvas->ops->read_bits(canvas, dest, dest_stride, area);
 }
 
-static int rgb32_data_has_alpha(int width, int height, size_t stride,
+static int rgb32_data_has_alpha(RedWorker *worker, int width, int height, size_t stride,
                                 uint8_t *data, int *all_set_out)
 {
     uint32_t *line, *end, alpha;
     int has_alpha;
 
+    if (worker->bitmap_simd_ops) {
+        return worker->bitmap_simd_ops->rgb32_has_alpha(width, height, stride,
+                                                        data, all_set_out);
+    }
+
     has_alpha = FALSE;
     while (height-- > 0) {
         line = (uint32_t *)data;
@@ -3496,7 +4375,7 @@ static inline int red_handle_self_bitmap(RedWorker *worker, Drawable *drawable)
        high bytes as the surface may be used as source to an alpha_blend */
     if (!is_primary_surface(worker, drawable->surface_id) &&
         image->u.bitmap.format == SPICE_BITMAP_FMT_32BIT &&
-        rgb32_data_has_alpha(width, height, dest_stride, dest, &all_set)) {
+        rgb32_data_has_alpha(worker, width, height, dest_stride, dest, &all_set)) {
         if (all_set) {
             image->descriptor.flags |= SPICE_IMAGE_FLAGS_HIGH_BITS_SET;
         } else {
@@ -3688,6 +4567,8 @@ static inline void red_process_drawable(RedWorker *worker, RedDrawable *red_draw
         goto cleanup;
     }
 
+    red_drawable_content_cache_tag(worker, drawable);
+
     if (!red_handle_depends_on_target_surface(worker, surface_id)) {
         goto cleanup;
     }
@@ -4360,9 +5241,135 @@ static void red_current_flush(RedWorker *worker, int surface_id)
     red_current_clear(worker, surface_id);
 }
 
-// adding the pipe item after pos. If pos == NULL, adding to head.
-static ImageItem *red_add_surface_area_image(DisplayChannelClient *dcc, int surface_id,
-                                             SpiceRect *area, PipeItem *pos, int can_lossy)
+/* content hash of bitmaps, xxHash64: four independent lanes of 8 bytes keep
+ * the multipliers busy, so it runs at several GB/s */
+#define RED_HASH_PRIME1 11400714785074694791ULL
+#define RED_HASH_PRIME2 14029467366897019727ULL
+#define RED_HASH_PRIME3 1609587929392839161ULL
+#define RED_HASH_PRIME4 9650029242287828579ULL
+#define RED_HASH_PRIME5 2870177450012600261ULL
+#define RED_HASH_ROTL(x, r) (((x) << (r)) | ((x) >> (64 - (r))))
+
+static inline uint64_t red_hash_round(uint64_t acc, uint64_t input)
+{
+    acc += input * RED_HASH_PRIME2;
+    acc = RED_HASH_ROTL(acc, 31);
+    return acc * RED_HASH_PRIME1;
+}
+
+static inline uint64_t red_hash_merge_round(uint64_t acc, uint64_t val)
+{
+    acc ^= red_hash_round(0, val);
+    return acc * RED_HASH_PRIME1 + RED_HASH_PRIME4;
+}
+
+static inline uint64_t red_hash_read64(const uint8_t *data)
+{
+    uint64_t word;
+
+    memcpy(&word, data, sizeof(word));
+    return GUINT64_FROM_LE(word);
+}
+
+static uint64_t red_hash_bytes(const uint8_t *data, size_t size, uint64_t seed)
+{
+    const uint8_t *end = data + size;
+    uint64_t hash;
+
+    if (size >= 32) {
+        const uint8_t *limit = end - 32;
+        uint64_t v1 = seed + RED_HASH_PRIME1 + RED_HASH_PRIME2;
+        uint64_t v2 = seed + RED_HASH_PRIME2;
+        uint64_t v3 = seed;
+        uint64_t v4 = seed - RED_HASH_PRIME1;
+
+        do {
+            v1 = red_hash_round(v1, red_hash_read64(data));
+            v2 = red_hash_round(v2, red_hash_read64(data + 8));
+            v3 = red_hash_round(v3, red_hash_read64(data + 16));
+            v4 = red_hash_round(v4, red_hash_read64(data + 24));
+            data += 32;
+        } while (data <= limit);
+
+        hash = RED_HASH_ROTL(v1, 1) + RED_HASH_ROTL(v2, 7) +
+               RED_HASH_ROTL(v3, 12) + RED_HASH_ROTL(v4, 18);
+        hash = red_hash_merge_round(hash, v1);
+        hash = red_hash_merge_round(hash, v2);
+        hash = red_hash_merge_round(hash, v3);
+        hash = red_hash_merge_round(hash, v4);
+    } else {
+        hash = seed + RED_HASH_PRIME5;
+    }
+    hash += size;
+
+    for (; data + 8 <= end; data += 8) {
+        hash ^= red_hash_round(0, red_hash_read64(data));
+        hash = RED_HASH_ROTL(hash, 27) * RED_HASH_PRIME1 + RED_HASH_PRIME4;
+    }
+    if (data + 4 <= end) {
+        uint32_t word;
+
+        memcpy(&word, data, sizeof(word));
+        hash ^= (uint64_t)GUINT32_FROM_LE(word) * RED_HASH_PRIME1;
+        hash = RED_HASH_ROTL(hash, 23) * RED_HASH_PRIME2 + RED_HASH_PRIME3;
+        data += 4;
+    }
+    for (; data < end; data++) {
+        hash ^= *data * RED_HASH_PRIME5;
+        hash = RED_HASH_ROTL(hash, 11) * RED_HASH_PRIME1;
+    }
+
+    hash ^= hash >> 33;
+    hash *= RED_HASH_PRIME2;
+    hash ^= hash >> 29;
+    hash *= RED_HASH_PRIME3;
+    hash ^= hash >> 32;
+    return hash;
+}
+
+/* guest and red image ids hold their group in the low 32 bits, which is
+   always smaller than 2^31, so ids derived from a content hash set bit 31 */
+static inline uint64_t red_hash_to_image_id(uint64_t hash)
+{
+    return hash | (1ULL << 31);
+}
+
+/* fingerprint of the content of a stream frame, never 0. It is computed
+ * once for all the clients of the stream. */
+static uint64_t red_stream_frame_hash(Drawable *drawable)
+{
+    RedDrawable *red_drawable = drawable->red_drawable;
+    SpiceBitmap *bitmap = &red_drawable->u.copy.src_bitmap->u.bitmap;
+    uint64_t hash;
+    uint32_t i;
+
+    if (drawable->frame_hash) {
+        return drawable->frame_hash;
+    }
+    hash = red_hash_bytes((uint8_t *)&red_drawable->u.copy.src_area,
+                          sizeof(red_drawable->u.copy.src_area),
+                          ((uint64_t)bitmap->format << 56) ^ bitmap->stride);
+    for (i = 0; i < bitmap->data->num_chunks; i++) {
+        hash = red_hash_bytes(bitmap->data->chunk[i].data, bitmap->data->chunk[i].len, hash);
+    }
+    drawable->frame_hash = hash | 1;
+    return drawable->frame_hash;
+}
+
+static inline uint64_t red_image_item_cache_id(ImageItem *item)
+{
+    uint64_t hash;
+
+    hash = red_hash_bytes(item->data, item->height * item->stride,
+                          ((uint64_t)item->image_format << 56) ^
+                          ((uint64_t)item->image_flags << 48) ^
+                          ((uint64_t)item->width << 24) ^ item->height);
+    return red_hash_to_image_id(hash);
+}
+
+static ImageItem *__red_add_surface_area_image(DisplayChannelClient *dcc, int surface_id,
+                                               SpiceRect *area, PipeItem *pos, int can_lossy,
+                                               int is_tile)
 {
     DisplayChannel *display_channel = DCC_TO_DC(dcc);
     RedWorker *worker = display_channel->common.worker;
@@ -4406,13 +5413,15 @@ static ImageItem *red_add_surface_area_image(DisplayChannelClient *dcc, int surf
        high bytes as the surface may be used as source to an alpha_blend */
     if (!is_primary_surface(worker, surface_id) &&
         item->image_format == SPICE_BITMAP_FMT_32BIT &&
-        rgb32_data_has_alpha(item->width, item->height, item->stride, item->data, &all_set)) {
+        rgb32_data_has_alpha(worker, item->width, item->height, item->stride, item->data,
+                             &all_set)) {
         if (all_set) {
             item->image_flags |= SPICE_IMAGE_FLAGS_HIGH_BITS_SET;
         } else {
             item->image_format = SPICE_BITMAP_FMT_RGBA;
         }
     }
+    item->cache_id = is_tile ? red_image_item_cache_id(item) : 0;
 
     if (!pos) {
         red_pipe_add_image_item(dcc, item);
@@ -4425,6 +5434,83 @@ static ImageItem *red_add_surface_area_image(DisplayChannelClient *dcc, int surf
     return item;
 }
 
+/* Large areas are sent as tiles on a grid aligned to the surface, so that
+ * content that is re-rendered in place (toolbars, partially updated windows)
+ * produces the same tiles, which are then sent as pixmap cache references
+ * instead of being compressed again. Returns the item that was added last. */
+static ImageItem *red_add_surface_area_tiles(DisplayChannelClient *dcc, int surface_id,
+                                             SpiceRect *area, PipeItem *pos, int can_lossy,
+                                             int tile_size)
+{
+    ImageItem *item = NULL;
+    SpiceRect tile;
+    int x, y;
+
+    for (y = area->top - area->top % tile_size; y < area->bottom; y += tile_size) {
+        tile.top = MAX(y, area->top);
+        tile.bottom = MIN(y + tile_size, area->bottom);
+        for (x = area->left - area->left % tile_size; x < area->right; x += tile_size) {
+            tile.left = MAX(x, area->left);
+            tile.right = MIN(x + tile_size, area->right);
+            item = __red_add_surface_area_image(dcc, surface_id, &tile, pos, can_lossy, TRUE);
+        }
+    }
+    return item;
+}
+
+/* Very large areas are sent as horizontal bands, each in its own message. A
+ * band is written to the socket as soon as it is encoded, so the transmission
+ * of the first bands overlaps with the encoding of the next ones, instead of
+ * waiting for the whole image to be compressed. Bands are queued top to
+ * bottom, and the item that was added last is returned.
+ * The pipe is sent from its tail, and an item added after pos is placed
+ * between pos and the items sent before it. Adding every band after the same
+ * pos therefore sends them in the order they were added, top to bottom, all
+ * before pos. pos must not be advanced to the previous band: that would send
+ * each band before the one above it. */
+static ImageItem *red_add_surface_area_bands(DisplayChannelClient *dcc, int surface_id,
+                                             SpiceRect *area, PipeItem *pos, int can_lossy,
+                                             int band_height)
+{
+    ImageItem *item = NULL;
+    SpiceRect band;
+
+    band.left = area->left;
+    band.right = area->right;
+    for (band.top = area->top; band.top < area->bottom; band.top = band.bottom) {
+        band.bottom = MIN(band.top + band_height, area->bottom);
+        item = __red_add_surface_area_image(dcc, surface_id, &band, pos, can_lossy, FALSE);
+    }
+    return item;
+}
+
+static ImageItem *red_add_surface_area_image(DisplayChannelClient *dcc, int surface_id,
+                                             SpiceRect *area, PipeItem *pos, int can_lossy)
+{
+    RedWorker *worker = DCC_TO_WORKER(dcc);
+    RedSurface *surface = &worker->surfaces[surface_id];
+    int tile_size = worker->image_tile_size;
+    int width = area->right - area->left;
+    int height = area->bottom - area->top;
+    int band_height;
+
+    if (tile_size && dcc->pixmap_cache &&
+        width >= 2 * tile_size && height >= 2 * tile_size) {
+        return red_add_surface_area_tiles(dcc, surface_id, area, pos, can_lossy, tile_size);
+    }
+
+    if (width > 0) {
+        band_height = RED_IMAGE_BAND_SIZE /
+                      (width * (SPICE_SURFACE_FMT_DEPTH(surface->context.format) / 8));
+        band_height = MAX(band_height, RED_IMAGE_BAND_MIN_HEIGHT);
+        if (height >= 2 * band_height) {
+            return red_add_surface_area_bands(dcc, surface_id, area, pos, can_lossy,
+                                              band_height);
+        }
+    }
+    return __red_add_surface_area_image(dcc, surface_id, area, pos, can_lossy, FALSE);
+}
+
 static void red_push_surface_image(DisplayChannelClient *dcc, int surface_id)
 {
     SpiceRect area;
@@ -4501,8 +5587,12 @@ static inline RedCompressBuf *red_display_alloc_compress_buf(DisplayChannelClien
     if (display_channel->free_compress_bufs) {
         ret = display_channel->free_compress_bufs;
         display_channel->free_compress_bufs = ret->next;
+        display_channel->num_free_compress_bufs--;
+        stat_inc_counter(display_channel->compress_bufs_reuse_counter, 1);
     } else {
         ret = spice_new(RedCompressBuf, 1);
+        display_channel->num_compress_bufs++;
+        stat_inc_counter(display_channel->compress_bufs_alloc_counter, 1);
     }
 
     ret->next = dcc->send_data.used_compress_bufs;
@@ -4510,11 +5600,33 @@ static inline RedCompressBuf *red_display_alloc_compress_buf(DisplayChannelClien
     return ret;
 }
 
+static void red_display_trim_compress_bufs(DisplayChannel *dc, uint32_t num_free)
+{
+    RedCompressBuf **last = &dc->free_compress_bufs;
+    RedCompressBuf *buf;
+    uint32_t i;
+
+    // the list head was released last, keep it
+    for (i = 0; i < num_free && *last; i++) {
+        last = &(*last)->next;
+    }
+    while ((buf = *last)) {
+        *last = buf->next;
+        free(buf);
+        dc->num_free_compress_bufs--;
+        dc->num_compress_bufs--;
+        stat_inc_counter(dc->compress_bufs_trim_counter, 1);
+    }
+}
+
 static inline void __red_display_free_compress_buf(DisplayChannel *dc,
                                                    RedCompressBuf *buf)
 {
     buf->next = dc->free_compress_bufs;
     dc->free_compress_bufs = buf;
+    if (++dc->num_free_compress_bufs > RED_COMPRESS_BUFS_HIGH_WATERMARK) {
+        red_display_trim_compress_bufs(dc, RED_COMPRESS_BUFS_LOW_WATERMARK);
+    }
 }
 
 static void red_display_free_compress_buf(DisplayChannelClient *dcc,
@@ -4546,11 +5658,114 @@ static void red_display_reset_compress_buf(DisplayChannelClient *dcc)
 static void red_display_destroy_compress_bufs(DisplayChannel *display_channel)
 {
     spice_assert(!red_channel_is_connected(&display_channel->common.base));
-    while (display_channel->free_compress_bufs) {
-        RedCompressBuf *buf = display_channel->free_compress_bufs;
-        display_channel->free_compress_bufs = buf->next;
-        free(buf);
+    red_display_trim_compress_bufs(display_channel, 0);
+}
+
+static void encoded_image_unref(EncodedImage *encoded)
+{
+    if (--encoded->refs == 0) {
+        free(encoded);
+    }
+}
+
+static void encoded_image_marshaller_free(uint8_t *data, void *opaque)
+{
+    encoded_image_unref((EncodedImage *)opaque);
+}
+
+static void encoded_image_cache_init(EncodedImageCache *cache, uint64_t max_size)
+{
+    memset(cache->hash_table, 0, sizeof(cache->hash_table));
+    ring_init(&cache->lru);
+    cache->size = 0;
+    cache->max_size = max_size;
+    cache->hits = 0;
+    cache->misses = 0;
+}
+
+static void encoded_image_cache_remove(EncodedImageCache *cache, EncodedImage *encoded)
+{
+    EncodedImage **now;
+
+    now = &cache->hash_table[ENCODED_IMAGE_CACHE_HASH_KEY(encoded->key.id)];
+    for (;;) {
+        spice_assert(*now);
+        if (*now == encoded) {
+            *now = encoded->next;
+            break;
+        }
+        now = &(*now)->next;
+    }
+    ring_remove(&encoded->lru_link);
+    cache->size -= encoded->size;
+    encoded_image_unref(encoded);
+}
+
+static void encoded_image_cache_clear(EncodedImageCache *cache)
+{
+    EncodedImage *encoded;
+
+    while ((encoded = (EncodedImage *)ring_get_head(&cache->lru))) {
+        encoded_image_cache_remove(cache, encoded);
+    }
+}
+
+static EncodedImage *encoded_image_cache_find(EncodedImageCache *cache,
+                                              const EncodedImageKey *key)
+{
+    EncodedImage *encoded;
+
+    encoded = cache->hash_table[ENCODED_IMAGE_CACHE_HASH_KEY(key->id)];
+    while (encoded) {
+        if (memcmp(&encoded->key, key, sizeof(*key)) == 0) {
+            ring_remove(&encoded->lru_link);
+            ring_add(&cache->lru, &encoded->lru_link);
+            return encoded;
+        }
+        encoded = encoded->next;
+    }
+    return NULL;
+}
+
+static void encoded_image_cache_add(EncodedImageCache *cache, const EncodedImageKey *key,
+                                    SpiceImage *image, RedCompressBuf *comp_buf,
+                                    uint32_t size, int is_lossy, int graduality)
+{
+    EncodedImage *encoded;
+    EncodedImage *tail;
+    uint32_t offset = 0;
+    int hash_key;
+
+    if (size > cache->max_size / 4) {
+        return;
+    }
+
+    encoded = spice_malloc(sizeof(EncodedImage) + size);
+    encoded->refs = 1;
+    encoded->key = *key;
+    encoded->image = *image;
+    encoded->is_lossy = is_lossy;
+    encoded->graduality = graduality;
+    encoded->size = size;
+    while (offset < size) {
+        uint32_t now = MIN(sizeof(comp_buf->buf), size - offset);
+
+        spice_assert(comp_buf);
+        memcpy(encoded->data + offset, comp_buf->buf, now);
+        offset += now;
+        comp_buf = comp_buf->send_next;
+    }
+
+    cache->size += size;
+    while (cache->size > cache->max_size &&
+           (tail = (EncodedImage *)ring_get_tail(&cache->lru))) {
+        encoded_image_cache_remove(cache, tail);
     }
+    hash_key = ENCODED_IMAGE_CACHE_HASH_KEY(key->id);
+    encoded->next = cache->hash_table[hash_key];
+    cache->hash_table[hash_key] = encoded;
+    ring_item_init(&encoded->lru_link);
+    ring_add(&cache->lru, &encoded->lru_link);
 }
 
 /******************************************************
@@ -5086,6 +6301,7 @@ static inline void red_init_jpeg(RedWorker *worker)
     if (!worker->jpeg) {
         spice_critical("create jpeg encoder failed");
     }
+    jpeg_encoder_set_simd_ops(worker->jpeg, worker->bitmap_simd_ops);
 }
 
 #ifdef USE_LZ4
@@ -5099,6 +6315,7 @@ static inline void red_init_lz4(RedWorker *worker)
     if (!worker->lz4) {
         spice_critical("create lz4 encoder failed");
     }
+    lz4_encoder_set_level(worker->lz4, red_get_env_int("SPICE_LZ4_LEVEL", -65537, 16, 0));
 }
 #endif
 
@@ -5152,6 +6369,7 @@ typedef uint16_t rgb16_pixel_t;
 static BitmapGradualType _get_bitmap_graduality_level(RedWorker *worker, SpiceBitmap *bitmap,
                                                       uint32_t group_id)
 {
+    const RedBitmapSimdOps *simd_ops = worker->bitmap_simd_ops;
     double score = 0.0;
     int num_samples = 0;
     int num_lines;
@@ -5164,10 +6382,32 @@ static BitmapGradualType _get_bitmap_graduality_level(RedWorker *worker, SpiceBi
     for (i = 0; i < bitmap->data->num_chunks; i++) {
         num_lines = chunk[i].len / bitmap->stride;
         x = bitmap->x;
-        switch (bitmap->format) {
-        case SPICE_BITMAP_FMT_16BIT:
-            compute_lines_gradual_score_rgb16((rgb16_pixel_t *)chunk[i].data, x, num_lines,
-                                              &chunk_score, &chunk_num_samples);
+        if (simd_ops) {
+            RedGradualScoreFunc score_func = NULL;
+
+            switch (bitmap->format) {
+            case SPICE_BITMAP_FMT_16BIT:
+                score_func = simd_ops->gradual_score_rgb16;
+                break;
+            case SPICE_BITMAP_FMT_24BIT:
+                score_func = simd_ops->gradual_score_rgb24;
+                break;
+            case SPICE_BITMAP_FMT_32BIT:
+            case SPICE_BITMAP_FMT_RGBA:
+                score_func = simd_ops->gradual_score_rgb32;
+                break;
+            default:
+                spice_error("invalid bitmap format (not RGB) %u", bitmap->format);
+            }
+            score_func(chunk[i].data, x, num_lines, &chunk_score, &chunk_num_samples);
+            score += chunk_score;
+            num_samples += chunk_num_samples;
+            continue;
+        }
+        switch (bitmap->format) {
+        case SPICE_BITMAP_FMT_16BIT:
+            compute_lines_gradual_score_rgb16((rgb16_pixel_t *)chunk[i].data, x, num_lines,
+                                              &chunk_score, &chunk_num_samples);
             break;
         case SPICE_BITMAP_FMT_24BIT:
             compute_lines_gradual_score_rgb24((rgb24_pixel_t *)chunk[i].data, x, num_lines,
@@ -5239,6 +6479,119 @@ typedef struct compress_send_data_t {
     int is_lossy;
 } compress_send_data_t;
 
+/* The zlib level of the ZLIB_GLZ wrap is chosen per client and image by the
+ * expected time the image delays the client: zlib time plus transmission
+ * time at the client's bit rate. A backlog in the client pipe means the link
+ * is the bottleneck, so the transmission time weighs more and higher levels
+ * pay off; once zlib used its CPU budget, the GLZ data is sent as is. Like
+ * the codec selection, the estimates of a level are used once they have
+ * RED_CODEC_MIN_SAMPLES samples, and every RED_CODEC_EXPLORE_INTERVAL-th
+ * decision tries the least sampled neighbour of the current level. */
+static const int red_zlib_levels[RED_ZLIB_NUM_LEVELS] = {0, 1, 3, 6, 9};
+
+static void codec_estimate_update(CodecEstimate *estimate, uint32_t orig_size,
+                                  uint32_t comp_size, stat_time_t cpu_time);
+
+static void red_zlib_selector_init(DisplayChannelClient *dcc)
+{
+    ZlibLevelSelector *selector = &dcc->zlib_selector;
+    int level = DCC_TO_DC(dcc)->zlib_level;
+
+    memset(selector, 0, sizeof(*selector));
+    // the first level that compresses at least as much as the channel level
+    selector->level = RED_ZLIB_NUM_LEVELS - 1;
+    while (selector->level > 1 && red_zlib_levels[selector->level - 1] >= level) {
+        selector->level--;
+    }
+    selector->cpu_budget = dcc->common.worker->zlib_cpu_budget;
+}
+
+/* returns the index in red_zlib_levels of the level to compress glz_size
+ * bytes of GLZ data with, 0 to leave them as is */
+static int red_zlib_select_level(DisplayChannelClient *dcc, int glz_size)
+{
+    DisplayChannel *display_channel = DCC_TO_DC(dcc);
+    ZlibLevelSelector *selector = &dcc->zlib_selector;
+    RedChannelClient *rcc = &dcc->common.base;
+    red_time_t now = red_get_monotonic_time();
+    int level = selector->level;
+
+    if (now - selector->window_start > RED_ZLIB_BUDGET_WINDOW) {
+        selector->window_start = now;
+        selector->window_cpu_time = 0;
+    }
+
+    if (selector->window_cpu_time * 100 >=
+        (uint64_t)RED_ZLIB_BUDGET_WINDOW * selector->cpu_budget) {
+        level = 0;
+    } else if (++selector->decisions % RED_CODEC_EXPLORE_INTERVAL == 0) {
+        int lower = MAX(level - 1, 1);
+        int higher = MIN(level + 1, RED_ZLIB_NUM_LEVELS - 1);
+
+        level = selector->estimates[lower].samples <= selector->estimates[higher].samples ?
+                lower : higher;
+    } else {
+        uint64_t bit_rate = red_display_client_bit_rate(dcc);
+        double link_weight = 1.0 + (double)rcc->pipe_size / RED_ZLIB_BACKLOG_ITEMS;
+        double best_cost_ms;
+        int i;
+
+        if (rcc->send_data.blocked) {
+            link_weight *= 2;
+        }
+
+        // sending the GLZ data as is costs its transmission only
+        best_cost_ms = ((double)glz_size * 8 * 1000 / bit_rate) * link_weight;
+        level = 0;
+        for (i = 1; i < RED_ZLIB_NUM_LEVELS; i++) {
+            CodecEstimate *estimate = &selector->estimates[i];
+            double cost_ms;
+
+            if (estimate->samples < RED_CODEC_MIN_SAMPLES) {
+                // keep sampling the current level until its estimate is usable
+                if (i == selector->level) {
+                    level = i;
+                    break;
+                }
+                continue;
+            }
+            cost_ms = ((double)glz_size * estimate->cpu_ns_per_byte) / (1000 * 1000) +
+                      ((double)glz_size * estimate->ratio * 8 * 1000 / bit_rate) * link_weight;
+            if (cost_ms < best_cost_ms) {
+                best_cost_ms = cost_ms;
+                level = i;
+            }
+        }
+    }
+
+    if (level == 0) {
+        stat_inc_counter(display_channel->zlib_glz_skipped_counter, 1);
+#ifdef COMPRESS_STAT
+        display_channel->zlib_glz_skipped++;
+#endif
+    } else {
+        selector->level = level;
+    }
+    return level;
+}
+
+/* feeds the result of compressing glz_size bytes with zlib level into the
+ * estimates */
+static void red_zlib_update(DisplayChannelClient *dcc, int level, int glz_size,
+                            int zlib_size, stat_time_t cpu_time)
+{
+    ZlibLevelSelector *selector = &dcc->zlib_selector;
+
+    // bigger output is dropped, the GLZ data is sent instead
+    codec_estimate_update(&selector->estimates[level], glz_size,
+                          MIN(zlib_size, glz_size), cpu_time);
+    selector->window_cpu_time += cpu_time;
+    stat_inc_counter(DCC_TO_DC(dcc)->zlib_glz_cpu_us_counter, cpu_time / 1000);
+    if (zlib_size < glz_size) {
+        stat_inc_counter(DCC_TO_DC(dcc)->zlib_glz_saved_bytes_counter, glz_size - zlib_size);
+    }
+}
+
 static inline int red_glz_compress_image(DisplayChannelClient *dcc,
                                          SpiceImage *dest, SpiceBitmap *src, Drawable *drawable,
                                          compress_send_data_t* o_comp_data)
@@ -5256,6 +6609,8 @@ static inline int red_glz_compress_image(DisplayChannelClient *dcc,
     GlzDrawableInstanceItem *glz_drawable_instance;
     int glz_size;
     int zlib_size;
+    int zlib_level;
+    stat_time_t zlib_start_time;
 
     glz_data->data.bufs_tail = red_display_alloc_compress_buf(dcc);
     glz_data->data.bufs_head = glz_data->data.bufs_tail;
@@ -5288,9 +6643,11 @@ static inline int red_glz_compress_image(DisplayChannelClient *dcc,
     if (!display_channel->enable_zlib_glz_wrap || (glz_size < MIN_GLZ_SIZE_FOR_ZLIB)) {
         goto glz;
     }
-#ifdef COMPRESS_STAT
-    start_time = stat_now(worker);
-#endif
+    zlib_level = red_zlib_select_level(dcc, glz_size);
+    if (zlib_level == 0) {
+        goto glz;
+    }
+    zlib_start_time = stat_now(worker);
     zlib_data = &worker->zlib_data;
 
     zlib_data->data.bufs_tail = red_display_alloc_compress_buf(dcc);
@@ -5307,9 +6664,11 @@ static inline int red_glz_compress_image(DisplayChannelClient *dcc,
     zlib_data->data.u.compressed_data.next = glz_data->data.bufs_head;
     zlib_data->data.u.compressed_data.size_left = glz_size;
 
-    zlib_size = zlib_encode(worker->zlib, display_channel->zlib_level,
+    zlib_size = zlib_encode(worker->zlib, red_zlib_levels[zlib_level],
                             glz_size, (uint8_t*)zlib_data->data.bufs_head->buf,
                             sizeof(zlib_data->data.bufs_head->buf));
+    red_zlib_update(dcc, zlib_level, glz_size, zlib_size,
+                    stat_now(worker) - zlib_start_time);
 
     // the compressed buffer is bigger than the original data
     if (zlib_size >= glz_size) {
@@ -5328,7 +6687,7 @@ static inline int red_glz_compress_image(DisplayChannelClient *dcc,
     o_comp_data->comp_buf = zlib_data->data.bufs_head;
     o_comp_data->comp_buf_size = zlib_size;
 
-    stat_compress_add(&display_channel->zlib_glz_stat, start_time, glz_size, zlib_size);
+    stat_compress_add(&display_channel->zlib_glz_stat, zlib_start_time, glz_size, zlib_size);
     return TRUE;
 glz:
     dest->descriptor.type = SPICE_IMAGE_TYPE_GLZ_RGB;
@@ -5418,6 +6777,199 @@ static inline int red_lz_compress_image(DisplayChannelClient *dcc,
     return TRUE;
 }
 
+/* The adaptive selection estimates, per client and content class, the
+ * compression ratio and encoding time of each codec from the images it
+ * compressed. Among the codecs the compression mode allows, it picks the one
+ * with the lowest expected time to display: encoding time plus transmission
+ * time at the client's bit rate. The jpeg quality is lowered, by steps from
+ * the channel quality, while average jpeg images are expected to reach the
+ * client later than RED_CODEC_JPEG_TARGET_MS. */
+static const int red_codec_jpeg_quality_steps[RED_CODEC_NUM_JPEG_LEVELS] = {0, 10, 20, 35};
+
+static int red_codec_jpeg_quality(DisplayChannelClient *dcc)
+{
+    int quality = DCC_TO_DC(dcc)->jpeg_quality;
+
+    if (dcc->codec_selector.enabled) {
+        quality -= red_codec_jpeg_quality_steps[dcc->codec_selector.jpeg_level];
+    }
+    return MAX(quality, 10);
+}
+
+static void red_codec_selector_init(DisplayChannelClient *dcc)
+{
+    CodecSelector *selector = &dcc->codec_selector;
+
+    memset(selector, 0, sizeof(*selector));
+    selector->enabled = dcc->common.worker->adaptive_codec;
+}
+
+static void codec_estimate_update(CodecEstimate *estimate, uint32_t orig_size,
+                                  uint32_t comp_size, stat_time_t cpu_time)
+{
+    double ratio = (double)comp_size / orig_size;
+    double cpu_ns_per_byte = (double)cpu_time / orig_size;
+
+    if (!estimate->samples) {
+        estimate->ratio = ratio;
+        estimate->cpu_ns_per_byte = cpu_ns_per_byte;
+    } else {
+        estimate->ratio += (ratio - estimate->ratio) * RED_CODEC_EWMA_WEIGHT;
+        estimate->cpu_ns_per_byte += (cpu_ns_per_byte - estimate->cpu_ns_per_byte) *
+                                     RED_CODEC_EWMA_WEIGHT;
+    }
+    estimate->samples++;
+}
+
+/* expected time, in milliseconds, to encode and transmit size bytes */
+static inline double codec_estimate_cost_ms(CodecEstimate *estimate, double size,
+                                            uint64_t bit_rate)
+{
+    return (size * estimate->cpu_ns_per_byte) / (1000 * 1000) +
+           (size * estimate->ratio * 8 * 1000) / bit_rate;
+}
+
+/* the codec the estimates of the client favour, without exploring */
+static int red_codec_prefers_quic(DisplayChannelClient *dcc, BitmapGradualType graduality,
+                                  SpiceBitmap *src, int static_quic)
+{
+    CodecSelector *selector = &dcc->codec_selector;
+    int content_class = graduality - BITMAP_GRADUAL_LOW;
+    CodecEstimate *quic = &selector->estimates[content_class][RED_CODEC_QUIC];
+    CodecEstimate *lz = &selector->estimates[content_class][RED_CODEC_LZ];
+    uint64_t bit_rate;
+    double size;
+
+    if (!selector->enabled ||
+        quic->samples < RED_CODEC_MIN_SAMPLES || lz->samples < RED_CODEC_MIN_SAMPLES) {
+        return static_quic;
+    }
+    bit_rate = red_display_client_bit_rate(dcc);
+    size = src->y * src->stride;
+    return codec_estimate_cost_ms(quic, size, bit_rate) <
+           codec_estimate_cost_ms(lz, size, bit_rate);
+}
+
+/* chooses between quic and the dictionary codec for a lossless image;
+ * static_quic is the choice of the static rules */
+static int red_codec_select_quic(DisplayChannelClient *dcc, BitmapGradualType graduality,
+                                 SpiceBitmap *src, int static_quic)
+{
+    DisplayChannel *display_channel = DCC_TO_DC(dcc);
+    CodecSelector *selector = &dcc->codec_selector;
+    int content_class = graduality - BITMAP_GRADUAL_LOW;
+    CodecEstimate *quic = &selector->estimates[content_class][RED_CODEC_QUIC];
+    CodecEstimate *lz = &selector->estimates[content_class][RED_CODEC_LZ];
+    int quic_compress;
+
+    if (!selector->enabled) {
+        return static_quic;
+    }
+
+    if (++selector->decisions[content_class] % RED_CODEC_EXPLORE_INTERVAL == 0) {
+        quic_compress = quic->samples < lz->samples;
+        stat_inc_counter(display_channel->codec_explore_counter, 1);
+    } else {
+        quic_compress = red_codec_prefers_quic(dcc, graduality, src, static_quic);
+    }
+
+    if (quic_compress) {
+        stat_inc_counter(display_channel->codec_quic_counter, 1);
+    } else {
+        stat_inc_counter(display_channel->codec_lz_counter, 1);
+    }
+    return quic_compress;
+}
+
+static void red_codec_update_jpeg_level(DisplayChannelClient *dcc)
+{
+    DisplayChannel *display_channel = DCC_TO_DC(dcc);
+    CodecSelector *selector = &dcc->codec_selector;
+    CodecEstimate *current = &selector->jpeg_estimates[selector->jpeg_level];
+    uint64_t bit_rate = red_display_client_bit_rate(dcc);
+    double target_ms;
+    double cost_ms;
+    int level = selector->jpeg_level;
+
+    if (current->samples < RED_CODEC_MIN_SAMPLES) {
+        return;
+    }
+
+    // the image is displayed about half a roundtrip after it is sent
+    target_ms = MAX(RED_CODEC_JPEG_TARGET_MS - red_display_client_roundtrip_ms(dcc) / 2.0,
+                    RED_CODEC_JPEG_TARGET_MS / 4.0);
+
+    cost_ms = codec_estimate_cost_ms(current, selector->jpeg_input_size, bit_rate);
+    if (cost_ms > target_ms) {
+        if (level < RED_CODEC_NUM_JPEG_LEVELS - 1) {
+            level++;
+        }
+    } else if (level > 0) {
+        CodecEstimate *higher = &selector->jpeg_estimates[level - 1];
+
+        // without an estimate of the higher quality, wait for a clear margin
+        if (higher->samples ? codec_estimate_cost_ms(higher, selector->jpeg_input_size,
+                                                     bit_rate) < target_ms * 0.75 :
+                              cost_ms < target_ms / 2) {
+            level--;
+        }
+    }
+
+    if (level != selector->jpeg_level) {
+        selector->jpeg_level = level;
+        selector->jpeg_estimates[level].samples = MIN(selector->jpeg_estimates[level].samples,
+                                                      RED_CODEC_MIN_SAMPLES / 2);
+        stat_inc_counter(display_channel->jpeg_quality_changes_counter, 1);
+        spice_debug("jpeg quality %d (%.1f ms expected, %.1f ms target)",
+                    red_codec_jpeg_quality(dcc), cost_ms, target_ms);
+    }
+}
+
+/* feeds the result of compressing src into the estimates */
+static void red_codec_update(DisplayChannelClient *dcc, BitmapGradualType graduality,
+                             SpiceImage *dest, SpiceBitmap *src,
+                             uint32_t comp_size, stat_time_t cpu_time)
+{
+    CodecSelector *selector = &dcc->codec_selector;
+    uint32_t orig_size = src->y * src->stride;
+    int codec;
+
+    if (!selector->enabled || !orig_size) {
+        return;
+    }
+
+    switch (dest->descriptor.type) {
+    case SPICE_IMAGE_TYPE_QUIC:
+        codec = RED_CODEC_QUIC;
+        break;
+    case SPICE_IMAGE_TYPE_LZ_RGB:
+    case SPICE_IMAGE_TYPE_GLZ_RGB:
+    case SPICE_IMAGE_TYPE_ZLIB_GLZ_RGB:
+    case SPICE_IMAGE_TYPE_LZ4:
+        codec = RED_CODEC_LZ;
+        break;
+    case SPICE_IMAGE_TYPE_JPEG:
+    case SPICE_IMAGE_TYPE_JPEG_ALPHA:
+        codec_estimate_update(&selector->jpeg_estimates[selector->jpeg_level],
+                              orig_size, comp_size, cpu_time);
+        if (selector->jpeg_input_size == 0) {
+            selector->jpeg_input_size = orig_size;
+        } else {
+            selector->jpeg_input_size += (orig_size - selector->jpeg_input_size) *
+                                         RED_CODEC_EWMA_WEIGHT;
+        }
+        red_codec_update_jpeg_level(dcc);
+        return;
+    default:
+        return;
+    }
+
+    if (graduality >= BITMAP_GRADUAL_LOW) {
+        codec_estimate_update(&selector->estimates[graduality - BITMAP_GRADUAL_LOW][codec],
+                              orig_size, comp_size, cpu_time);
+    }
+}
+
 static int red_jpeg_compress_image(DisplayChannelClient *dcc, SpiceImage *dest,
                                    SpiceBitmap *src, compress_send_data_t* o_comp_data,
                                    uint32_t group_id)
@@ -5494,7 +7046,7 @@ static int red_jpeg_compress_image(DisplayChannelClient *dcc, SpiceImage *dest,
         jpeg_data->data.u.lines_data.reverse = 1;
         stride = -src->stride;
     }
-    jpeg_size = jpeg_encode(jpeg, display_channel->jpeg_quality, jpeg_in_type,
+    jpeg_size = jpeg_encode(jpeg, red_codec_jpeg_quality(dcc), jpeg_in_type,
                             src->x, src->y, NULL,
                             0, stride, (uint8_t*)jpeg_data->data.bufs_head->buf,
                             sizeof(jpeg_data->data.bufs_head->buf));
@@ -5715,16 +7267,121 @@ static inline int red_quic_compress_image(DisplayChannelClient *dcc, SpiceImage
 
 #define MIN_SIZE_TO_COMPRESS 54
 #define MIN_DIMENSION_TO_QUIC 3
-static inline int red_compress_image(DisplayChannelClient *dcc,
-                                     SpiceImage *dest, SpiceBitmap *src, Drawable *drawable,
-                                     int can_lossy,
-                                     compress_send_data_t* o_comp_data)
+/* log2 with a linear interpolation between powers of 2 (error < 0.09) */
+static inline double red_approx_log2(uint32_t v)
+{
+    int exp = 0;
+
+    spice_assert(v);
+    while ((v >> exp) > 1) {
+        exp++;
+    }
+    return exp + (double)(v - (1U << exp)) / (1U << exp);
+}
+
+/* Estimates the ratio lossless compression would achieve on an RGB bitmap,
+ * from the order-0 entropy of the differences between horizontally adjacent
+ * pixels, per channel, on a few lines spread over the bitmap. The padding
+ * byte of 32 bit pixels is not counted, since it is not sent compressed.
+ * The pixels that repeat the one above them are counted apart and taken as
+ * free, since both codecs encode them in a few bits: the entropy alone does
+ * not see the repetition of noisy content, such as a tiled background. */
+static double red_bitmap_estimate_compress_ratio(SpiceBitmap *bitmap)
+{
+    uint32_t hist[256];
+    int bpp = BITMAP_FMP_BYTES_PER_PIXEL[bitmap->format];
+    int channels = bitmap->format == SPICE_BITMAP_FMT_32BIT ? 3 : bpp;
+    uint32_t line_step = MAX(bitmap->y / RED_INCOMPRESSIBLE_SAMPLE_LINES, 1);
+    uint32_t next_line = line_step / 2;
+    uint32_t chunk_line = 0;
+    uint32_t num_samples = 0;
+    uint32_t num_pixels = 0;
+    uint32_t num_repeats = 0;
+    double entropy;
+    double bits;
+    SpiceChunk *chunk;
+    uint32_t i;
+
+    if (bitmap->x < 2) {
+        return RED_INCOMPRESSIBLE_MIN_RATIO;
+    }
+    memset(hist, 0, sizeof(hist));
+    chunk = bitmap->data->chunk;
+    for (i = 0; i < bitmap->data->num_chunks; i++) {
+        uint32_t num_lines = chunk[i].len / bitmap->stride;
+
+        for (; next_line < chunk_line + num_lines; next_line += line_step) {
+            uint8_t *prev = chunk[i].data + (next_line - chunk_line) * bitmap->stride;
+            uint8_t *pixel = prev + bpp;
+            uint8_t *end = prev + bitmap->x * bpp;
+            int c;
+
+            for (; pixel < end; prev = pixel, pixel += bpp) {
+                for (c = 0; c < channels; c++) {
+                    hist[(uint8_t)(pixel[c] - prev[c])]++;
+                }
+            }
+            num_samples += (bitmap->x - 1) * channels;
+
+            if (next_line > chunk_line) {
+                pixel = end - bitmap->x * bpp;
+                for (prev = pixel - bitmap->stride; pixel < end; prev += bpp, pixel += bpp) {
+                    num_repeats += !memcmp(pixel, prev, channels);
+                }
+                num_pixels += bitmap->x;
+            }
+        }
+        chunk_line += num_lines;
+    }
+
+    if (!num_samples) {
+        return RED_INCOMPRESSIBLE_MIN_RATIO;
+    }
+    entropy = 0;
+    for (i = 0; i < 256; i++) {
+        if (hist[i]) {
+            entropy -= hist[i] * red_approx_log2(hist[i]);
+        }
+    }
+    entropy = entropy / num_samples + red_approx_log2(num_samples);
+    bits = entropy * channels;
+    if (num_pixels) {
+        bits *= (double)(num_pixels - num_repeats) / num_pixels;
+    }
+    if (bits <= 0) {
+        return bpp * 8;
+    }
+    return (bpp * 8) / bits;
+}
+
+static inline int red_bitmap_is_incompressible(DisplayChannelClient *dcc, SpiceBitmap *src)
+{
+    DisplayChannel *display_channel = DCC_TO_DC(dcc);
+    stat_time_t start_time = stat_now(display_channel->common.worker);
+    int size = src->y * src->stride;
+    int incompressible;
+
+    incompressible = red_bitmap_estimate_compress_ratio(src) < RED_INCOMPRESSIBLE_MIN_RATIO;
+    stat_compress_add(&display_channel->estimate_stat, start_time, size, size);
+    if (incompressible) {
+        stat_compress_add(&display_channel->incompressible_stat, start_time, size, size);
+    }
+    return incompressible;
+}
+
+static inline int __red_compress_image(DisplayChannelClient *dcc,
+                                       SpiceImage *dest, SpiceBitmap *src, Drawable *drawable,
+                                       int can_lossy,
+                                       compress_send_data_t* o_comp_data,
+                                       BitmapGradualType *o_graduality)
 {
     DisplayChannel *display_channel = DCC_TO_DC(dcc);
     SpiceImageCompression image_compression =
         display_channel->common.worker->image_compression;
     int quic_compress = FALSE;
 
+    *o_graduality = BITMAP_GRADUAL_INVALID;
+
     if ((image_compression == SPICE_IMAGE_COMPRESSION_OFF) ||
         ((src->y * src->stride) < MIN_SIZE_TO_COMPRESS)) { // TODO: change the size cond
         return FALSE;
@@ -5754,14 +7411,22 @@ static inline int red_compress_image(DisplayChannelClient *dcc,
                 if ((src->x < MIN_DIMENSION_TO_QUIC) || (src->y < MIN_DIMENSION_TO_QUIC)) {
                     quic_compress = FALSE;
                 } else {
-                    if (drawable->copy_bitmap_graduality == BITMAP_GRADUAL_INVALID) {
-                        quic_compress = BITMAP_FMT_HAS_GRADUALITY(src->format) &&
-                            (_get_bitmap_graduality_level(display_channel->common.worker, src,
-                                                          drawable->group_id) ==
-                             BITMAP_GRADUAL_HIGH);
-                    } else {
-                        quic_compress = (drawable->copy_bitmap_graduality == BITMAP_GRADUAL_HIGH);
+                    BitmapGradualType graduality = drawable->copy_bitmap_graduality;
+
+                    if (graduality == BITMAP_GRADUAL_INVALID) {
+                        graduality = BITMAP_FMT_HAS_GRADUALITY(src->format) ?
+                            _get_bitmap_graduality_level(display_channel->common.worker, src,
+                                                         drawable->group_id) :
+                            BITMAP_GRADUAL_NOT_AVAIL;
+                    }
+                    quic_compress = (graduality == BITMAP_GRADUAL_HIGH);
+                    // picture-like bitmaps that may be lossy are sent with jpeg
+                    if (graduality >= BITMAP_GRADUAL_LOW &&
+                        !(quic_compress && can_lossy && display_channel->enable_jpeg)) {
+                        quic_compress = red_codec_select_quic(dcc, graduality, src,
+                                                              quic_compress);
                     }
+                    *o_graduality = graduality;
                 }
             } else {
                 quic_compress = FALSE;
@@ -5840,6 +7505,67 @@ static inline int red_compress_image(DisplayChannelClient *dcc,
     }
 }
 
+/* Bitmaps that are not going to be compressed with jpeg are first checked for
+ * compressibility, and are sent uncompressed when compression would barely
+ * shrink them (noise, already compressed or encrypted looking content).
+ * With glz, the estimation is skipped: the bitmap can still match earlier
+ * images in the dictionary, which a local estimation can't tell. */
+static inline int red_compress_image(DisplayChannelClient *dcc,
+                                     SpiceImage *dest, SpiceBitmap *src, Drawable *drawable,
+                                     int can_lossy,
+                                     compress_send_data_t* o_comp_data,
+                                     BitmapGradualType *o_graduality)
+{
+    DisplayChannel *display_channel = DCC_TO_DC(dcc);
+    SpiceImageCompression image_compression =
+        display_channel->common.worker->image_compression;
+    BitmapGradualType graduality = BITMAP_GRADUAL_INVALID;
+    stat_time_t start_time;
+    int estimated;
+    int incompressible;
+    int ret;
+
+    estimated = image_compression != SPICE_IMAGE_COMPRESSION_OFF &&
+                image_compression != SPICE_IMAGE_COMPRESSION_GLZ &&
+                image_compression != SPICE_IMAGE_COMPRESSION_AUTO_GLZ &&
+                !(can_lossy && display_channel->enable_jpeg) &&
+                bitmap_fmt_is_rgb(src->format) &&
+                src->y * src->stride >= RED_INCOMPRESSIBLE_MIN_SIZE;
+    incompressible = estimated && red_bitmap_is_incompressible(dcc, src);
+#ifdef COMPRESS_STAT
+    if (incompressible &&
+        display_channel->incompressible_stat.count % RED_INCOMPRESSIBLE_CHECK_INTERVAL) {
+        return FALSE;
+    }
+#else
+    if (incompressible) {
+        return FALSE;
+    }
+#endif
+
+    start_time = stat_now(display_channel->common.worker);
+    ret = __red_compress_image(dcc, dest, src, drawable, can_lossy, o_comp_data,
+                               &graduality);
+    if (ret) {
+        red_codec_update(dcc, graduality, dest, src, o_comp_data->comp_buf_size,
+                         stat_now(display_channel->common.worker) - start_time);
+    }
+    *o_graduality = graduality;
+#ifdef COMPRESS_STAT
+    if (ret && estimated) {
+        int shrunk = o_comp_data->comp_buf_size * RED_INCOMPRESSIBLE_MIN_RATIO <=
+                     src->y * src->stride;
+
+        if (incompressible && shrunk) {
+            display_channel->mispredicted_incompressible++;
+        } else if (!incompressible && !shrunk) {
+            display_channel->mispredicted_compressible++;
+        }
+    }
+#endif
+    return ret;
+}
+
 int dcc_pixmap_cache_unlocked_add(DisplayChannelClient *dcc, uint64_t id, uint32_t size, int lossy)
 {
     PixmapCache *cache = dcc->pixmap_cache;
@@ -5952,20 +7678,230 @@ static int dcc_pixmap_cache_unlocked_hit(DisplayChannelClient *dcc, uint64_t id,
         item = item->next;
     }
 
-    return !!item;
+    return !!item;
+}
+
+static int dcc_pixmap_cache_hit(DisplayChannelClient *dcc, uint64_t id, int *lossy)
+{
+    int hit;
+    PixmapCache *cache = dcc->pixmap_cache;
+
+    pthread_mutex_lock(&cache->lock);
+    hit = dcc_pixmap_cache_unlocked_hit(dcc, id, lossy);
+    pthread_mutex_unlock(&cache->lock);
+    return hit;
+}
+
+static uint64_t red_hash_chunks(SpiceChunks *chunks, uint64_t seed)
+{
+    uint64_t hash = seed;
+    int i;
+
+    for (i = 0; i < chunks->num_chunks; i++) {
+        hash = red_hash_bytes(chunks->chunk[i].data, chunks->chunk[i].len, hash);
+    }
+    return hash;
+}
+
+static inline uint64_t *red_display_content_cache_seen(ContentCache *cache, uint64_t id)
+{
+    return &cache->seen[(id >> 32) & (RED_CONTENT_CACHE_SEEN_SIZE - 1)];
+}
+
+/* Gives a bitmap that the guest didn't ask to cache an id derived from its
+ * content, so that it goes through the pixmap cache like the guest cached
+ * ones. Only content that is seen a second time gets it. The guest image is
+ * shared by all the clients, so it is tagged once, when its drawable is
+ * processed, see red_drawable_content_cache_tag. */
+static void red_display_content_cache_tag(DisplayChannel *display_channel, SpiceImage *simage)
+{
+    ContentCache *cache = &display_channel->content_cache;
+    SpiceBitmap *bitmap = &simage->u.bitmap;
+    uint64_t id, seed, *seen;
+    uint64_t pixels;
+    stat_time_t start_time;
+
+    if (!cache->min_pixels || !simage || simage->descriptor.type != SPICE_IMAGE_TYPE_BITMAP ||
+        (simage->descriptor.flags & SPICE_IMAGE_FLAGS_CACHE_ME)) {
+        return;
+    }
+    pixels = (uint64_t)bitmap->x * bitmap->y;
+    if (pixels < cache->min_pixels || pixels > RED_CONTENT_CACHE_MAX_PIXELS) {
+        return;
+    }
+
+    start_time = stat_now(display_channel->common.worker);
+    seed = ((uint64_t)bitmap->format << 56) ^ ((uint64_t)bitmap->flags << 48) ^
+           ((uint64_t)bitmap->x << 24) ^ bitmap->y;
+    if (bitmap->palette) {
+        seed = red_hash_bytes((uint8_t *)bitmap->palette->ents,
+                              bitmap->palette->num_ents * sizeof(uint32_t), seed);
+    }
+    id = red_hash_to_image_id(red_hash_chunks(bitmap->data, seed));
+    stat_compress_add(&display_channel->content_hash_stat, start_time,
+                      bitmap->y * bitmap->stride, 0);
+
+    seen = red_display_content_cache_seen(cache, id);
+    if (*seen != id) {
+        *seen = id;
+        return;
+    }
+    simage->descriptor.id = id;
+    simage->descriptor.flags |= SPICE_IMAGE_FLAGS_CACHE_ME;
+    cache->tagged++;
+    stat_inc_counter(display_channel->content_cache_tagged_counter, 1);
+}
+
+static inline void red_brush_content_cache_tag(DisplayChannel *display_channel,
+                                               SpiceBrush *brush)
+{
+    if (brush->type == SPICE_BRUSH_TYPE_PATTERN) {
+        red_display_content_cache_tag(display_channel, brush->u.pattern.pat);
+    }
+}
+
+/* tags the images that fill_bits may send for the drawable */
+static void red_drawable_content_cache_tag(RedWorker *worker, Drawable *drawable)
+{
+    DisplayChannel *display_channel = worker->display_channel;
+    RedDrawable *red_drawable = drawable->red_drawable;
+
+    if (!display_channel || !display_channel->content_cache.min_pixels) {
+        return;
+    }
+
+    red_display_content_cache_tag(display_channel, red_drawable->self_bitmap_image);
+    switch (red_drawable->type) {
+    case QXL_DRAW_FILL:
+        red_brush_content_cache_tag(display_channel, &red_drawable->u.fill.brush);
+        red_display_content_cache_tag(display_channel, red_drawable->u.fill.mask.bitmap);
+        break;
+    case QXL_DRAW_OPAQUE:
+        red_brush_content_cache_tag(display_channel, &red_drawable->u.opaque.brush);
+        red_display_content_cache_tag(display_channel, red_drawable->u.opaque.src_bitmap);
+        red_display_content_cache_tag(display_channel, red_drawable->u.opaque.mask.bitmap);
+        break;
+    case QXL_DRAW_COPY:
+        red_display_content_cache_tag(display_channel, red_drawable->u.copy.src_bitmap);
+        red_display_content_cache_tag(display_channel, red_drawable->u.copy.mask.bitmap);
+        break;
+    case QXL_DRAW_TRANSPARENT:
+        red_display_content_cache_tag(display_channel, red_drawable->u.transparent.src_bitmap);
+        break;
+    case QXL_DRAW_ALPHA_BLEND:
+        red_display_content_cache_tag(display_channel, red_drawable->u.alpha_blend.src_bitmap);
+        break;
+    case QXL_DRAW_BLEND:
+        red_display_content_cache_tag(display_channel, red_drawable->u.blend.src_bitmap);
+        red_display_content_cache_tag(display_channel, red_drawable->u.blend.mask.bitmap);
+        break;
+    case QXL_DRAW_BLACKNESS:
+        red_display_content_cache_tag(display_channel, red_drawable->u.blackness.mask.bitmap);
+        break;
+    case QXL_DRAW_WHITENESS:
+        red_display_content_cache_tag(display_channel, red_drawable->u.whiteness.mask.bitmap);
+        break;
+    case QXL_DRAW_INVERS:
+        red_display_content_cache_tag(display_channel, red_drawable->u.invers.mask.bitmap);
+        break;
+    case QXL_DRAW_ROP3:
+        red_brush_content_cache_tag(display_channel, &red_drawable->u.rop3.brush);
+        red_display_content_cache_tag(display_channel, red_drawable->u.rop3.src_bitmap);
+        red_display_content_cache_tag(display_channel, red_drawable->u.rop3.mask.bitmap);
+        break;
+    case QXL_DRAW_COMPOSITE:
+        red_display_content_cache_tag(display_channel, red_drawable->u.composite.src_bitmap);
+        red_display_content_cache_tag(display_channel, red_drawable->u.composite.mask_bitmap);
+        break;
+    case QXL_DRAW_STROKE:
+        red_brush_content_cache_tag(display_channel, &red_drawable->u.stroke.brush);
+        break;
+    case QXL_DRAW_TEXT:
+        red_brush_content_cache_tag(display_channel, &red_drawable->u.text.fore_brush);
+        red_brush_content_cache_tag(display_channel, &red_drawable->u.text.back_brush);
+        break;
+    default:
+        break;
+    }
+}
+
+/* returns FALSE if the encoding of the bitmap should not be shared between
+ * the channel clients */
+static int red_encoded_image_key(DisplayChannelClient *dcc, SpiceImage *simage,
+                                 int can_lossy, EncodedImageKey *key)
+{
+    DisplayChannel *display_channel = DCC_TO_DC(dcc);
+    RedWorker *worker = display_channel->common.worker;
+    SpiceBitmap *bitmap = &simage->u.bitmap;
+
+    if (!display_channel->encoded_image_cache.max_size ||
+        display_channel->common.base.clients_num < 2 ||
+        worker->image_compression == SPICE_IMAGE_COMPRESSION_OFF ||
+        !bitmap_fmt_is_rgb(bitmap->format)) {
+        return FALSE;
+    }
+
+    memset(key, 0, sizeof(*key));
+    if (simage->descriptor.flags & SPICE_IMAGE_FLAGS_CACHE_ME) {
+        key->id = simage->descriptor.id;
+    } else {
+        key->id = red_hash_chunks(bitmap->data, bitmap->stride);
+        key->by_content = TRUE;
+    }
+    key->width = bitmap->x;
+    key->height = bitmap->y;
+    key->format = bitmap->format;
+    key->flags = bitmap->flags;
+    key->can_lossy = can_lossy;
+    key->compression = worker->image_compression;
+    key->enable_jpeg = display_channel->enable_jpeg;
+    key->jpeg_quality = red_codec_jpeg_quality(dcc);
+#ifdef USE_LZ4
+    key->lz4 = red_channel_client_test_remote_cap(&dcc->common.base,
+                                                  SPICE_DISPLAY_CAP_LZ4_COMPRESSION);
+#endif
+    return TRUE;
 }
 
-static int dcc_pixmap_cache_hit(DisplayChannelClient *dcc, uint64_t id, int *lossy)
+/* GLZ output depends on the client's dictionary, LZ palette images on its
+ * palette cache, and LZ is only used instead of GLZ when the dictionary is
+ * frozen */
+static int red_encoded_image_is_shareable(RedWorker *worker, SpiceImage *image)
 {
-    int hit;
-    PixmapCache *cache = dcc->pixmap_cache;
-
-    pthread_mutex_lock(&cache->lock);
-    hit = dcc_pixmap_cache_unlocked_hit(dcc, id, lossy);
-    pthread_mutex_unlock(&cache->lock);
-    return hit;
+    switch (image->descriptor.type) {
+    case SPICE_IMAGE_TYPE_QUIC:
+    case SPICE_IMAGE_TYPE_JPEG:
+    case SPICE_IMAGE_TYPE_JPEG_ALPHA:
+    case SPICE_IMAGE_TYPE_LZ4:
+        return TRUE;
+    case SPICE_IMAGE_TYPE_LZ_RGB:
+        return worker->image_compression != SPICE_IMAGE_COMPRESSION_GLZ &&
+               worker->image_compression != SPICE_IMAGE_COMPRESSION_AUTO_GLZ;
+    default:
+        return FALSE;
+    }
 }
 
+/* The lossless codec of an image chosen by the codec selection (see
+ * red_codec_select_quic) depends on the estimates of the client it was
+ * encoded for: the encoding is only reused by the clients whose estimates
+ * favour the same codec. */
+static int red_encoded_image_codec_matches(DisplayChannelClient *dcc, EncodedImage *encoded,
+                                           SpiceBitmap *src, int can_lossy)
+{
+    int static_quic;
+    int cached_quic;
+
+    if (encoded->graduality < BITMAP_GRADUAL_LOW) {
+        return TRUE;
+    }
+    static_quic = encoded->graduality == BITMAP_GRADUAL_HIGH;
+    if (static_quic && can_lossy && DCC_TO_DC(dcc)->enable_jpeg) {
+        return TRUE;
+    }
+    cached_quic = encoded->image.descriptor.type == SPICE_IMAGE_TYPE_QUIC;
+    return red_codec_prefers_quic(dcc, encoded->graduality, src, static_quic) == cached_quic;
+}
 
 typedef enum {
     FILL_BITS_TYPE_INVALID,
@@ -6019,6 +7955,12 @@ static FillBitsType fill_bits(DisplayChannelClient *dcc, SpiceMarshaller *m,
                 spice_assert(bitmap_palette_out == NULL);
                 spice_assert(lzplt_palette_out == NULL);
                 stat_inc_counter(display_channel->cache_hits_counter, 1);
+                if (*red_display_content_cache_seen(&display_channel->content_cache,
+                                                    image.descriptor.id) ==
+                    image.descriptor.id) {
+                    display_channel->content_cache.hits++;
+                    stat_inc_counter(display_channel->content_cache_hits_counter, 1);
+                }
                 pthread_mutex_unlock(&dcc->pixmap_cache->lock);
                 return FILL_BITS_TYPE_CACHE;
             } else {
@@ -6057,15 +7999,59 @@ static FillBitsType fill_bits(DisplayChannelClient *dcc, SpiceMarshaller *m,
     }
     case SPICE_IMAGE_TYPE_BITMAP: {
         SpiceBitmap *bitmap = &image.u.bitmap;
+        EncodedImageCache *encoded_cache = &display_channel->encoded_image_cache;
+        EncodedImageKey encoded_key;
+        EncodedImage *encoded = NULL;
+        BitmapGradualType graduality;
+        int share_encoded;
 #ifdef DUMP_BITMAP
         dump_bitmap(&simage->u.bitmap);
 #endif
+        share_encoded = reds_stream_get_family(rcc->stream) != AF_UNIX &&
+                        red_encoded_image_key(dcc, simage, can_lossy, &encoded_key);
+        if (share_encoded) {
+            encoded = encoded_image_cache_find(encoded_cache, &encoded_key);
+            if (encoded &&
+                !red_encoded_image_codec_matches(dcc, encoded, &simage->u.bitmap, can_lossy)) {
+                // encode it for this client, keeping the entry of the other clients
+                encoded = NULL;
+                share_encoded = FALSE;
+            }
+            if (encoded) {
+                encoded_cache->hits++;
+                stat_inc_counter(display_channel->encoded_cache_hits_counter, 1);
+            } else {
+                encoded_cache->misses++;
+                stat_inc_counter(display_channel->encoded_cache_misses_counter, 1);
+            }
+        }
+
+        if (encoded) {
+            red_display_add_image_to_pixmap_cache(rcc, simage, &image, encoded->is_lossy);
+
+            image.descriptor.type = encoded->image.descriptor.type;
+            image.u = encoded->image.u;
+            spice_marshall_Image(m, &image,
+                                 &bitmap_palette_out, &lzplt_palette_out);
+            spice_assert(bitmap_palette_out == NULL);
+            spice_assert(lzplt_palette_out == NULL);
+
+            encoded->refs++;
+            spice_marshaller_add_ref_full(m, encoded->data, encoded->size,
+                                          encoded_image_marshaller_free, encoded);
+
+            spice_assert(!encoded->is_lossy || can_lossy);
+            pthread_mutex_unlock(&dcc->pixmap_cache->lock);
+            return (encoded->is_lossy ? FILL_BITS_TYPE_COMPRESS_LOSSY :
+                                        FILL_BITS_TYPE_COMPRESS_LOSSLESS);
+        }
+
         /* Images must be added to the cache only after they are compressed
            in order to prevent starvation in the client between pixmap_cache and
            global dictionary (in cases of multiple monitors) */
         if (reds_stream_get_family(rcc->stream) == AF_UNIX ||
             !red_compress_image(dcc, &image, &simage->u.bitmap,
-                                drawable, can_lossy, &comp_send_data)) {
+                                drawable, can_lossy, &comp_send_data, &graduality)) {
             SpicePalette *palette;
 
             red_display_add_image_to_pixmap_cache(rcc, simage, &image, FALSE);
@@ -6087,6 +8073,12 @@ static FillBitsType fill_bits(DisplayChannelClient *dcc, SpiceMarshaller *m,
             pthread_mutex_unlock(&dcc->pixmap_cache->lock);
             return FILL_BITS_TYPE_BITMAP;
         } else {
+            if (share_encoded && red_encoded_image_is_shareable(worker, &image)) {
+                encoded_image_cache_add(encoded_cache, &encoded_key, &image,
+                                        comp_send_data.comp_buf,
+                                        comp_send_data.comp_buf_size,
+                                        comp_send_data.is_lossy, graduality);
+            }
             red_display_add_image_to_pixmap_cache(rcc, simage, &image,
                                                   comp_send_data.is_lossy);
 
@@ -6470,6 +8462,129 @@ static void red_pipe_replace_rendered_drawables_with_images(RedWorker *worker,
     }
 }
 
+static inline int rect_area(const SpiceRect *rect)
+{
+    return (rect->right - rect->left) * (rect->bottom - rect->top);
+}
+
+static inline int red_is_coalesce_candidate(RedWorker *worker, PipeItem *pipe_item)
+{
+    Drawable *drawable;
+
+    if (pipe_item->type != PIPE_ITEM_TYPE_DRAW) {
+        return FALSE;
+    }
+    drawable = SPICE_CONTAINEROF(pipe_item, DrawablePipeItem, dpi_pipe_item)->drawable;
+    return is_primary_surface(worker, drawable->surface_id) && !drawable->stream &&
+           rect_area(&drawable->red_drawable->bbox) <= RED_COALESCE_SMALL_DRAWABLE_AREA;
+}
+
+static inline int drawable_touches_primary_area(RedWorker *worker, Drawable *drawable,
+                                                const SpiceRect *area)
+{
+    RedDrawable *red_drawable = drawable->red_drawable;
+    int x;
+
+    if (is_primary_surface(worker, drawable->surface_id) &&
+        rect_intersects(area, &red_drawable->bbox)) {
+        return TRUE;
+    }
+    for (x = 0; x < 3; ++x) {
+        if (is_primary_surface(worker, drawable->surfaces_dest[x]) &&
+            rect_intersects(area, &red_drawable->surfaces_rects[x])) {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+/* Replaces the small drawables of the primary surface that wait in the pipe
+ * with one image of their extents. The image is read from the surface after
+ * rendering, so it is placed instead of the newest of these drawables, and
+ * nothing is coalesced if another drawable from the oldest one onwards draws
+ * to, or reads from, the same area. The small drawables are looked for among
+ * the RED_COALESCE_MAX_SCAN_ITEMS oldest pipe items; the newer ones that are
+ * not coalesced are checked like the other drawables, since rendering the area
+ * renders them too. */
+static void red_pipe_coalesce_small_drawables(RedWorker *worker, DisplayChannelClient *dcc)
+{
+    DrawablePipeItem *dpis[RED_COALESCE_MAX_DRAWABLES];
+    Ring *pipe = &dcc->common.base.pipe;
+    PipeItem *pipe_item;
+    SpiceRect extents = {0, 0, 0, 0};
+    int num_dpis = 0;
+    int num_scanned = 0;
+    int num_passed = 0;
+    int sum_area = 0;
+    int i;
+
+    if (dcc->common.base.pipe_size < RED_COALESCE_MIN_DRAWABLES ||
+        !dcc->surface_client_created[0] || !worker->surfaces[0].context.canvas) {
+        return;
+    }
+
+    // going from the oldest to the newest
+    for (pipe_item = (PipeItem *)ring_get_tail(pipe);
+         pipe_item && num_dpis < RED_COALESCE_MAX_DRAWABLES &&
+         num_scanned < RED_COALESCE_MAX_SCAN_ITEMS;
+         pipe_item = (PipeItem *)ring_prev(pipe, &pipe_item->link), num_scanned++) {
+        DrawablePipeItem *dpi;
+        SpiceRect *bbox;
+
+        if (!red_is_coalesce_candidate(worker, pipe_item)) {
+            continue;
+        }
+        dpi = SPICE_CONTAINEROF(pipe_item, DrawablePipeItem, dpi_pipe_item);
+        bbox = &dpi->drawable->red_drawable->bbox;
+        if (num_dpis == 0) {
+            extents = *bbox;
+        } else {
+            rect_union(&extents, bbox);
+        }
+        sum_area += rect_area(bbox);
+        dpis[num_dpis++] = dpi;
+    }
+
+    if (num_dpis < RED_COALESCE_MIN_DRAWABLES ||
+        rect_area(&extents) > sum_area + num_dpis * RED_COALESCE_MESSAGE_OVERHEAD_AREA) {
+        return;
+    }
+
+    // up to the head: red_update_area renders the newer drawables as well
+    for (pipe_item = &dpis[0]->dpi_pipe_item;
+         pipe_item;
+         pipe_item = (PipeItem *)ring_prev(pipe, &pipe_item->link)) {
+        switch (pipe_item->type) {
+        case PIPE_ITEM_TYPE_DRAW: {
+            Drawable *drawable;
+
+            if (num_passed < num_dpis && pipe_item == &dpis[num_passed]->dpi_pipe_item) {
+                num_passed++;
+                break;
+            }
+            drawable = SPICE_CONTAINEROF(pipe_item, DrawablePipeItem, dpi_pipe_item)->drawable;
+            if (drawable_touches_primary_area(worker, drawable, &extents)) {
+                return;
+            }
+            break;
+        }
+        case PIPE_ITEM_TYPE_CREATE_SURFACE:
+        case PIPE_ITEM_TYPE_DESTROY_SURFACE:
+        case PIPE_ITEM_TYPE_UPGRADE:
+            return;
+        default:
+            break;
+        }
+    }
+
+    red_update_area(worker, &extents, 0);
+    red_add_surface_area_image(dcc, 0, &extents, &dpis[num_dpis - 1]->dpi_pipe_item, TRUE);
+    for (i = 0; i < num_dpis; i++) {
+        red_channel_client_pipe_remove_and_release(&dcc->common.base, &dpis[i]->dpi_pipe_item);
+    }
+    stat_inc_counter(DCC_TO_DC(dcc)->coalesced_drawables_counter, num_dpis);
+}
+
 static void red_add_lossless_drawable_dependencies(RedWorker *worker,
                                                    RedChannelClient *rcc,
                                                    Drawable *item,
@@ -7710,6 +9825,26 @@ static inline void display_begin_send_message(RedChannelClient *rcc)
     red_channel_client_begin_send_message(rcc);
 }
 
+/*
+ * The clients play a frame when their multimedia time, mm_time_latency
+ * behind the server one, reaches the frame time. Low latency frames get the
+ * time the client should play them, stream_latency_ms after they are sent,
+ * however long they waited in the pipe. The streams do not raise the
+ * latency of the client then, see mjpeg_encoder_set_max_playback_delay;
+ * audio and video are no longer in sync.
+ */
+static uint32_t red_stream_get_frame_mm_time(DisplayChannelClient *dcc, Drawable *drawable)
+{
+    uint32_t latency = dcc->common.worker->stream_latency_ms;
+
+    if (latency) {
+        return reds_get_mm_time() - reds_get_mm_time_latency() + latency;
+    }
+    /* workaround for vga streams */
+    return drawable->red_drawable->mm_time ? drawable->red_drawable->mm_time :
+                                             reds_get_mm_time();
+}
+
 static inline int red_marshall_stream_data(RedChannelClient *rcc,
                   SpiceMarshaller *base_marshaller, Drawable *drawable)
 {
@@ -7721,6 +9856,7 @@ static inline int red_marshall_stream_data(RedChannelClient *rcc,
     uint32_t frame_mm_time;
     int n;
     int width, height;
+    int enc_width, enc_height;
     int ret;
 
     if (!stream) {
@@ -7753,8 +9889,45 @@ static inline int red_marshall_stream_data(RedChannelClient *rcc,
     StreamAgent *agent = &dcc->stream_agents[get_stream_id(worker, stream)];
     uint64_t time_now = red_get_monotonic_time();
     size_t outbuf_size;
+    int frame_part;
+
+    if (red_stream_agent_is_frame_shown(agent, drawable)) {
+        if (!dcc->use_mjpeg_encoder_rate_control) {
+            agent->frames--;
+        }
+#ifdef STREAM_STATS
+        agent->stats.num_frames_skipped++;
+#endif
+        return TRUE;
+    }
+
+    /* the tiles of a video frame follow the decision taken for its first
+     * tile, so that the fps, the pacer and the rate control count frames */
+    frame_part = drawable->stream_frame && drawable->stream_frame == agent->tile_frame;
+    if (frame_part && agent->tile_frame_dropped) {
+        return TRUE;
+    }
+    if (!frame_part) {
+        agent->tile_frame = drawable->stream_frame;
+        agent->tile_frame_dropped = TRUE;
+    }
+
+    /* a newer frame is already queued, and this one would be played late:
+     * dropping the old frames first keeps the stream close to the guest */
+    if (!frame_part && worker->stream_latency_ms && drawable != stream->current &&
+        time_now - drawable->creation_time > (red_time_t)worker->stream_latency_ms * 1000 * 1000) {
+        if (dcc->use_mjpeg_encoder_rate_control) {
+            mjpeg_encoder_notify_server_frame_drop(agent->mjpeg_encoder);
+        } else {
+            agent->frames--;
+        }
+#ifdef STREAM_STATS
+        agent->stats.num_drops_late++;
+#endif
+        return TRUE;
+    }
 
-    if (!dcc->use_mjpeg_encoder_rate_control) {
+    if (!frame_part && !dcc->use_mjpeg_encoder_rate_control) {
         if (time_now - agent->last_send_time < (1000 * 1000 * 1000) / agent->fps) {
             agent->frames--;
 #ifdef STREAM_STATS
@@ -7764,18 +9937,50 @@ static inline int red_marshall_stream_data(RedChannelClient *rcc,
         }
     }
 
-    /* workaround for vga streams */
-    frame_mm_time =  drawable->red_drawable->mm_time ?
-                        drawable->red_drawable->mm_time :
-                        reds_get_mm_time();
+    if (!frame_part && !red_stream_pacer_admit(dcc, agent, time_now)) {
+        /* the rate control adapts its fps and quality to the frames the
+         * server could not send, otherwise it keeps encoding for a frame
+         * rate the pacer does not let through */
+        if (dcc->use_mjpeg_encoder_rate_control) {
+            mjpeg_encoder_notify_server_frame_drop(agent->mjpeg_encoder);
+        } else {
+            agent->frames--;
+        }
+#ifdef STREAM_STATS
+        agent->stats.num_drops_pacer++;
+#endif
+        return TRUE;
+    }
+
+    frame_mm_time = red_stream_get_frame_mm_time(dcc, drawable);
+
+    /* with several clients, each frame is encoded once per quality the rate
+     * control of their agents picked */
+    if (display_channel->common.base.clients_num > 1 && !stream->frame_cache) {
+        stream->frame_cache = mjpeg_frame_cache_new();
+    }
 
     outbuf_size = dcc->send_data.stream_outbuf_size;
-    ret = mjpeg_encoder_encode_frame(agent->mjpeg_encoder,
-                                     &image->u.bitmap, width, height,
-                                     &drawable->red_drawable->u.copy.src_area,
-                                     stream->top_down, frame_mm_time,
-                                     &dcc->send_data.stream_outbuf,
-                                     &outbuf_size, &n);
+    if (frame_part) {
+        ret = mjpeg_encoder_encode_frame_part(agent->mjpeg_encoder,
+                                              stream->frame_cache, drawable->creation_time,
+                                              &image->u.bitmap, width, height,
+                                              &drawable->red_drawable->u.copy.src_area,
+                                              stream->top_down, frame_mm_time,
+                                              &dcc->send_data.stream_outbuf,
+                                              &outbuf_size, &n, &enc_width, &enc_height);
+    } else {
+        ret = mjpeg_encoder_encode_frame(agent->mjpeg_encoder,
+                                         stream->frame_cache, drawable->creation_time,
+                                         &image->u.bitmap, width, height,
+                                         &drawable->red_drawable->u.copy.src_area,
+                                         stream->top_down, frame_mm_time,
+                                         &dcc->send_data.stream_outbuf,
+                                         &outbuf_size, &n, &enc_width, &enc_height);
+    }
+    if (ret != MJPEG_ENCODER_FRAME_DROP) {
+        agent->tile_frame_dropped = FALSE;
+    }
     switch (ret) {
     case MJPEG_ENCODER_FRAME_DROP:
         spice_assert(dcc->use_mjpeg_encoder_rate_control);
@@ -7793,7 +9998,8 @@ static inline int red_marshall_stream_data(RedChannelClient *rcc,
     }
     dcc->send_data.stream_outbuf_size = outbuf_size;
 
-    if (!drawable->sized_stream) {
+    /* downscaled frames are sized, the client scales them back to the frame area */
+    if (!drawable->sized_stream && enc_width == width && enc_height == height) {
         SpiceMsgDisplayStreamData stream_data;
 
         red_channel_client_init_send_data(rcc, SPICE_MSG_DISPLAY_STREAM_DATA, NULL);
@@ -7811,8 +10017,8 @@ static inline int red_marshall_stream_data(RedChannelClient *rcc,
         stream_data.base.id = get_stream_id(worker, stream);
         stream_data.base.multi_media_time = frame_mm_time;
         stream_data.data_size = n;
-        stream_data.width = width;
-        stream_data.height = height;
+        stream_data.width = enc_width;
+        stream_data.height = enc_height;
         stream_data.dest = drawable->red_drawable->bbox;
 
         spice_debug("stream %d: sized frame: dest ==> ", stream_data.base.id);
@@ -7822,8 +10028,12 @@ static inline int red_marshall_stream_data(RedChannelClient *rcc,
     spice_marshaller_add_ref(base_marshaller,
                              dcc->send_data.stream_outbuf, n);
     agent->last_send_time = time_now;
+    agent->pacer_tokens -= n;
+    red_stream_agent_add_sent_frame(agent, drawable);
 #ifdef STREAM_STATS
-    agent->stats.num_frames_sent++;
+    if (!frame_part) {
+        agent->stats.num_frames_sent++;
+    }
     agent->stats.size_sent += n;
     agent->stats.end = frame_mm_time;
 #endif
@@ -7847,6 +10057,11 @@ static inline void marshall_qxl_drawable(RedChannelClient *rcc,
         red_marshall_qxl_drawable(display_channel->common.worker, rcc, m, dpi);
     else
         red_lossy_marshall_qxl_drawable(display_channel->common.worker, rcc, m, dpi);
+    if (item->stream_overlay) {
+        // the client drew it over a video frame, see red_stream_overlay_fits
+        surface_lossy_region_update(display_channel->common.worker, RCC_TO_DCC(rcc), item,
+                                    FALSE, TRUE);
+    }
 }
 
 static inline void red_marshall_inval(RedChannelClient *rcc,
@@ -7995,6 +10210,74 @@ static void display_channel_marshall_reset_cache(RedChannelClient *rcc,
                                                  &wait);
 }
 
+/* Marshalls a reference to a tile that is already in the client's pixmap
+ * cache. Returns FALSE if the tile must be sent; when a lossless tile
+ * replaces a lossy one, red_image is flagged to replace it, like in
+ * fill_bits. */
+static int red_marshall_image_from_cache(DisplayChannelClient *dcc, SpiceMarshaller *m,
+                                         ImageItem *item, SpiceImage *red_image,
+                                         int *lossy_cache_item)
+{
+    DisplayChannel *display_channel = DCC_TO_DC(dcc);
+    SpiceMarshaller *bitmap_palette_out, *lzplt_palette_out;
+    SpiceImage image;
+
+    pthread_mutex_lock(&dcc->pixmap_cache->lock);
+    if (!dcc_pixmap_cache_unlocked_hit(dcc, item->cache_id, lossy_cache_item)) {
+        pthread_mutex_unlock(&dcc->pixmap_cache->lock);
+        stat_inc_counter(display_channel->tile_cache_misses_counter, 1);
+        return FALSE;
+    }
+    dcc->send_data.pixmap_cache_items[dcc->send_data.num_pixmap_cache_items++] =
+                                                                           item->cache_id;
+    if (*lossy_cache_item && !item->can_lossy) {
+        pixmap_cache_unlocked_set_lossy(dcc->pixmap_cache, item->cache_id, FALSE);
+        red_image->descriptor.id = item->cache_id;
+        red_image->descriptor.flags |= SPICE_IMAGE_FLAGS_CACHE_REPLACE_ME;
+        pthread_mutex_unlock(&dcc->pixmap_cache->lock);
+        stat_inc_counter(display_channel->tile_cache_misses_counter, 1);
+        return FALSE;
+    }
+    image.descriptor = red_image->descriptor;
+    image.descriptor.id = item->cache_id;
+    image.descriptor.flags = 0;
+    if (!display_channel->enable_jpeg || *lossy_cache_item) {
+        image.descriptor.type = SPICE_IMAGE_TYPE_FROM_CACHE;
+    } else {
+        image.descriptor.type = SPICE_IMAGE_TYPE_FROM_CACHE_LOSSLESS;
+    }
+    spice_marshall_Image(m, &image, &bitmap_palette_out, &lzplt_palette_out);
+    spice_assert(bitmap_palette_out == NULL);
+    spice_assert(lzplt_palette_out == NULL);
+    pthread_mutex_unlock(&dcc->pixmap_cache->lock);
+    stat_inc_counter(display_channel->tile_cache_hits_counter, 1);
+    return TRUE;
+}
+
+static void red_image_item_add_to_cache(DisplayChannelClient *dcc, ImageItem *item,
+                                        SpiceImage *red_image, int is_lossy)
+{
+    DisplayChannel *display_channel = DCC_TO_DC(dcc);
+    int lossy_cache_item;
+
+    pthread_mutex_lock(&dcc->pixmap_cache->lock);
+    /* already cached: a lossless tile replacing a lossy one was flagged by
+     * red_marshall_image_from_cache */
+    if (dcc_pixmap_cache_unlocked_hit(dcc, item->cache_id, &lossy_cache_item)) {
+        pthread_mutex_unlock(&dcc->pixmap_cache->lock);
+        return;
+    }
+    if (dcc_pixmap_cache_unlocked_add(dcc, item->cache_id, item->width * item->height,
+                                      is_lossy)) {
+        red_image->descriptor.id = item->cache_id;
+        red_image->descriptor.flags |= SPICE_IMAGE_FLAGS_CACHE_ME;
+        dcc->send_data.pixmap_cache_items[dcc->send_data.num_pixmap_cache_items++] =
+                                                                           item->cache_id;
+        stat_inc_counter(display_channel->add_to_cache_counter, 1);
+    }
+    pthread_mutex_unlock(&dcc->pixmap_cache->lock);
+}
+
 static void red_marshall_image(RedChannelClient *rcc, SpiceMarshaller *m, ImageItem *item)
 {
     DisplayChannelClient *dcc = RCC_TO_DCC(rcc);
@@ -8059,6 +10342,22 @@ static void red_marshall_image(RedChannelClient *rcc, SpiceMarshaller *m, ImageI
     spice_marshall_msg_display_draw_copy(m, &copy,
                                          &src_bitmap_out, &mask_bitmap_out);
 
+    surface_lossy_region = &dcc->surface_client_lossy_region[item->surface_id];
+    if (item->cache_id) {
+        int lossy_cache_item;
+
+        if (red_marshall_image_from_cache(dcc, src_bitmap_out, item, &red_image,
+                                          &lossy_cache_item)) {
+            if (lossy_cache_item) {
+                region_add(surface_lossy_region, &copy.base.box);
+            } else {
+                region_remove(surface_lossy_region, &copy.base.box);
+            }
+            spice_chunks_destroy(chunks);
+            return;
+        }
+    }
+
     compress_send_data_t comp_send_data = {0};
 
     comp_mode = display_channel->common.worker->image_compression;
@@ -8109,7 +10408,9 @@ static void red_marshall_image(RedChannelClient *rcc, SpiceMarshaller *m, ImageI
         }
     }
 
-    surface_lossy_region = &dcc->surface_client_lossy_region[item->surface_id];
+    if (item->cache_id) {
+        red_image_item_add_to_cache(dcc, item, &red_image, lossy_comp && comp_succeeded);
+    }
     if (comp_succeeded) {
         spice_marshall_Image(src_bitmap_out, &red_image,
                              &bitmap_palette_out, &lzplt_palette_out);
@@ -8213,6 +10514,8 @@ static void red_display_marshall_stream_clip(RedChannelClient *rcc,
 
     spice_assert(agent->stream);
 
+    /* the frames sent before may no longer be visible everywhere the clip shows */
+    red_stream_agent_reset_sent_frames(agent);
     red_channel_client_init_send_data(rcc, SPICE_MSG_DISPLAY_STREAM_CLIP, &item->base);
     SpiceMsgDisplayStreamClip stream_clip;
 
@@ -8394,9 +10697,15 @@ static void display_channel_send_item(RedChannelClient *rcc, PipeItem *pipe_item
 
 static inline void red_push(RedWorker *worker)
 {
+    DisplayChannelClient *dcc;
+    RingItem *link, *next;
+
     if (worker->cursor_channel) {
         red_channel_push(&worker->cursor_channel->common.base);
     }
+    WORKER_FOREACH_DCC_SAFE(worker, link, next, dcc) {
+        red_pipe_coalesce_small_drawables(worker, dcc);
+    }
     if (worker->display_channel) {
         red_channel_push(&worker->display_channel->common.base);
     }
@@ -8495,10 +10804,12 @@ static void display_channel_client_on_disconnect(RedChannelClient *rcc)
     red_display_reset_compress_buf(dcc);
     free(dcc->send_data.free_list.res);
     red_display_destroy_streams_agents(dcc);
+    region_destroy(&dcc->update_damage);
 
     // this was the last channel client
     if (!red_channel_is_connected(rcc->channel)) {
         red_display_destroy_compress_bufs(display_channel);
+        encoded_image_cache_clear(&display_channel->encoded_image_cache);
     }
     spice_debug("#draw=%d, #red_draw=%d, #glz_draw=%d",
                 worker->drawable_count, worker->red_drawable_count,
@@ -8531,6 +10842,8 @@ static void red_destroy_streams(RedWorker *worker)
 
 static void red_migrate_display(RedWorker *worker, RedChannelClient *rcc)
 {
+    DisplayChannelClient *dcc;
+
     /* We need to stop the streams, and to send upgrade_items to the client.
      * Otherwise, (1) the client might display lossy regions that we don't track
      * (streams are not part of the migration data) (2) streams_timeout may occur
@@ -8542,6 +10855,12 @@ static void red_migrate_display(RedWorker *worker, RedChannelClient *rcc)
      * handle_dev_stop already took care of releasing all the dev ram resources.
      */
     red_destroy_streams(worker);
+    /* for the same reason, the deferred updates are pushed now and no new
+     * ones are deferred */
+    dcc = RCC_TO_DCC(rcc);
+    dcc_flush_update_damage(dcc);
+    dcc->update_window_start = 0;
+    dcc->update_interval_ms = 0;
     if (red_channel_client_is_connected(rcc)) {
         red_channel_client_default_migrate(rcc);
     }
@@ -8961,6 +11280,64 @@ static GlzSharedDictionary *_red_create_glz_dictionary(RedClient *client, uint8_
     return shared_dict;
 }
 
+/* GLZ match finder geometry, see glz_enc_dictionary_set_hash. The client doesn't
+ * depend on it, so it is chosen per client: low bandwidth clients get longer hash
+ * chains, which compress better at the expense of encoding speed. The hash memory
+ * is the same for both. SPICE_GLZ_HASH=<size log>,<chain log> overrides it. */
+#define RED_GLZ_LOW_BANDWIDTH_HASH_SIZE_LOG 18
+#define RED_GLZ_LOW_BANDWIDTH_HASH_CHAIN_LOG 2
+
+/* SPICE_GLZ_HASH is a pair, unlike the knobs red_get_env_int reads.
+ * size_log is -1 when it is not set. */
+static void red_get_glz_hash(int *size_log, int *chain_log)
+{
+    char *env_hash_str, *end;
+    long env_size_log, env_chain_log = 0;
+
+    *size_log = -1;
+    *chain_log = 0;
+    env_hash_str = getenv("SPICE_GLZ_HASH");
+    if (env_hash_str == NULL) {
+        return;
+    }
+    errno = 0;
+    env_size_log = strtol(env_hash_str, &end, 10);
+    if (errno == 0 && *end == ',') {
+        env_chain_log = strtol(end + 1, &end, 10);
+    }
+    if (errno != 0 || *end != '\0' || env_size_log < 0 || env_size_log > 30 ||
+        env_chain_log < 0 || env_chain_log > 30) {
+        spice_warning("error parsing SPICE_GLZ_HASH: %s", env_hash_str);
+        return;
+    }
+    spice_info("SPICE_GLZ_HASH=%ld,%ld", env_size_log, env_chain_log);
+    *size_log = env_size_log;
+    *chain_log = env_chain_log;
+}
+
+static void red_init_glz_dictionary_hash(DisplayChannelClient *dcc, GlzEncDictContext *glz_dict)
+{
+    RedWorker *worker = dcc->common.worker;
+    long size_log, chain_log;
+
+    if (worker->glz_hash_size_log >= 0) {
+        size_log = worker->glz_hash_size_log;
+        chain_log = worker->glz_hash_chain_log;
+    } else if (dcc->common.is_low_bandwidth) {
+        size_log = RED_GLZ_LOW_BANDWIDTH_HASH_SIZE_LOG;
+        chain_log = RED_GLZ_LOW_BANDWIDTH_HASH_CHAIN_LOG;
+    } else {
+        size_log = GLZ_ENC_DICT_HASH_SIZE_LOG_DEFAULT;
+        chain_log = 0;
+    }
+
+    if (!glz_enc_dictionary_set_hash(glz_dict, size_log, chain_log, &dcc->glz_data.usr)) {
+        spice_warning("invalid glz hash geometry 2^%ld x %d", size_log, 1 << chain_log);
+        return;
+    }
+    spice_debug("glz hash 2^%ld x %d", size_log, 1 << chain_log);
+}
+
 static GlzSharedDictionary *red_create_glz_dictionary(DisplayChannelClient *dcc,
                                                       uint8_t id, int window_size)
 {
@@ -8974,6 +11351,7 @@ static GlzSharedDictionary *red_create_glz_dictionary(DisplayChannelClient *dcc,
         spice_critical("failed creating lz dictionary");
         return NULL;
     }
+    red_init_glz_dictionary_hash(dcc, glz_dict);
     return _red_create_glz_dictionary(dcc->common.base.client, id, glz_dict);
 }
 
@@ -8987,6 +11365,7 @@ static GlzSharedDictionary *red_create_restored_glz_dictionary(DisplayChannelCli
         spice_critical("failed creating lz dictionary");
         return NULL;
     }
+    red_init_glz_dictionary_hash(dcc, glz_dict);
     return _red_create_glz_dictionary(dcc->common.base.client, id, glz_dict);
 }
 
@@ -9223,6 +11602,9 @@ static int display_channel_handle_migrate_data(RedChannelClient *rcc, uint32_t s
                                          PIPE_ITEM_TYPE_PIXMAP_RESET);
     }
 
+    // before restoring the dictionary, its hash depends on it
+    dcc->common.is_low_bandwidth = migrate_data->low_bandwidth_setting;
+
     if (display_channel_handle_migrate_glz_dictionary(dcc, migrate_data)) {
         dcc->glz = glz_encoder_create(dcc->common.id,
                                       dcc->glz_dict->dict, &dcc->glz_data.usr);
@@ -9233,8 +11615,6 @@ static int display_channel_handle_migrate_data(RedChannelClient *rcc, uint32_t s
         spice_critical("restoring global lz dictionary failed");
     }
 
-    dcc->common.is_low_bandwidth = migrate_data->low_bandwidth_setting;
-
     if (migrate_data->low_bandwidth_setting) {
         red_channel_client_ack_set_client_window(rcc, WIDE_CLIENT_ACK_WINDOW);
         if (dcc->common.worker->jpeg_state == SPICE_WAN_COMPRESSION_AUTO) {
@@ -9717,7 +12097,61 @@ static void display_channel_create(RedWorker *worker, int migrate)
                                                              "add_to_cache", TRUE);
     display_channel->non_cache_counter = stat_add_counter(display_channel->stat,
                                                           "non_cache", TRUE);
+    display_channel->deferred_drawables_counter = stat_add_counter(display_channel->stat,
+                                                                   "deferred_drawables", TRUE);
+    display_channel->damage_images_counter = stat_add_counter(display_channel->stat,
+                                                              "damage_images", TRUE);
+    display_channel->tile_cache_hits_counter = stat_add_counter(display_channel->stat,
+                                                                "tile_cache_hits", TRUE);
+    display_channel->tile_cache_misses_counter = stat_add_counter(display_channel->stat,
+                                                                  "tile_cache_misses", TRUE);
+    display_channel->coalesced_drawables_counter = stat_add_counter(display_channel->stat,
+                                                                    "coalesced_drawables",
+                                                                    TRUE);
+    display_channel->encoded_cache_hits_counter = stat_add_counter(display_channel->stat,
+                                                                   "encoded_cache_hits",
+                                                                   TRUE);
+    display_channel->encoded_cache_misses_counter = stat_add_counter(display_channel->stat,
+                                                                     "encoded_cache_misses",
+                                                                     TRUE);
+    display_channel->compress_bufs_alloc_counter = stat_add_counter(display_channel->stat,
+                                                                    "compress_bufs_alloc",
+                                                                    TRUE);
+    display_channel->compress_bufs_reuse_counter = stat_add_counter(display_channel->stat,
+                                                                    "compress_bufs_reuse",
+                                                                    TRUE);
+    display_channel->compress_bufs_trim_counter = stat_add_counter(display_channel->stat,
+                                                                   "compress_bufs_trim",
+                                                                   TRUE);
+    display_channel->codec_quic_counter = stat_add_counter(display_channel->stat,
+                                                           "codec_quic", TRUE);
+    display_channel->codec_lz_counter = stat_add_counter(display_channel->stat,
+                                                         "codec_lz", TRUE);
+    display_channel->codec_explore_counter = stat_add_counter(display_channel->stat,
+                                                              "codec_explore", TRUE);
+    display_channel->jpeg_quality_changes_counter = stat_add_counter(display_channel->stat,
+                                                                     "jpeg_quality_changes",
+                                                                     TRUE);
+    display_channel->content_cache_tagged_counter = stat_add_counter(display_channel->stat,
+                                                                     "content_cache_tagged",
+                                                                     TRUE);
+    display_channel->content_cache_hits_counter = stat_add_counter(display_channel->stat,
+                                                                   "content_cache_hits",
+                                                                   TRUE);
+    display_channel->zlib_glz_skipped_counter = stat_add_counter(display_channel->stat,
+                                                                 "zlib_glz_skipped", TRUE);
+    display_channel->zlib_glz_saved_bytes_counter = stat_add_counter(display_channel->stat,
+                                                                     "zlib_glz_saved_bytes",
+                                                                     TRUE);
+    display_channel->zlib_glz_cpu_us_counter = stat_add_counter(display_channel->stat,
+                                                                "zlib_glz_cpu_us", TRUE);
 #endif
+    encoded_image_cache_init(&display_channel->encoded_image_cache,
+                             red_get_env_int("SPICE_ENCODED_IMAGE_CACHE_SIZE", 0, INT64_MAX,
+                                             RED_ENCODED_IMAGE_CACHE_SIZE));
+    display_channel->content_cache.min_pixels =
+        red_get_env_int("SPICE_CONTENT_CACHE_MIN_PIXELS", 0, UINT32_MAX,
+                        RED_CONTENT_CACHE_MIN_PIXELS);
     stat_compress_init(&display_channel->lz_stat, lz_stat_name);
     stat_compress_init(&display_channel->glz_stat, glz_stat_name);
     stat_compress_init(&display_channel->quic_stat, quic_stat_name);
@@ -9725,6 +12159,13 @@ static void display_channel_create(RedWorker *worker, int migrate)
     stat_compress_init(&display_channel->zlib_glz_stat, zlib_stat_name);
     stat_compress_init(&display_channel->jpeg_alpha_stat, jpeg_alpha_stat_name);
     stat_compress_init(&display_channel->lz4_stat, lz4_stat_name);
+    stat_compress_init(&display_channel->estimate_stat, estimate_stat_name);
+    stat_compress_init(&display_channel->incompressible_stat, incompressible_stat_name);
+    stat_compress_init(&display_channel->content_hash_stat, content_hash_stat_name);
+#ifdef COMPRESS_STAT
+    display_channel->mispredicted_compressible = 0;
+    display_channel->mispredicted_incompressible = 0;
+#endif
 }
 
 static void guest_set_client_capabilities(RedWorker *worker)
@@ -9777,6 +12218,16 @@ static void guest_set_client_capabilities(RedWorker *worker)
     worker->set_client_capabilities_pending = 0;
 }
 
+static uint32_t red_display_get_update_interval(DisplayChannelClient *dcc)
+{
+    RedWorker *worker = dcc->common.worker;
+
+    if (worker->display_update_interval_ms >= 0) {
+        return worker->display_update_interval_ms;
+    }
+    return dcc->common.is_low_bandwidth ? RED_DISPLAY_LOW_BANDWIDTH_UPDATE_INTERVAL : 0;
+}
+
 static void handle_new_display_channel(RedWorker *worker, RedClient *client, RedsStream *stream,
                                        int migrate,
                                        uint32_t *common_caps, int num_common_caps,
@@ -9816,8 +12267,9 @@ static void handle_new_display_channel(RedWorker *worker, RedClient *client, Red
         display_channel->enable_jpeg = (worker->jpeg_state == SPICE_WAN_COMPRESSION_ALWAYS);
     }
 
-    // todo: tune quality according to bandwidth
+    // tuned per client by the adaptive codec selection
     display_channel->jpeg_quality = 85;
+    red_codec_selector_init(dcc);
 
     if (worker->zlib_glz_state == SPICE_WAN_COMPRESSION_AUTO) {
         display_channel->enable_zlib_glz_wrap = dcc->common.is_low_bandwidth;
@@ -9831,9 +12283,15 @@ static void handle_new_display_channel(RedWorker *worker, RedClient *client, Red
 
     guest_set_client_capabilities(worker);
 
-    // todo: tune level according to bandwidth
+    // starting level, tuned per client by the zlib level selection
     display_channel->zlib_level = ZLIB_DEFAULT_COMPRESSION_LEVEL;
+    red_zlib_selector_init(dcc);
     red_display_client_init_streams(dcc);
+
+    region_init(&dcc->update_damage);
+    dcc->update_interval_ms = red_display_get_update_interval(dcc);
+    spice_debug("update rate cap %s (%u ms)", dcc->update_interval_ms ? "enabled" : "disabled",
+                dcc->update_interval_ms);
     on_new_display_channel_client(dcc);
 }
 
@@ -10422,7 +12880,13 @@ void handle_dev_reset_cursor(void *opaque, void *payload)
 
 void handle_dev_reset_image_cache(void *opaque, void *payload)
 {
-    image_cache_reset(&((RedWorker *)opaque)->image_cache);
+    RedWorker *worker = opaque;
+
+    image_cache_reset(&worker->image_cache);
+    // the guest may reuse the image ids
+    if (worker->display_channel) {
+        encoded_image_cache_clear(&worker->display_channel->encoded_image_cache);
+    }
 }
 
 void handle_dev_destroy_surface_wait_async(void *opaque, void *payload)
@@ -10964,6 +13428,46 @@ static void handle_dev_input(int fd, int event, void *opaque)
     dispatcher_handle_recv_read(red_dispatcher_get_dispatcher(worker->red_dispatcher));
 }
 
+/* SSE2 is the default: the AVX2 graduality scan measured slower than the
+ * SSE2 one on 1080p frames, so AVX2 has to be asked for explicitly */
+static const RedBitmapSimdOps *red_get_bitmap_simd_ops(void)
+{
+    char *env_simd_str;
+    RedBitmapSimdLevel max_level = RED_BITMAP_SIMD_SSE2;
+    const RedBitmapSimdOps *ops;
+
+    env_simd_str = getenv("SPICE_BITMAP_SIMD");
+    if (env_simd_str != NULL) {
+        if (strcmp(env_simd_str, "none") == 0) {
+            max_level = RED_BITMAP_SIMD_NONE;
+        } else if (strcmp(env_simd_str, "avx2") == 0) {
+            max_level = RED_BITMAP_SIMD_AVX2;
+        } else if (strcmp(env_simd_str, "sse2") != 0) {
+            spice_warning("error parsing SPICE_BITMAP_SIMD: %s", env_simd_str);
+        }
+    }
+    ops = red_bitmap_simd_get_ops(max_level);
+    spice_info("bitmap scans: %s", ops ? ops->name : "scalar");
+    return ops;
+}
+
+static uint32_t red_get_image_tile_size(void)
+{
+    uint32_t tile_size = red_get_env_int("SPICE_IMAGE_TILE_SIZE", 0, INT32_MAX, 0);
+
+    if (tile_size && tile_size < RED_IMAGE_TILE_MIN_SIZE) {
+        tile_size = RED_IMAGE_TILE_MIN_SIZE;
+    }
+    return tile_size;
+}
+
+static uint32_t red_get_stream_latency(void)
+{
+    uint32_t latency = red_get_env_int("SPICE_STREAM_LOW_LATENCY", 0, MM_TIME_DELTA, 0);
+
+    return latency ? MAX(latency, RED_STREAM_MIN_LATENCY) : 0;
+}
+
 RedWorker* red_worker_new(QXLInstance *qxl, RedDispatcher *red_dispatcher)
 {
     QXLDevInitInfo init_info;
@@ -11006,6 +13510,23 @@ RedWorker* red_worker_new(QXLInstance *qxl, RedDispatcher *red_dispatcher)
     worker->jpeg_state = jpeg_state;
     worker->zlib_glz_state = zlib_glz_state;
     worker->streaming_video = streaming_video;
+    worker->image_tile_size = red_get_image_tile_size();
+    stream_detector_init(&worker->stream_detector,
+                         red_get_env_int("SPICE_STREAM_DETECTOR_FRAMES", 0, INT_MAX,
+                                         RED_STREAM_DETECTOR_START_FRAMES),
+                         RED_STREAM_DETACTION_MAX_DELTA);
+    worker->stream_pacer_burst_ms = red_get_env_int("SPICE_STREAM_PACER_BURST", 0, 10000,
+                                                    RED_STREAM_PACER_BURST_MS);
+    worker->stream_latency_ms = red_get_stream_latency();
+    worker->stream_overlay_max_percent = red_get_env_int("SPICE_STREAM_OVERLAY_MAX", 0, 100,
+                                                         RED_STREAM_OVERLAY_MAX_PERCENT);
+    worker->bitmap_simd_ops = red_get_bitmap_simd_ops();
+    worker->zlib_cpu_budget = red_get_env_int("SPICE_ZLIB_CPU_BUDGET", 0, 100,
+                                              RED_ZLIB_CPU_BUDGET);
+    worker->adaptive_codec = red_get_env_int("SPICE_ADAPTIVE_CODEC", 0, 1, TRUE);
+    red_get_glz_hash(&worker->glz_hash_size_log, &worker->glz_hash_chain_log);
+    worker->display_update_interval_ms = red_get_env_int("SPICE_DISPLAY_UPDATE_INTERVAL",
+                                                         0, INT32_MAX, -1);
     worker->driver_cap_monitors_config = 0;
     ring_init(&worker->current_list);
     image_cache_init(&worker->image_cache);
@@ -11021,6 +13542,7 @@ RedWorker* red_worker_new(QXLInstance *qxl, RedDispatcher *red_dispatcher)
     worker->stat = stat_add_node(INVALID_STAT_REF, worker_str, TRUE);
     worker->wakeup_counter = stat_add_counter(worker->stat, "wakeups", TRUE);
     worker->command_counter = stat_add_counter(worker->stat, "commands", TRUE);
+    worker->merged_streams_counter = stat_add_counter(worker->stat, "merged_streams", TRUE);
 #endif
     for (i = 0; i < MAX_EVENT_SOURCES; i++) {
         worker->poll_fds[i].fd = -1;
@@ -11085,8 +13607,11 @@ SPICE_GNUC_NORETURN static void *red_worker_main(void *arg)
         worker->event_timeout = MIN(timeout, worker->event_timeout);
         timeout = red_get_streams_timout(worker);
         worker->event_timeout = MIN(timeout, worker->event_timeout);
+        timeout = red_get_display_update_timeout(worker);
+        worker->event_timeout = MIN(timeout, worker->event_timeout);
         num_events = poll(worker->poll_fds, MAX_EVENT_SOURCES, worker->event_timeout);
         red_handle_streams_timout(worker);
+        red_handle_display_update_timeout(worker);
         spice_timer_queue_cb();
 
         if (worker->display_channel) {
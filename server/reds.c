@@ -2885,6 +2885,11 @@ uint32_t reds_get_mm_time(void)
     return time_space.tv_sec * 1000 + time_space.tv_nsec / 1000 / 1000;
 }
 
+uint32_t reds_get_mm_time_latency(void)
+{
+    return reds->mm_time_latency;
+}
+
 void reds_enable_mm_time(void)
 {
     reds->mm_time_enabled = TRUE;
@@ -47,9 +47,16 @@ struct SpiceMigrateState {
 /* main thread only */
 void reds_handle_channel_event(int event, SpiceChannelEventInfo *info);
 
+/* the clients play the frames this long after their multimedia time, unless
+ * a stream needs more, see reds_set_client_mm_time_latency */
+#define MM_TIME_DELTA 400 /*ms*/
+
 void reds_disable_mm_time(void);
 void reds_enable_mm_time(void);
 uint32_t reds_get_mm_time(void);
+/* how far the multimedia time of the clients is behind reds_get_mm_time;
+ * also read by the worker threads */
+uint32_t reds_get_mm_time_latency(void);
 void reds_set_client_mouse_allowed(int is_client_mouse_allowed,
                                    int x_res, int y_res);
 void reds_register_channel(RedChannel *channel);
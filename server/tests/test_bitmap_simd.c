@@ -0,0 +1,279 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2015 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+/* Checks that the vectorized bitmap scans of red_bitmap_simd.c return the
+ * same results as the scalar code of red_worker.c and the jpeg encoders for
+ * every level the CPU supports. */
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <glib.h>
+
+#include "red_bitmap_simd.h"
+
+typedef struct {
+    uint8_t b;
+    uint8_t g;
+    uint8_t r;
+    uint8_t pad;
+} rgb32_pixel_t;
+
+typedef struct {
+    uint8_t b;
+    uint8_t g;
+    uint8_t r;
+} rgb24_pixel_t;
+
+typedef uint16_t rgb16_pixel_t;
+
+#define RED_BITMAP_UTILS_RGB16
+#include "red_bitmap_utils_tmpl.c"
+#define RED_BITMAP_UTILS_RGB24
+#include "red_bitmap_utils_tmpl.c"
+#define RED_BITMAP_UTILS_RGB32
+#include "red_bitmap_utils_tmpl.c"
+
+/* copy of red_worker.c */
+static int rgb32_data_has_alpha(int width, int height, size_t stride,
+                                uint8_t *data, int *all_set_out)
+{
+    uint32_t *line, *end, alpha;
+    int has_alpha;
+
+    has_alpha = FALSE;
+    while (height-- > 0) {
+        line = (uint32_t *)data;
+        end = line + width;
+        data += stride;
+        while (line != end) {
+            alpha = *line & 0xff000000U;
+            if (alpha != 0) {
+                has_alpha = TRUE;
+                if (alpha != 0xff000000U) {
+                    *all_set_out = FALSE;
+                    return TRUE;
+                }
+            }
+            line++;
+        }
+    }
+
+    *all_set_out = has_alpha;
+    return has_alpha;
+}
+
+/* copy of the 16bpp conversion of jpeg_encoder.c */
+static void convert_RGB16_to_BGRX32(const uint8_t *line, int width, uint8_t *out_pix)
+{
+    const uint16_t *src_line = (const uint16_t *)line;
+    int x;
+
+    for (x = 0; x < width; x++) {
+        uint16_t pixel = *src_line++;
+        *out_pix++ = ((pixel << 3) & 0xf8) | ((pixel >> 2) & 0x7);
+        *out_pix++ = ((pixel >> 2) & 0xf8) | ((pixel >> 7) & 0x7);
+        *out_pix++ = ((pixel >> 7) & 0xf8) | ((pixel >> 12) & 0x7);
+        *out_pix++ = 0;
+    }
+}
+
+/* copy of the downscaling of mjpeg_encoder.c */
+static void line_halve_bgrx(const uint8_t *line0, const uint8_t *line1, int width, uint8_t *dest)
+{
+    int x, c;
+
+    for (x = 0; x < width; x += 2) {
+        int right = x + 1 < width ? 4 : 0;
+
+        for (c = 0; c < 4; c++) {
+            *dest++ = (line0[c] + line0[right + c] + line1[c] + line1[right + c] + 2) >> 2;
+        }
+        line0 += 8;
+        line1 += 8;
+    }
+}
+
+#define MAX_WIDTH 97
+#define MAX_HEIGHT 33
+#define NUM_ITERATIONS 2000
+
+enum {
+    PATTERN_RANDOM,
+    PATTERN_FLAT,
+    PATTERN_GRADIENT,
+    PATTERN_NOISY_GRADIENT,
+    PATTERN_LAST,
+};
+
+static uint8_t bitmap[MAX_WIDTH * MAX_HEIGHT * 4];
+static int failures;
+
+static void fill_bitmap(int pattern, int size)
+{
+    int i;
+
+    for (i = 0; i < size; i++) {
+        switch (pattern) {
+        case PATTERN_RANDOM:
+            bitmap[i] = rand();
+            break;
+        case PATTERN_FLAT:
+            bitmap[i] = (i % 3) * 40;
+            break;
+        case PATTERN_GRADIENT:
+            bitmap[i] = i / 7;
+            break;
+        default:
+            bitmap[i] = i / 7 + rand() % 80;
+            break;
+        }
+    }
+}
+
+static void check_gradual(const RedBitmapSimdOps *ops, int width, int height)
+{
+    double score, simd_score;
+    int num_samples, simd_num_samples;
+
+    compute_lines_gradual_score_rgb16((rgb16_pixel_t *)bitmap, width, height,
+                                      &score, &num_samples);
+    ops->gradual_score_rgb16(bitmap, width, height, &simd_score, &simd_num_samples);
+    if (score != simd_score || num_samples != simd_num_samples) {
+        printf("%s rgb16 %dx%d: %f/%d != %f/%d\n", ops->name, width, height,
+               simd_score, simd_num_samples, score, num_samples);
+        failures++;
+    }
+
+    compute_lines_gradual_score_rgb24((rgb24_pixel_t *)bitmap, width, height,
+                                      &score, &num_samples);
+    ops->gradual_score_rgb24(bitmap, width, height, &simd_score, &simd_num_samples);
+    if (score != simd_score || num_samples != simd_num_samples) {
+        printf("%s rgb24 %dx%d: %f/%d != %f/%d\n", ops->name, width, height,
+               simd_score, simd_num_samples, score, num_samples);
+        failures++;
+    }
+
+    compute_lines_gradual_score_rgb32((rgb32_pixel_t *)bitmap, width, height,
+                                      &score, &num_samples);
+    ops->gradual_score_rgb32(bitmap, width, height, &simd_score, &simd_num_samples);
+    if (score != simd_score || num_samples != simd_num_samples) {
+        printf("%s rgb32 %dx%d: %f/%d != %f/%d\n", ops->name, width, height,
+               simd_score, simd_num_samples, score, num_samples);
+        failures++;
+    }
+}
+
+static void check_rgb16_to_bgrx(const RedBitmapSimdOps *ops, int width)
+{
+    uint8_t expected[MAX_WIDTH * 4 + 1], result[MAX_WIDTH * 4 + 1];
+
+    // the guard byte catches writes past the end of the line
+    expected[width * 4] = result[width * 4] = 0x5a;
+    convert_RGB16_to_BGRX32(bitmap, width, expected);
+    ops->rgb16_to_bgrx(bitmap, width, result);
+    if (memcmp(expected, result, width * 4 + 1) != 0) {
+        printf("%s rgb16 to bgrx %d: mismatch\n", ops->name, width);
+        failures++;
+    }
+}
+
+static void check_halve_bgrx(const RedBitmapSimdOps *ops, int width, int height)
+{
+    uint8_t expected[MAX_WIDTH * 2 + 4], result[MAX_WIDTH * 2 + 4];
+    int half_width = (width + 1) / 2;
+    const uint8_t *line1 = bitmap + (height > 1 ? width * 4 : 0);
+
+    expected[half_width * 4] = result[half_width * 4] = 0x5a;
+    line_halve_bgrx(bitmap, line1, width, expected);
+    ops->halve_bgrx(bitmap, line1, width, result);
+    if (memcmp(expected, result, half_width * 4 + 1) != 0) {
+        printf("%s halve bgrx %d: mismatch\n", ops->name, width);
+        failures++;
+    }
+}
+
+static void check_alpha(const RedBitmapSimdOps *ops, int width, int height)
+{
+    int i, alpha_mode;
+    int has_alpha, simd_has_alpha;
+    int all_set = -1, simd_all_set = -1;
+
+    alpha_mode = rand() % 4;
+    for (i = 3; i < width * height * 4; i += 4) {
+        switch (alpha_mode) {
+        case 0:
+            bitmap[i] = 0;
+            break;
+        case 1:
+            bitmap[i] = 0xff;
+            break;
+        case 2:
+            bitmap[i] = rand() % 2 ? 0xff : 0;
+            break;
+        default:
+            // mostly valid, with a rare partial alpha
+            bitmap[i] = rand() % 64 ? 0xff : rand();
+            break;
+        }
+    }
+
+    // stride equals the line size, so the bitmap is scanned as a whole
+    has_alpha = rgb32_data_has_alpha(width, height, width * 4, bitmap, &all_set);
+    simd_has_alpha = ops->rgb32_has_alpha(width, height, width * 4, bitmap, &simd_all_set);
+    if (has_alpha != simd_has_alpha || all_set != simd_all_set) {
+        printf("%s alpha %dx%d: %d/%d != %d/%d\n", ops->name, width, height,
+               simd_has_alpha, simd_all_set, has_alpha, all_set);
+        failures++;
+    }
+}
+
+int main(void)
+{
+    static const RedBitmapSimdLevel levels[] = {
+        RED_BITMAP_SIMD_SSE2,
+        RED_BITMAP_SIMD_AVX2,
+    };
+    const RedBitmapSimdOps *ops;
+    unsigned int i;
+    int iter, width, height;
+
+    srand(1);
+    for (i = 0; i < G_N_ELEMENTS(levels); i++) {
+        ops = red_bitmap_simd_get_ops(levels[i]);
+        if (ops == NULL) {
+            printf("simd level %d not supported\n", levels[i]);
+            continue;
+        }
+        printf("checking %s\n", ops->name);
+        for (iter = 0; iter < NUM_ITERATIONS; iter++) {
+            width = 1 + rand() % MAX_WIDTH;
+            height = 1 + rand() % MAX_HEIGHT;
+            fill_bitmap(iter % PATTERN_LAST, width * height * 4);
+            check_gradual(ops, width, height);
+            check_rgb16_to_bgrx(ops, width);
+            check_halve_bgrx(ops, width, height);
+            check_alpha(ops, width, height);
+        }
+    }
+
+    if (failures) {
+        printf("%d mismatches\n", failures);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,266 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2015 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+/* Measures how GLZ encoding scales when several encoders share one
+ * dictionary, like the display channels of a multi-monitor client, and
+ * the speed and ratio of the hash geometries of the match finder.
+ *
+ * usage: test_glz_bench [max_threads [images_per_thread]]
+ */
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <glib.h>
+
+#include "glz_encoder.h"
+
+#define IMAGE_WIDTH 512
+#define IMAGE_HEIGHT 256
+#define IMAGE_STRIDE (IMAGE_WIDTH * 4)
+#define NUM_BASE_IMAGES 16
+#define DICT_SIZE (1 << 24) // pixels
+#define OUT_BUF_SIZE (IMAGE_STRIDE * IMAGE_HEIGHT * 2)
+
+typedef struct BenchUsrContext {
+    GlzEncoderUsrContext usr;
+    GlzEncoderContext *encoder;
+    int id;
+    int num_images;
+    uint8_t *out_buf;
+    uint64_t in_bytes;
+    uint64_t out_bytes;
+} BenchUsrContext;
+
+static GlzEncDictContext *dict;
+static uint8_t *images[NUM_BASE_IMAGES];
+static pthread_barrier_t start_barrier;
+
+static SPICE_GNUC_PRINTF(2, 3) void bench_usr_error(GlzEncoderUsrContext *usr,
+                                                    const char *fmt, ...)
+{
+    va_list ap;
+
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+    abort();
+}
+
+static SPICE_GNUC_PRINTF(2, 3) void bench_usr_warn(GlzEncoderUsrContext *usr,
+                                                   const char *fmt, ...)
+{
+    va_list ap;
+
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+}
+
+static void *bench_usr_malloc(GlzEncoderUsrContext *usr, int size)
+{
+    return malloc(size);
+}
+
+static void bench_usr_free(GlzEncoderUsrContext *usr, void *ptr)
+{
+    free(ptr);
+}
+
+static int bench_usr_more_space(GlzEncoderUsrContext *usr, uint8_t **io_ptr)
+{
+    return 0;
+}
+
+static int bench_usr_more_lines(GlzEncoderUsrContext *usr, uint8_t **lines)
+{
+    return 0;
+}
+
+static void bench_usr_free_image(GlzEncoderUsrContext *usr, GlzUsrImageContext *image)
+{
+}
+
+/* text like content: runs of a few colors, with a small part that changes
+ * between the images so the dictionary finds matches in earlier images */
+static void init_images(void)
+{
+    uint32_t *pixels;
+    int i, x, y;
+
+    srand(1);
+    for (i = 0; i < NUM_BASE_IMAGES; i++) {
+        images[i] = malloc(IMAGE_STRIDE * IMAGE_HEIGHT);
+        pixels = (uint32_t *)images[i];
+        for (y = 0; y < IMAGE_HEIGHT; y++) {
+            for (x = 0; x < IMAGE_WIDTH; x++) {
+                if (((x / 6 + y / 12) % 5) == 0 || (y >= i * 8 && y < i * 8 + 8)) {
+                    pixels[x] = rand() % 4 * 0x00303030;
+                } else {
+                    pixels[x] = 0x00e0e0e0 - (x / 32) * 0x00010101;
+                }
+            }
+            pixels += IMAGE_WIDTH;
+        }
+    }
+}
+
+static uint64_t get_time_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void *encode_thread(void *opaque)
+{
+    BenchUsrContext *ctx = opaque;
+    GlzEncDictImageContext *dict_image;
+    uint8_t *image;
+    int i;
+
+    pthread_barrier_wait(&start_barrier);
+    for (i = 0; i < ctx->num_images; i++) {
+        image = images[(i + ctx->id) % NUM_BASE_IMAGES];
+        ctx->out_bytes += glz_encode(ctx->encoder, LZ_IMAGE_TYPE_RGB32,
+                                     IMAGE_WIDTH, IMAGE_HEIGHT, TRUE,
+                                     image, IMAGE_HEIGHT, IMAGE_STRIDE,
+                                     ctx->out_buf, OUT_BUF_SIZE, NULL, &dict_image);
+        ctx->in_bytes += IMAGE_STRIDE * IMAGE_HEIGHT;
+    }
+    return NULL;
+}
+
+static void init_usr(GlzEncoderUsrContext *usr)
+{
+    usr->error = bench_usr_error;
+    usr->warn = bench_usr_warn;
+    usr->info = bench_usr_warn;
+    usr->malloc = bench_usr_malloc;
+    usr->free = bench_usr_free;
+    usr->more_space = bench_usr_more_space;
+    usr->more_lines = bench_usr_more_lines;
+    usr->free_image = bench_usr_free_image;
+}
+
+static void run(int num_threads, int images_per_thread, BenchUsrContext *ctxs,
+                int hash_size_log, int hash_chain_log)
+{
+    pthread_t threads[num_threads];
+    GlzEncoderUsrContext usr;
+    uint64_t start, elapsed, in_bytes = 0, out_bytes = 0;
+    int i;
+
+    init_usr(&usr);
+    glz_enc_dictionary_reset(dict, &usr);
+    if (!glz_enc_dictionary_set_hash(dict, hash_size_log, hash_chain_log, &usr)) {
+        fprintf(stderr, "failed to set the hash geometry\n");
+        abort();
+    }
+    pthread_barrier_init(&start_barrier, NULL, num_threads + 1);
+    for (i = 0; i < num_threads; i++) {
+        ctxs[i].num_images = images_per_thread;
+        ctxs[i].in_bytes = 0;
+        ctxs[i].out_bytes = 0;
+        pthread_create(&threads[i], NULL, encode_thread, &ctxs[i]);
+    }
+
+    start = get_time_ns();
+    pthread_barrier_wait(&start_barrier);
+    for (i = 0; i < num_threads; i++) {
+        pthread_join(threads[i], NULL);
+        in_bytes += ctxs[i].in_bytes;
+        out_bytes += ctxs[i].out_bytes;
+    }
+    elapsed = get_time_ns() - start;
+    pthread_barrier_destroy(&start_barrier);
+
+    printf("%2d threads, hash 2^%-2d x %d: %8.1f MB/s ratio %5.2f\n", num_threads,
+           hash_size_log, 1 << hash_chain_log,
+           (double)in_bytes * 1000 / elapsed, (double)in_bytes / out_bytes);
+}
+
+static const struct {
+    int size_log;
+    int chain_log;
+} hash_geometries[] = {
+    {16, 0},
+    {18, 0},
+    {20, 0},
+    {18, 1},
+    {18, 2},
+    {20, 2},
+    {20, 3},
+};
+
+int main(int argc, char **argv)
+{
+    GlzEncoderUsrContext usr;
+    BenchUsrContext *ctxs;
+    int max_threads, images_per_thread;
+    int i;
+
+    max_threads = argc > 1 ? atoi(argv[1]) : sysconf(_SC_NPROCESSORS_ONLN);
+    images_per_thread = argc > 2 ? atoi(argv[2]) : 200;
+    if (max_threads <= 0 || max_threads > 255 || images_per_thread <= 0) {
+        fprintf(stderr, "usage: %s [max_threads [images_per_thread]]\n", argv[0]);
+        return 1;
+    }
+
+    init_images();
+    init_usr(&usr);
+    dict = glz_enc_dictionary_create(DICT_SIZE, max_threads, &usr);
+    if (!dict) {
+        fprintf(stderr, "failed to create the dictionary\n");
+        return 1;
+    }
+
+    ctxs = calloc(max_threads, sizeof(BenchUsrContext));
+    for (i = 0; i < max_threads; i++) {
+        init_usr(&ctxs[i].usr);
+        ctxs[i].id = i;
+        ctxs[i].out_buf = malloc(OUT_BUF_SIZE);
+        ctxs[i].encoder = glz_encoder_create(i, dict, &ctxs[i].usr);
+    }
+
+    for (i = 1; i <= max_threads; i *= 2) {
+        run(i, images_per_thread, ctxs, GLZ_ENC_DICT_HASH_SIZE_LOG_DEFAULT, 0);
+    }
+    if ((max_threads & (max_threads - 1)) != 0) {
+        run(max_threads, images_per_thread, ctxs, GLZ_ENC_DICT_HASH_SIZE_LOG_DEFAULT, 0);
+    }
+    for (i = 0; i < (int)G_N_ELEMENTS(hash_geometries); i++) {
+        run(1, images_per_thread, ctxs, hash_geometries[i].size_log,
+            hash_geometries[i].chain_log);
+    }
+
+    for (i = 0; i < max_threads; i++) {
+        glz_encoder_destroy(ctxs[i].encoder);
+        free(ctxs[i].out_buf);
+    }
+    free(ctxs);
+    glz_enc_dictionary_destroy(dict, &usr);
+    for (i = 0; i < NUM_BASE_IMAGES; i++) {
+        free(images[i]);
+    }
+    return 0;
+}
@@ -0,0 +1,561 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2015 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+/* Runs the mjpeg rate control against a simulated network, without a
+ * client, to evaluate changes to its constants reproducibly.
+ *
+ * The frames of a synthetic video, or of a raw file of 32bpp frames, are
+ * encoded by a real MJpegEncoder on a virtual clock, the way red_worker.c
+ * does: a frame still waiting in the pipe when the next one arrives is
+ * dropped and reported to the encoder, and frames are encoded when the
+ * socket has room. The socket drains at the bandwidth of the trace; frames
+ * reach the client half a roundtrip later, one more roundtrip later when
+ * they hit a loss. The client drops frames that arrive after their play
+ * time and sends stream reports like the spice-gtk one.
+ *
+ * A trace file has lines "start_ms bandwidth_kbps rtt_ms loss_percent",
+ * each line starts a segment; the last one lasts SEGMENT_TAIL_MS. The
+ * summary gives, per segment, the time the bit rate took to settle.
+ * Without a trace, the built-in scenarios are run and summarized.
+ *
+ * usage: test_mjpeg_rate_control_sim [trace|scenario [frames.raw width height]]
+ */
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <glib.h>
+
+#include "mjpeg_encoder.h"
+
+/* the values of red_worker.c and reds */
+#define CHANNEL_CAPACITY 0.8
+#define CLIENT_REPORT_WINDOW 5
+#define CLIENT_REPORT_TIMEOUT 1000
+#define START_LATENCY 400 // MM_TIME_DELTA
+
+#define SOURCE_FPS 25
+#define FRAME_WIDTH 640
+#define FRAME_HEIGHT 360
+#define SCENE_MS 20000 // the synthetic video alternates calm and busy scenes
+#define SOCKET_BUFFER (64 * 1024)
+#define SEGMENT_TAIL_MS 20000
+#define SETTLE_MS 5000
+#define SETTLE_MARGIN 0.1
+#define MAX_SEGMENTS 64
+#define MAX_IN_FLIGHT 256
+#define NSEC_PER_MSEC (1000 * 1000)
+
+typedef struct Segment {
+    uint32_t start_ms;
+    double bandwidth_kbps;
+    uint32_t rtt_ms;
+    double loss_percent;
+} Segment;
+
+typedef struct Scenario {
+    const char *name;
+    int num_segments;
+    Segment segments[4];
+} Scenario;
+
+static const Scenario scenarios[] = {
+    { "steady-5mbps", 1, { { 0, 5000, 20, 0 } } },
+    { "step-down-up", 3, { { 0, 10000, 20, 0 }, { 20000, 2000, 20, 0 }, { 40000, 10000, 20, 0 } } },
+    { "lossy-wan", 1, { { 0, 4000, 80, 2 } } },
+    { "low-bandwidth", 1, { { 0, 800, 60, 0 } } },
+    { "rtt-spike", 3, { { 0, 6000, 20, 0 }, { 15000, 6000, 300, 0 }, { 30000, 6000, 20, 0 } } },
+};
+
+typedef struct InFlight {
+    uint32_t mm_time;
+    uint32_t size;
+    uint32_t left;    // bytes still in the socket
+    uint64_t arrival; // ms, once they all left
+} InFlight;
+
+typedef struct Report {
+    uint64_t arrival;
+    uint32_t num_frames;
+    uint32_t num_drops;
+    uint32_t start_mm_time;
+    uint32_t end_mm_time;
+    int32_t end_delay;
+} Report;
+
+typedef struct Sim {
+    const Segment *segments;
+    int num_segments;
+    const Segment *segment;
+    uint32_t duration_ms;
+    uint64_t now; // ms
+    uint32_t latency;
+
+    MJpegEncoder *encoder;
+    uint8_t *frames;
+    int num_frames;
+    int synthetic;            // the frames are a calm then a busy second
+    int width;
+    int height;
+    int frame_index;
+    uint8_t *outbuf;
+    size_t outbuf_size;
+
+    int pipe_frame;           // waiting to be encoded, -1 for none
+    uint32_t pipe_mm_time;
+    InFlight in_flight[MAX_IN_FLIGHT];
+    int in_flight_head;
+    int num_in_flight;
+    uint64_t socket_bytes;
+    double drain_credit;
+
+    Report window;            // the report the client fills
+    uint64_t window_start;
+    Report reports[64];       // on their way to the server
+    int num_reports;
+
+    /* per second, and for the whole run */
+    uint32_t sec_frames_shown;
+    uint32_t sec_client_drops;
+    uint32_t sec_server_drops;
+    uint64_t sec_bytes;
+    uint32_t sec_encoded;
+    double sec_quality;
+    uint32_t total_shown;
+    uint32_t total_client_drops;
+    uint32_t total_server_drops;
+    uint64_t total_bytes;
+    double total_quality;
+    uint32_t total_encoded;
+    uint32_t settle_ms[MAX_SEGMENTS];
+    uint64_t last_bit_rate;
+    uint32_t stable_start;    // ms, since the bit rate stays about the same
+} Sim;
+
+static uint32_t sim_get_roundtrip_ms(void *opaque)
+{
+    Sim *sim = opaque;
+
+    return sim->segment->rtt_ms;
+}
+
+static uint32_t sim_get_source_fps(void *opaque)
+{
+    return SOURCE_FPS;
+}
+
+static void sim_update_client_playback_delay(void *opaque, uint32_t delay_ms)
+{
+    Sim *sim = opaque;
+
+    // like reds_set_client_mm_time_latency, the latency only grows
+    sim->latency = MAX(sim->latency, delay_ms);
+}
+
+static uint64_t sim_get_time(void *opaque)
+{
+    Sim *sim = opaque;
+
+    return sim->now * NSEC_PER_MSEC;
+}
+
+/* a calm scene is smooth gradients, a busy one has fine detail; both move */
+static void make_synthetic_frames(Sim *sim)
+{
+    int frame, x, y;
+
+    sim->width = FRAME_WIDTH;
+    sim->height = FRAME_HEIGHT;
+    sim->num_frames = 2 * SOURCE_FPS;
+    sim->synthetic = TRUE;
+    sim->frames = g_malloc(sim->num_frames * sim->width * sim->height * 4);
+    for (frame = 0; frame < sim->num_frames; frame++) {
+        int busy = frame >= SOURCE_FPS;
+        uint8_t *pixel = sim->frames + frame * sim->width * sim->height * 4;
+
+        for (y = 0; y < sim->height; y++) {
+            for (x = 0; x < sim->width; x++) {
+                int fx = x + frame * 4, fy = y + frame * 2;
+                int noise = busy ? (((fx * 7919) ^ (fy * 104729)) >> 3) % 96 : 0;
+
+                *pixel++ = (fx / 3 + noise) & 0xff;
+                *pixel++ = (fy / 2 + (busy ? (fx ^ fy) % 64 : 0)) & 0xff;
+                *pixel++ = ((fx + fy) / 4 + noise / 2) & 0xff;
+                *pixel++ = 0;
+            }
+        }
+    }
+}
+
+static int load_raw_frames(Sim *sim, const char *path, int width, int height)
+{
+    size_t frame_size = (size_t)width * height * 4;
+    gchar *data;
+    gsize len;
+
+    if (!g_file_get_contents(path, &data, &len, NULL) || len < frame_size) {
+        fprintf(stderr, "failed to read frames of %dx%d from %s\n", width, height, path);
+        return FALSE;
+    }
+    sim->frames = (uint8_t *)data;
+    sim->num_frames = len / frame_size;
+    sim->width = width;
+    sim->height = height;
+    return TRUE;
+}
+
+static int load_trace(const char *path, Segment *segments)
+{
+    FILE *f = fopen(path, "r");
+    char line[256];
+    int n = 0;
+
+    if (!f) {
+        return 0;
+    }
+    while (n < MAX_SEGMENTS && fgets(line, sizeof(line), f)) {
+        Segment *seg = &segments[n];
+
+        if (line[0] == '#' || line[0] == '\n') {
+            continue;
+        }
+        if (sscanf(line, "%u %lf %u %lf", &seg->start_ms, &seg->bandwidth_kbps,
+                   &seg->rtt_ms, &seg->loss_percent) != 4 ||
+            seg->bandwidth_kbps <= 0 || (n && seg->start_ms <= segments[n - 1].start_ms)) {
+            fprintf(stderr, "bad trace line: %s", line);
+            n = 0;
+            break;
+        }
+        n++;
+    }
+    fclose(f);
+    return n;
+}
+
+static void sim_encode_pipe_frame(Sim *sim)
+{
+    SpiceChunks *chunks;
+    SpiceBitmap bitmap;
+    SpiceRect src;
+    InFlight *frame;
+    int size, width, height, ret;
+
+    chunks = g_malloc0(sizeof(SpiceChunks) + sizeof(SpiceChunk));
+    chunks->num_chunks = 1;
+    chunks->data_size = sim->width * sim->height * 4;
+    chunks->chunk[0].data = sim->frames + (size_t)sim->pipe_frame * chunks->data_size;
+    chunks->chunk[0].len = chunks->data_size;
+    memset(&bitmap, 0, sizeof(bitmap));
+    bitmap.format = SPICE_BITMAP_FMT_32BIT;
+    bitmap.x = sim->width;
+    bitmap.y = sim->height;
+    bitmap.stride = sim->width * 4;
+    bitmap.data = chunks;
+    src.left = src.top = 0;
+    src.right = sim->width;
+    src.bottom = sim->height;
+
+    ret = mjpeg_encoder_encode_frame(sim->encoder, NULL, 0, &bitmap, sim->width, sim->height,
+                                     &src, TRUE, sim->pipe_mm_time,
+                                     &sim->outbuf, &sim->outbuf_size, &size, &width, &height);
+    g_free(chunks);
+    sim->pipe_frame = -1;
+    if (ret != MJPEG_ENCODER_FRAME_ENCODE_DONE || sim->num_in_flight == MAX_IN_FLIGHT) {
+        return;
+    }
+
+    frame = &sim->in_flight[(sim->in_flight_head + sim->num_in_flight++) % MAX_IN_FLIGHT];
+    frame->mm_time = sim->pipe_mm_time;
+    frame->size = frame->left = size;
+    frame->arrival = 0;
+    sim->socket_bytes += size;
+    sim->sec_encoded++;
+    sim->sec_bytes += size;
+}
+
+static void sim_send_report(Sim *sim)
+{
+    if (sim->num_reports < G_N_ELEMENTS(sim->reports)) {
+        sim->window.arrival = sim->now + sim->segment->rtt_ms / 2;
+        sim->reports[sim->num_reports++] = sim->window;
+    }
+    memset(&sim->window, 0, sizeof(sim->window));
+}
+
+static void sim_client_receive(Sim *sim, InFlight *frame)
+{
+    int32_t delay = (int64_t)frame->mm_time - ((int64_t)sim->now - sim->latency);
+
+    if (!sim->window.num_frames) {
+        sim->window.start_mm_time = frame->mm_time;
+        sim->window_start = sim->now;
+    }
+    sim->window.num_frames++;
+    sim->window.end_mm_time = frame->mm_time;
+    sim->window.end_delay = delay;
+    if (delay < 0) {
+        sim->window.num_drops++;
+        sim->sec_client_drops++;
+    } else {
+        sim->sec_frames_shown++;
+    }
+    if (sim->window.num_frames >= CLIENT_REPORT_WINDOW) {
+        sim_send_report(sim);
+    }
+}
+
+/* one millisecond of the network */
+static void sim_network_tick(Sim *sim)
+{
+    double bytes_per_ms = sim->segment->bandwidth_kbps * 1000 / 8 / 1000;
+    int i;
+
+    sim->drain_credit += bytes_per_ms;
+    for (i = 0; i < sim->num_in_flight && sim->drain_credit >= 1; i++) {
+        InFlight *frame = &sim->in_flight[(sim->in_flight_head + i) % MAX_IN_FLIGHT];
+        uint32_t sent;
+
+        if (!frame->left) {
+            continue;
+        }
+        sent = MIN(frame->left, (uint32_t)sim->drain_credit);
+        frame->left -= sent;
+        sim->drain_credit -= sent;
+        sim->socket_bytes -= sent;
+        if (!frame->left) {
+            frame->arrival = sim->now + sim->segment->rtt_ms / 2;
+            if (g_random_double() * 100 < sim->segment->loss_percent) {
+                frame->arrival += sim->segment->rtt_ms; // retransmitted
+            }
+        }
+    }
+    if (!sim->socket_bytes) {
+        sim->drain_credit = MIN(sim->drain_credit, bytes_per_ms);
+    }
+
+    // frames reach the client in order
+    while (sim->num_in_flight) {
+        InFlight *frame = &sim->in_flight[sim->in_flight_head];
+
+        if (frame->left || frame->arrival > sim->now) {
+            break;
+        }
+        sim_client_receive(sim, frame);
+        sim->in_flight_head = (sim->in_flight_head + 1) % MAX_IN_FLIGHT;
+        sim->num_in_flight--;
+    }
+    if (sim->window.num_frames && sim->now - sim->window_start >= CLIENT_REPORT_TIMEOUT) {
+        sim_send_report(sim);
+    }
+
+    for (i = 0; i < sim->num_reports; i++) {
+        Report *report = &sim->reports[i];
+
+        if (report->arrival > sim->now) {
+            continue;
+        }
+        mjpeg_encoder_client_stream_report(sim->encoder, report->num_frames, report->num_drops,
+                                           report->start_mm_time, report->end_mm_time,
+                                           report->end_delay, UINT32_MAX);
+        sim->reports[i--] = sim->reports[--sim->num_reports];
+    }
+}
+
+static void sim_end_second(Sim *sim, int verbose)
+{
+    MJpegEncoderStats stats;
+    double link_mbps = sim->segment->bandwidth_kbps / 1000;
+    double sent_mbps = sim->sec_bytes * 8 / 1000.0 / 1000;
+    double quality;
+    uint32_t stable_start;
+    int seg = sim->segment - sim->segments;
+
+    mjpeg_encoder_get_stats(sim->encoder, &stats);
+    quality = stats.avg_quality * (sim->total_encoded + sim->sec_encoded) -
+              sim->total_quality;
+    sim->sec_quality = sim->sec_encoded ? quality / sim->sec_encoded : 0;
+
+    /* settled once the bit rate stayed within SETTLE_MARGIN for SETTLE_MS
+     * without client drops */
+    if (sim->sec_client_drops ||
+        stats.cur_bit_rate > sim->last_bit_rate * (1 + SETTLE_MARGIN) ||
+        stats.cur_bit_rate < sim->last_bit_rate * (1 - SETTLE_MARGIN)) {
+        sim->stable_start = sim->now;
+        sim->last_bit_rate = stats.cur_bit_rate;
+    }
+    stable_start = MAX(sim->stable_start, sim->segment->start_ms);
+    if (sim->settle_ms[seg] == UINT32_MAX && sim->now - stable_start >= SETTLE_MS) {
+        sim->settle_ms[seg] = stable_start - sim->segment->start_ms;
+    }
+    if (verbose) {
+        printf("%5.0f %8.2f %5u %8.2f %8.2f %4u %6.1f %5u %5u %6u %7"PRIu64"\n",
+               sim->now / 1000.0, link_mbps, sim->segment->rtt_ms,
+               stats.cur_bit_rate / 1000.0 / 1000, sent_mbps,
+               sim->sec_frames_shown, sim->sec_quality,
+               sim->sec_client_drops, sim->sec_server_drops, sim->latency,
+               sim->socket_bytes);
+    }
+
+    sim->total_shown += sim->sec_frames_shown;
+    sim->total_client_drops += sim->sec_client_drops;
+    sim->total_server_drops += sim->sec_server_drops;
+    sim->total_bytes += sim->sec_bytes;
+    sim->total_quality += sim->sec_quality * sim->sec_encoded;
+    sim->total_encoded += sim->sec_encoded;
+    sim->sec_frames_shown = sim->sec_client_drops = sim->sec_server_drops = 0;
+    sim->sec_bytes = 0;
+    sim->sec_encoded = 0;
+}
+
+static void run(const char *name, const Segment *segments, int num_segments,
+                Sim *frames, int verbose)
+{
+    MJpegEncoderRateControlCbs cbs;
+    MJpegEncoderStats stats;
+    Sim sim;
+    double used = 0;
+    int i;
+
+    memset(&sim, 0, sizeof(sim));
+    sim.frames = frames->frames;
+    sim.num_frames = frames->num_frames;
+    sim.width = frames->width;
+    sim.height = frames->height;
+    sim.segments = segments;
+    sim.num_segments = num_segments;
+    sim.segment = segments;
+    sim.duration_ms = segments[num_segments - 1].start_ms + SEGMENT_TAIL_MS;
+    sim.latency = START_LATENCY;
+    sim.pipe_frame = -1;
+    for (i = 0; i < num_segments; i++) {
+        sim.settle_ms[i] = UINT32_MAX;
+    }
+    g_random_set_seed(1);
+
+    cbs.get_roundtrip_ms = sim_get_roundtrip_ms;
+    cbs.get_source_fps = sim_get_source_fps;
+    cbs.update_client_playback_delay = sim_update_client_playback_delay;
+    cbs.get_time = sim_get_time;
+    sim.encoder = mjpeg_encoder_new(CHANNEL_CAPACITY * segments[0].bandwidth_kbps * 1000,
+                                    &cbs, &sim);
+    mjpeg_encoder_enable_scaling(sim.encoder);
+
+    if (verbose) {
+        printf("%s\n    t link-Mbps   rtt rate-Mbps sent-Mbps  fps quality "
+               "c-drop s-drop latency socket\n", name);
+    }
+    for (sim.now = 1; sim.now <= sim.duration_ms; sim.now++) {
+        if (sim.segment + 1 < segments + num_segments && sim.segment[1].start_ms <= sim.now) {
+            sim.segment++;
+        }
+        if (sim.now % (1000 / SOURCE_FPS) == 0) {
+            if (sim.pipe_frame != -1) {
+                mjpeg_encoder_notify_server_frame_drop(sim.encoder);
+                sim.sec_server_drops++;
+            }
+            sim.pipe_mm_time = sim.now;
+            // the synthetic video changes scene every SCENE_MS
+            if (frames->synthetic) {
+                sim.pipe_frame = sim.frame_index % SOURCE_FPS +
+                                 (sim.now / SCENE_MS % 2) * SOURCE_FPS;
+            } else {
+                sim.pipe_frame = sim.frame_index % sim.num_frames;
+            }
+            sim.frame_index++;
+        }
+        if (sim.pipe_frame != -1 && sim.socket_bytes < SOCKET_BUFFER) {
+            sim_encode_pipe_frame(&sim);
+        }
+        sim_network_tick(&sim);
+        if (sim.now % 1000 == 0) {
+            sim_end_second(&sim, verbose);
+        }
+    }
+
+    for (i = 0; i < num_segments; i++) {
+        uint32_t end = i + 1 < num_segments ? segments[i + 1].start_ms : sim.duration_ms;
+
+        used += segments[i].bandwidth_kbps * 1000 / 8 * (end - segments[i].start_ms) / 1000;
+    }
+    printf("%-16s fps %5.1f quality %5.1f link-use %3.0f%% client-drops %4.1f%% "
+           "server-drops %4u latency %5u settle-ms",
+           name, sim.total_shown * 1000.0 / sim.duration_ms,
+           sim.total_encoded ? sim.total_quality / sim.total_encoded : 0,
+           100.0 * sim.total_bytes / used,
+           100.0 * sim.total_client_drops / MAX(1, sim.total_shown + sim.total_client_drops),
+           sim.total_server_drops, sim.latency);
+    for (i = 0; i < num_segments; i++) {
+        if (sim.settle_ms[i] == UINT32_MAX) {
+            printf(" -");
+        } else {
+            printf(" %u", sim.settle_ms[i]);
+        }
+    }
+    mjpeg_encoder_get_stats(sim.encoder, &stats);
+    printf(" evals %"PRIu64" eval-frames %"PRIu64" eval-cpu-ms %.1f\n",
+           stats.num_quality_evals, stats.num_eval_frames, stats.quality_eval_time / 1e6);
+
+    mjpeg_encoder_destroy(sim.encoder);
+    free(sim.outbuf);
+}
+
+int main(int argc, char **argv)
+{
+    Segment segments[MAX_SEGMENTS];
+    Sim frames;
+    unsigned int i;
+
+    if (argc != 1 && argc != 2 && argc != 5) {
+        fprintf(stderr, "usage: %s [trace|scenario [frames.raw width height]]\n", argv[0]);
+        return 1;
+    }
+
+    memset(&frames, 0, sizeof(frames));
+    if (argc == 5) {
+        if (!load_raw_frames(&frames, argv[2], atoi(argv[3]), atoi(argv[4]))) {
+            return 1;
+        }
+    } else {
+        make_synthetic_frames(&frames);
+    }
+
+    if (argc == 1) {
+        for (i = 0; i < G_N_ELEMENTS(scenarios); i++) {
+            run(scenarios[i].name, scenarios[i].segments, scenarios[i].num_segments,
+                &frames, FALSE);
+        }
+        g_free(frames.frames);
+        return 0;
+    }
+
+    for (i = 0; i < G_N_ELEMENTS(scenarios); i++) {
+        if (strcmp(argv[1], scenarios[i].name) == 0) {
+            run(scenarios[i].name, scenarios[i].segments, scenarios[i].num_segments,
+                &frames, TRUE);
+            g_free(frames.frames);
+            return 0;
+        }
+    }
+    i = load_trace(argv[1], segments);
+    if (!i) {
+        fprintf(stderr, "no scenario or trace %s\n", argv[1]);
+        return 1;
+    }
+    run(argv[1], segments, i, &frames, TRUE);
+    g_free(frames.frames);
+    return 0;
+}
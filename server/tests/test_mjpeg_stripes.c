@@ -0,0 +1,260 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2015 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+/* Checks that the frames mjpeg_encoder.c encodes in parallel stripes decode
+ * to the same pixels as the frames it encodes at once.
+ *
+ * The stripe pool is set up once per process from SPICE_MJPEG_THREADS, so the
+ * frames are encoded at once by a child process with SPICE_MJPEG_THREADS=1,
+ * which sends their decoded pixels to the parent through a pipe. */
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <jpeglib.h>
+#include <glib.h>
+
+#include "mjpeg_encoder.h"
+
+#define STRIPE_THREADS "4"
+
+typedef struct {
+    int width;
+    int height;
+} FrameSize;
+
+static const FrameSize frame_sizes[] = {
+    { 1920, 1080 },
+    { 1280, 720 },
+    { 1000, 777 },
+    { 333, 200 },
+};
+
+/* detailed content: gradients, edges and noise, so that every stripe has
+ * non trivial DC and AC coefficients */
+static uint8_t *make_frame(int width, int height)
+{
+    uint8_t *frame = g_malloc(width * height * 4);
+    uint32_t seed = 1;
+    int x, y;
+
+    for (y = 0; y < height; y++) {
+        for (x = 0; x < width; x++) {
+            uint8_t *pixel = frame + (y * width + x) * 4;
+
+            seed = seed * 1103515245 + 12345;
+            pixel[0] = x * 255 / width;
+            pixel[1] = ((x / 16 + y / 16) & 1) ? 200 : 40;
+            pixel[2] = (y * 255 / height) ^ ((seed >> 16) & 0x1f);
+            pixel[3] = 0;
+        }
+    }
+    return frame;
+}
+
+static uint8_t *encode_frame(int width, int height, size_t *jpeg_size)
+{
+    MJpegEncoder *encoder;
+    SpiceChunks *chunks;
+    SpiceBitmap bitmap;
+    SpiceRect src;
+    uint8_t *frame, *outbuf = NULL;
+    size_t outbuf_size = 0;
+    int size, enc_width, enc_height, ret;
+
+    // without rate control, every frame is encoded at the same quality
+    encoder = mjpeg_encoder_new(0, NULL, NULL);
+
+    frame = make_frame(width, height);
+    chunks = g_malloc0(sizeof(SpiceChunks) + sizeof(SpiceChunk));
+    chunks->num_chunks = 1;
+    chunks->data_size = width * height * 4;
+    chunks->chunk[0].data = frame;
+    chunks->chunk[0].len = chunks->data_size;
+    memset(&bitmap, 0, sizeof(bitmap));
+    bitmap.format = SPICE_BITMAP_FMT_32BIT;
+    bitmap.x = width;
+    bitmap.y = height;
+    bitmap.stride = width * 4;
+    bitmap.data = chunks;
+    src.left = src.top = 0;
+    src.right = width;
+    src.bottom = height;
+
+    ret = mjpeg_encoder_encode_frame(encoder, NULL, 0, &bitmap, width, height, &src, TRUE, 0,
+                                     &outbuf, &outbuf_size, &size, &enc_width, &enc_height);
+    g_free(chunks);
+    g_free(frame);
+    mjpeg_encoder_destroy(encoder);
+    if (ret != MJPEG_ENCODER_FRAME_ENCODE_DONE || enc_width != width || enc_height != height) {
+        printf("%dx%d: frame not encoded\n", width, height);
+        exit(1);
+    }
+    *jpeg_size = size;
+    return outbuf;
+}
+
+/* returns the decoded RGB pixels */
+static uint8_t *decode_frame(uint8_t *jpeg, size_t jpeg_size, int width, int height)
+{
+    struct jpeg_decompress_struct cinfo;
+    struct jpeg_error_mgr jerr;
+    uint8_t *pixels;
+    JSAMPROW row;
+
+    cinfo.err = jpeg_std_error(&jerr);
+    jpeg_create_decompress(&cinfo);
+    jpeg_mem_src(&cinfo, jpeg, jpeg_size);
+    jpeg_read_header(&cinfo, TRUE);
+    cinfo.out_color_space = JCS_RGB;
+    jpeg_start_decompress(&cinfo);
+    if (cinfo.output_width != width || cinfo.output_height != height) {
+        printf("%dx%d: decoded as %ux%u\n", width, height,
+               cinfo.output_width, cinfo.output_height);
+        exit(1);
+    }
+    pixels = g_malloc(width * height * 3);
+    while (cinfo.output_scanline < cinfo.output_height) {
+        row = pixels + cinfo.output_scanline * width * 3;
+        jpeg_read_scanlines(&cinfo, &row, 1);
+    }
+    jpeg_finish_decompress(&cinfo);
+    jpeg_destroy_decompress(&cinfo);
+    return pixels;
+}
+
+/* a frame encoded in stripes has a restart interval, see Stripe encoding in
+ * mjpeg_encoder.c */
+static int has_restart_interval(uint8_t *jpeg, size_t jpeg_size)
+{
+    size_t pos = 2;
+
+    while (pos + 4 <= jpeg_size && jpeg[pos] == 0xff && jpeg[pos + 1] != 0xda) {
+        if (jpeg[pos + 1] == 0xdd) {
+            return TRUE;
+        }
+        pos += 2 + ((jpeg[pos + 2] << 8) | jpeg[pos + 3]);
+    }
+    return FALSE;
+}
+
+static void run_reference(int fd)
+{
+    int i;
+
+    for (i = 0; i < G_N_ELEMENTS(frame_sizes); i++) {
+        int width = frame_sizes[i].width;
+        int height = frame_sizes[i].height;
+        size_t jpeg_size, size, done;
+        uint8_t *jpeg, *pixels;
+
+        jpeg = encode_frame(width, height, &jpeg_size);
+        pixels = decode_frame(jpeg, jpeg_size, width, height);
+        size = width * height * 3;
+        for (done = 0; done < size;) {
+            ssize_t n = write(fd, pixels + done, size - done);
+
+            if (n <= 0) {
+                exit(1);
+            }
+            done += n;
+        }
+        g_free(pixels);
+        free(jpeg);
+    }
+}
+
+static int read_all(int fd, uint8_t *buf, size_t size)
+{
+    size_t done;
+
+    for (done = 0; done < size;) {
+        ssize_t n = read(fd, buf + done, size - done);
+
+        if (n <= 0) {
+            return FALSE;
+        }
+        done += n;
+    }
+    return TRUE;
+}
+
+int main(void)
+{
+    int fds[2];
+    int status, failed = FALSE;
+    pid_t pid;
+    int i;
+
+    if (pipe(fds) < 0) {
+        perror("pipe");
+        return 1;
+    }
+    pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        return 1;
+    }
+    if (pid == 0) {
+        close(fds[0]);
+        setenv("SPICE_MJPEG_THREADS", "1", TRUE);
+        run_reference(fds[1]);
+        close(fds[1]);
+        exit(0);
+    }
+    close(fds[1]);
+    setenv("SPICE_MJPEG_THREADS", STRIPE_THREADS, TRUE);
+
+    for (i = 0; i < G_N_ELEMENTS(frame_sizes); i++) {
+        int width = frame_sizes[i].width;
+        int height = frame_sizes[i].height;
+        size_t jpeg_size, size;
+        uint8_t *jpeg, *pixels, *reference;
+
+        jpeg = encode_frame(width, height, &jpeg_size);
+        if (!has_restart_interval(jpeg, jpeg_size)) {
+            printf("%dx%d: not encoded in stripes\n", width, height);
+            failed = TRUE;
+        }
+        pixels = decode_frame(jpeg, jpeg_size, width, height);
+        size = width * height * 3;
+        reference = g_malloc(size);
+        if (!read_all(fds[0], reference, size)) {
+            printf("%dx%d: no reference frame\n", width, height);
+            return 1;
+        }
+        if (memcmp(pixels, reference, size) != 0) {
+            printf("%dx%d: stripes decode differently\n", width, height);
+            failed = TRUE;
+        } else {
+            printf("%dx%d: ok\n", width, height);
+        }
+        g_free(reference);
+        g_free(pixels);
+        free(jpeg);
+    }
+
+    close(fds[0]);
+    if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        printf("reference encoding failed\n");
+        failed = TRUE;
+    }
+    return failed;
+}
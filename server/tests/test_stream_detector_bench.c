@@ -0,0 +1,439 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2015 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+/* Compares the per drawable stream detection of red_worker.c with the one
+ * that adds the damage history of red_stream_detector.c, on the ways
+ * browsers paint video: as one rect, as tiles or stripes, as rects that
+ * vary from frame to frame, next to ui updates that should not be streamed.
+ *
+ * A recording of a browser playing a video, made with
+ * SPICE_WORKER_RECORD_FILENAME, can be given too. Its opaque copies to the
+ * primary surface are replayed at their mm_time and all count as video.
+ *
+ * usage: test_stream_detector_bench [recording]
+ */
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <glib.h>
+
+#include <spice/qxl_dev.h>
+#include "red_replay_qxl.h"
+#include "red_stream_detector.h"
+
+/* the values of red_worker.c */
+#define DETACTION_MAX_DELTA ((1000 * 1000 * 1000) / 5)
+#define STREAM_TIMEOUT (1000 * 1000 * 1000)
+#define FRAMES_START_CONDITION 20
+#define DETECTOR_START_FRAMES 5
+#define STREAM_MIN_SIZE (96 * 96)
+
+#define NSEC_PER_MSEC (1000 * 1000)
+#define TRACE_DURATION_MS 5000
+#define MAX_ITEMS 64
+#define MAX_STREAMS 16
+
+typedef struct Update {
+    red_time_t time;
+    SpiceRect rect;
+    int gradual;
+    int video;
+} Update;
+
+typedef struct Item {
+    SpiceRect rect;
+    red_time_t time;
+    int frames_count;
+} Item;
+
+typedef struct BenchStream {
+    SpiceRect dest;
+    red_time_t last_time;
+    int tiled;
+} BenchStream;
+
+typedef struct Model {
+    Item items[MAX_ITEMS];
+    int next_item;
+    BenchStream streams[MAX_STREAMS];
+    int num_streams;
+    StreamDetector detector;
+    int use_detector;
+
+    int streams_started;
+    red_time_t first_stream_time;
+    uint64_t video_pixels;
+    uint64_t streamed_video_pixels;
+    uint64_t streamed_other_pixels;
+} Model;
+
+static void set_rect(SpiceRect *rect, int left, int top, int right, int bottom)
+{
+    rect->left = left;
+    rect->top = top;
+    rect->right = right;
+    rect->bottom = bottom;
+}
+
+static void add_update(GArray *trace, red_time_t time, int left, int top,
+                       int right, int bottom, int gradual, int video)
+{
+    Update update;
+
+    update.time = time;
+    set_rect(&update.rect, left, top, right, bottom);
+    update.gradual = gradual;
+    update.video = video;
+    g_array_append_val(trace, update);
+}
+
+static gint update_cmp(gconstpointer a, gconstpointer b)
+{
+    const Update *u1 = a, *u2 = b;
+
+    return u1->time < u2->time ? -1 : u1->time > u2->time;
+}
+
+/* a 640x360 video at (100, 100), painted in cols x rows tiles */
+static void add_tiled_video(GArray *trace, int fps, int cols, int rows)
+{
+    red_time_t time;
+    int frame, x, y;
+
+    for (frame = 0; frame < TRACE_DURATION_MS * fps / 1000; frame++) {
+        time = (red_time_t)frame * 1000 * NSEC_PER_MSEC / fps;
+        for (y = 0; y < rows; y++) {
+            for (x = 0; x < cols; x++) {
+                add_update(trace, time + (y * cols + x) * 100 * 1000,
+                           100 + x * 640 / cols, 100 + y * 360 / rows,
+                           100 + (x + 1) * 640 / cols, 100 + (y + 1) * 360 / rows,
+                           TRUE, TRUE);
+            }
+        }
+    }
+}
+
+/* only the changed macroblock rows are painted, as two rects */
+static void add_varying_video(GArray *trace, int fps)
+{
+    red_time_t time;
+    int frame, top, bottom, split;
+
+    for (frame = 0; frame < TRACE_DURATION_MS * fps / 1000; frame++) {
+        time = (red_time_t)frame * 1000 * NSEC_PER_MSEC / fps;
+        top = rand() % 6 * 16;
+        bottom = 360 - rand() % 6 * 16;
+        split = top + 16 + rand() % ((bottom - top) / 16 - 1) * 16;
+        add_update(trace, time, 100, 100 + top, 740, 100 + split, TRUE, TRUE);
+        add_update(trace, time + 200 * 1000, 100, 100 + split, 740, 100 + bottom, TRUE, TRUE);
+    }
+}
+
+/* a blinking cursor, a clock, a short spinner animation and a page that is
+ * painted at once as 64x64 tiles */
+static void add_ui_noise(GArray *trace)
+{
+    red_time_t page_time = (red_time_t)3000 * NSEC_PER_MSEC;
+    int ms, x, y;
+
+    for (ms = 0; ms < TRACE_DURATION_MS; ms += 500) {
+        add_update(trace, (red_time_t)ms * NSEC_PER_MSEC, 900, 400, 902, 416, FALSE, FALSE);
+    }
+    for (ms = 0; ms < TRACE_DURATION_MS; ms += 1000) {
+        add_update(trace, (red_time_t)ms * NSEC_PER_MSEC, 1000, 10, 1200, 30, FALSE, FALSE);
+    }
+    for (ms = 2000; ms < 2500; ms += 100) {
+        add_update(trace, (red_time_t)ms * NSEC_PER_MSEC, 900, 500, 1000, 600, TRUE, FALSE);
+    }
+    for (y = 0; y < 768; y += 64) {
+        for (x = 0; x < 1280; x += 64) {
+            add_update(trace, page_time + (y / 64 * 20 + x / 64) * 50 * 1000,
+                       x, y, x + 64, y + 64, FALSE, FALSE);
+        }
+    }
+}
+
+static int legacy_is_next_frame(const BenchStream *stream, const SpiceRect *rect)
+{
+    if (stream->tiled) {
+        return rect_contains(&stream->dest, rect);
+    }
+    return rect_contains(rect, &stream->dest) &&
+           rect_get_area(rect) <= 2 * rect_get_area(&stream->dest);
+}
+
+static void model_start_stream(Model *model, const SpiceRect *dest, red_time_t time, int tiled)
+{
+    BenchStream *stream;
+
+    if (model->num_streams == MAX_STREAMS) {
+        return;
+    }
+    stream = &model->streams[model->num_streams++];
+    stream->dest = *dest;
+    stream->last_time = time;
+    stream->tiled = tiled;
+    if (!model->streams_started++) {
+        model->first_stream_time = time;
+    }
+}
+
+static int model_legacy_update(Model *model, const Update *update)
+{
+    Item *item = NULL;
+    int i;
+
+    for (i = 0; i < MAX_ITEMS; i++) {
+        if (rect_is_equal(&model->items[i].rect, &update->rect)) {
+            item = &model->items[i];
+            break;
+        }
+    }
+    if (!item) {
+        item = &model->items[model->next_item++ % MAX_ITEMS];
+        item->rect = update->rect;
+        item->frames_count = 0;
+    } else if (update->time - item->time > DETACTION_MAX_DELTA) {
+        item->frames_count = 0;
+    }
+    item->time = update->time;
+    if (++item->frames_count >= FRAMES_START_CONDITION &&
+        rect_get_area(&update->rect) >= STREAM_MIN_SIZE) {
+        model_start_stream(model, &update->rect, update->time, FALSE);
+        item->frames_count = 0;
+        return TRUE;
+    }
+    return FALSE;
+}
+
+static void model_update(Model *model, const Update *update)
+{
+    SpiceRect area;
+    int i, streamed = FALSE;
+
+    for (i = 0; i < model->num_streams; i++) {
+        BenchStream *stream = &model->streams[i];
+
+        if (update->time - stream->last_time > STREAM_TIMEOUT) {
+            *stream = model->streams[--model->num_streams];
+            i--;
+            continue;
+        }
+        if (legacy_is_next_frame(stream, &update->rect)) {
+            stream->last_time = update->time;
+            streamed = TRUE;
+            break;
+        }
+    }
+
+    if (!streamed) {
+        streamed = model_legacy_update(model, update);
+    }
+    if (!streamed && model->use_detector &&
+        stream_detector_add(&model->detector, &update->rect, update->time,
+                            update->gradual, STREAM_MIN_SIZE, &area)) {
+        model_start_stream(model, &area, update->time, !rect_is_equal(&area, &update->rect));
+        streamed = TRUE;
+    }
+
+    if (update->video) {
+        model->video_pixels += rect_get_area(&update->rect);
+        if (streamed) {
+            model->streamed_video_pixels += rect_get_area(&update->rect);
+        }
+    } else if (streamed) {
+        model->streamed_other_pixels += rect_get_area(&update->rect);
+    }
+}
+
+static void run_model(const char *name, GArray *trace, int use_detector)
+{
+    Model *model = g_new0(Model, 1);
+    guint i;
+
+    model->use_detector = use_detector;
+    stream_detector_init(&model->detector, DETECTOR_START_FRAMES, DETACTION_MAX_DELTA);
+    for (i = 0; i < trace->len; i++) {
+        model_update(model, &g_array_index(trace, Update, i));
+    }
+
+    printf("%-16s %-8s streams %3d first %6.0f ms video streamed %5.1f%% "
+           "other streamed %7"G_GUINT64_FORMAT" px\n",
+           name, use_detector ? "damage" : "legacy", model->streams_started,
+           model->streams_started ?
+               (double)(model->first_stream_time -
+                        g_array_index(trace, Update, 0).time) / NSEC_PER_MSEC : -1.0,
+           model->video_pixels ?
+               100.0 * model->streamed_video_pixels / model->video_pixels : 0.0,
+           model->streamed_other_pixels);
+    g_free(model);
+}
+
+static uint64_t get_time_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* the cost of the damage history, on updates that never become a stream */
+static void run_speed(GArray *trace)
+{
+    StreamDetector detector;
+    SpiceRect area;
+    uint64_t start, elapsed, num_updates = 0;
+    int iter;
+    guint i;
+
+    stream_detector_init(&detector, G_MAXINT, DETACTION_MAX_DELTA);
+    start = get_time_ns();
+    for (iter = 0; iter < 100; iter++) {
+        stream_detector_reset(&detector);
+        for (i = 0; i < trace->len; i++) {
+            Update *update = &g_array_index(trace, Update, i);
+            stream_detector_add(&detector, &update->rect, update->time,
+                                update->gradual, STREAM_MIN_SIZE, &area);
+        }
+        num_updates += trace->len;
+    }
+    elapsed = get_time_ns() - start;
+    printf("detector: %.1f ns per update\n", (double)elapsed / num_updates);
+}
+
+static void run_trace(const char *name, GArray *trace)
+{
+    g_array_sort(trace, update_cmp);
+    run_model(name, trace, FALSE);
+    run_model(name, trace, TRUE);
+}
+
+static void run_synthetic(void)
+{
+    static const struct {
+        const char *name;
+        int fps;
+        int cols;
+        int rows;
+        int varying;
+        int noise;
+    } traces[] = {
+        {"one rect", 30, 1, 1, FALSE, FALSE},
+        {"2x2 tiles", 30, 2, 2, FALSE, FALSE},
+        {"stripes", 25, 1, 6, FALSE, FALSE},
+        {"64px tiles", 24, 10, 6, FALSE, FALSE},
+        {"varying rects", 30, 0, 0, TRUE, FALSE},
+        {"tiles and ui", 30, 2, 2, FALSE, TRUE},
+        {"ui only", 0, 0, 0, FALSE, TRUE},
+    };
+    GArray *all = g_array_new(FALSE, FALSE, sizeof(Update));
+    unsigned int i;
+
+    srand(1);
+    for (i = 0; i < G_N_ELEMENTS(traces); i++) {
+        GArray *trace = g_array_new(FALSE, FALSE, sizeof(Update));
+
+        if (traces[i].varying) {
+            add_varying_video(trace, traces[i].fps);
+        } else if (traces[i].fps) {
+            add_tiled_video(trace, traces[i].fps, traces[i].cols, traces[i].rows);
+        }
+        if (traces[i].noise) {
+            add_ui_noise(trace);
+        }
+        run_trace(traces[i].name, trace);
+        g_array_append_vals(all, trace->data, trace->len);
+        g_array_free(trace, TRUE);
+    }
+    g_array_sort(all, update_cmp);
+    run_speed(all);
+    g_array_free(all, TRUE);
+}
+
+static void replay_create_primary(QXLWorker *worker, uint32_t surface_id,
+                                  QXLDevSurfaceCreate *surface)
+{
+}
+
+static void replay_destroy_primary(QXLWorker *worker, uint32_t surface_id)
+{
+}
+
+static void replay_destroy_surfaces(QXLWorker *worker)
+{
+}
+
+static int run_recording(const char *filename)
+{
+    QXLWorker worker = { 0, };
+    SpiceReplay *replay;
+    QXLCommandExt *cmd;
+    GArray *trace;
+    red_time_t time = 0;
+    FILE *file;
+
+    file = fopen(filename, "r");
+    if (!file) {
+        fprintf(stderr, "failed to open %s\n", filename);
+        return 1;
+    }
+    G_GNUC_BEGIN_IGNORE_DEPRECATIONS
+    worker.create_primary_surface = replay_create_primary;
+    worker.destroy_primary_surface = replay_destroy_primary;
+    worker.destroy_surfaces = replay_destroy_surfaces;
+    G_GNUC_END_IGNORE_DEPRECATIONS
+
+    trace = g_array_new(FALSE, FALSE, sizeof(Update));
+    replay = spice_replay_new(file, 1024);
+    while ((cmd = spice_replay_next_cmd(replay, &worker))) {
+        QXLDrawable *qxl = (QXLDrawable *)cmd->cmd.data;
+
+        if (cmd->cmd.type == QXL_CMD_DRAW && qxl->surface_id == 0 &&
+            qxl->type == QXL_DRAW_COPY && qxl->effect == QXL_EFFECT_OPAQUE) {
+            /* drawables without mm_time are taken as 1ms apart */
+            time = qxl->mm_time ? (red_time_t)qxl->mm_time * NSEC_PER_MSEC :
+                                  time + NSEC_PER_MSEC;
+            add_update(trace, time, qxl->bbox.left, qxl->bbox.top,
+                       qxl->bbox.right, qxl->bbox.bottom, TRUE, TRUE);
+        }
+        spice_replay_free_cmd(replay, cmd);
+    }
+    spice_replay_free(replay);
+    fclose(file);
+
+    if (trace->len) {
+        run_trace("recording", trace);
+    }
+    printf("recording: %u opaque copies to the primary surface\n", trace->len);
+    g_array_free(trace, TRUE);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc > 2) {
+        fprintf(stderr, "usage: %s [recording]\n", argv[0]);
+        return 1;
+    }
+    run_synthetic();
+    if (argc == 2) {
+        return run_recording(argv[1]);
+    }
+    return 0;
+}